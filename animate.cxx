@@ -53,7 +53,8 @@ void parseCmdLine(int argc, char ** argv)
 	}
 }
 
-float catmull_rom(float t, const float * P)
+// basis weights of a catmull-rom segment at t
+void catmull_rom_weights(float t, float * O)
 {
 	static const float C[4][4] = {
 		{-1.0, 3.0, -3.0, 1.0},
@@ -65,16 +66,21 @@ float catmull_rom(float t, const float * P)
 	float t2 = t*t;
 	float t3 = t2 * t;
 	float U[4] = {t3, t2, t, 1.0f};
-	float O[4] = {0.0f, 0.0f, 0.0f, 0.0f};
 	
 	for (int i = 0; i < 4; i++)
 	{
+		O[i] = 0.0f;
 		for (int j = 0; j < 4; j++)
 		{
 			O[i] += U[j] * .5f * C[j][i];
 		}
 	}
+}
 
+float catmull_rom(float t, const float * P)
+{
+	float O[4];
+	catmull_rom_weights(t, O);
 	return O[0]*P[0] + O[1]*P[1] + O[2]*P[2] + O[3]*P[3];
 }
 
@@ -97,11 +103,9 @@ bool writeXYZ(const char * filename, const Atoms & interpolated)
 		output << filename << "\n";
 		
 		// actual atoms
-		Atoms::const_iterator it = interpolated.begin();
-		for (unsigned int id = 1; it != interpolated.end(); it++, id++)
+		for (size_t i = 0; i < interpolated.size(); i++)
 		{
-			const Atom & atom = *it;
-			output << atom.atomType << '\t' << atom.x << ' ' << atom.y << ' ' << atom.z << '\n';  
+			output << lookUpElementSymbol(interpolated.element[i]) << '\t' << interpolated.x[i] << ' ' << interpolated.y[i] << ' ' << interpolated.z[i] << '\n';  
 		}
 		
 		output << flush;
@@ -125,23 +129,26 @@ void animate(
 	int ncores = omp_get_max_threads();  
 	omp_set_num_threads( ncores );
 		
-	unsigned int len = atoms1.size();
+	// weights are the same for every atom
+	float O[4];
+	catmull_rom_weights(t, O);
 	
-#pragma omp parallel for	
-	for (unsigned i = 0; i < len; i++)
+	const long len = atoms1.size();
+	const float * X[4] = {atoms1.x, atoms2.x, atoms3.x, atoms4.x};
+	const float * Y[4] = {atoms1.y, atoms2.y, atoms3.y, atoms4.y};
+	const float * Z[4] = {atoms1.z, atoms2.z, atoms3.z, atoms4.z};
+	float * xM = interpolated.x;
+	float * yM = interpolated.y;
+	float * zM = interpolated.z;
+	
+#pragma omp parallel for simd
+	for (long i = 0; i < len; i++)
 	{
-		const Atom & a1 = atoms1[i];
-		const Atom & a2 = atoms2[i];
-		const Atom & a3 = atoms3[i];
-		const Atom & a4 = atoms4[i];
-		Atom & aM = interpolated[i];
-				
-		aM.x = catmull_rom(t, a1.x, a2.x, a3.x, a4.x);
-		aM.y = catmull_rom(t, a1.y, a2.y, a3.y, a4.y);
-		aM.z = catmull_rom(t, a1.z, a2.z, a3.z, a4.z);
+		xM[i] = O[0]*X[0][i] + O[1]*X[1][i] + O[2]*X[2][i] + O[3]*X[3][i];
+		yM[i] = O[0]*Y[0][i] + O[1]*Y[1][i] + O[2]*Y[2][i] + O[3]*Y[3][i];
+		zM[i] = O[0]*Z[0][i] + O[1]*Z[1][i] + O[2]*Z[2][i] + O[3]*Z[3][i];
 	}
 }
-
 				
 // data sequence
 CubeSequence * sequence = NULL;
@@ -149,7 +156,6 @@ CubeSequence * sequence = NULL;
 
 int main(int argc, char ** argv)
 {
-	init_atom_data();
 	parseCmdLine(argc, argv);
 	cout << "ANIMATE" << endl;
 	cout << "\tWill expand: " << seqFile << " by " << expandCount << endl;
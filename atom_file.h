@@ -0,0 +1,86 @@
+/* -----------------------------------------------
+ * Super nanovol
+ * Khairi Reda, 2013
+ * Electronic Visualization Laboratory
+ * www.evl.uic.edu/kreda
+ *
+ * GPL v2 License:
+ * http://www.gnu.org/licenses/gpl-2.0.html
+ * atom_file.h
+ *
+ * Binary columnar atom file (.atoms). Layout:
+ *   AtomFileHeader
+ *   element ids	(uint8 per atom, see ElementId in atoms.h)
+ *   x, y, z		(one float column each)
+ *   block table	(version 2, optional)
+ * Every column starts at a multiple of ATOM_FILE_ALIGNMENT
+ * so the file can be used in place through mmap.
+ *
+ * Spatially sorted files (ATOM_FILE_MORTON_ORDER) store
+ * atoms along a Morton curve and come with a table of
+ * AtomFileBlocks: consecutive runs of atoms and their
+ * bounds, so that a region of interest can be loaded
+ * by reading only the blocks that intersect it.
+ * -----------------------------------------------
+ */
+
+#ifndef _ATOM_FILE_H___
+#define _ATOM_FILE_H___
+
+#include <stdint.h>
+
+static const char		ATOM_FILE_MAGIC[8]	= {'S', 'N', 'V', 'A', 'T', 'O', 'M', 'S'};
+static const uint32_t		ATOM_FILE_VERSION	= 2;
+static const uint32_t		ATOM_FILE_BYTE_ORDER	= 0x01020304;
+static const uint64_t		ATOM_FILE_ALIGNMENT	= 4096;
+
+struct AtomFileHeader
+{
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	byteOrder;		// ATOM_FILE_BYTE_ORDER as written by the producer
+	uint32_t	headerSize;		// sizeof(AtomFileHeader)
+	uint32_t	elementSize;		// bytes per element id
+
+	uint64_t	atomCount;
+
+	// bounds (including Van der Waals radius)
+	float		worldMin[3];
+	float		worldMax[3];
+
+	// byte offsets of the columns from the start of the file
+	uint64_t	elementOffset;
+	uint64_t	xOffset;
+	uint64_t	yOffset;
+	uint64_t	zOffset;
+
+	// version 2
+	uint32_t	flags;			// ATOM_FILE_* flags below
+	uint32_t	blockSize;		// atoms per block (the last block may be short)
+	uint64_t	blockCount;		// 0 if the file has no block table
+	uint64_t	blockOffset;
+};
+
+// size of the version 1 header (which ends at zOffset)
+static const uint32_t		ATOM_FILE_HEADER_V1_SIZE = 88;
+
+// flags
+static const uint32_t		ATOM_FILE_MORTON_ORDER	= 1;
+
+struct AtomFileBlock
+{
+	uint64_t	first;			// index of the first atom
+	uint64_t	count;
+
+	// bounds of the block's atoms (including Van der Waals radius)
+	float		min[3];
+	float		max[3];
+};
+
+// rounds offset up to the next column boundary
+inline uint64_t atom_file_align(uint64_t offset)
+{
+	return (offset + ATOM_FILE_ALIGNMENT - 1) & ~(ATOM_FILE_ALIGNMENT - 1);
+}
+
+#endif
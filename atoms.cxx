@@ -14,55 +14,354 @@
  */
 
 #include <iostream>
-#include <map>
+#include <cfloat>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __linux__
+#include <omp.h>
+#endif
 #include "atoms.h"
 
-// map containing atom data for a selection of atoms
-static map<string, AtomData> knownElements;
-static AtomData unknownElement;
+// element type of every ElementId
+static const char * elementSymbols[ELEMENT_COUNT] = {
+	"",		// ELEMENT_UNKNOWN
+	"h",
+	"o",
+	"o_bg",
+	"al",
+	"al_bg",
+	"c",
+	"si"
+};
 
-int get_atomic_number(const char * str)
+int lookUpElementId(string symbol)
 {
-	for (int i = 0; i < 119; i++)
+	std::transform(symbol.begin(), symbol.end(), symbol.begin(), ::tolower);
+	for (int i = 1; i < ELEMENT_COUNT; i++)
 	{
-		if (0 == strcasecmp(str, atom_table[i])) {
+		if (symbol == elementSymbols[i]) {
 			return i;
 		}
 	}
-	return -1;
+	return ELEMENT_UNKNOWN;
+}
+
+const char * lookUpElementSymbol(int elementId)
+{
+	if (elementId <= ELEMENT_UNKNOWN || elementId >= ELEMENT_COUNT) {
+		return elementSymbols[ELEMENT_UNKNOWN];
+	}
+	return elementSymbols[elementId];
+}
+
+/* -----------------------------------------------
+ * Atoms (structure of arrays)
+ * -----------------------------------------------
+ */
+static const size_t COLUMN_ALIGNMENT = 64;
+
+template<typename T>
+static T * alloc_column(size_t n)
+{
+	void * mem = NULL;
+	if (0 != posix_memalign(&mem, COLUMN_ALIGNMENT, max(n, (size_t) 1) * sizeof(T)))
+	{
+		cerr << "Could not allocate memory for " << n << " atoms!" << endl;
+		exit(1);
+	}
+	return (T *) mem;
+}
+
+Atoms::Atoms()
+{
+	x = y = z = radius = NULL;
+	element = NULL;
+	count = capacity = 0;
+	owned = true;
+}
+
+Atoms::Atoms(const Atoms & other)
+{
+	x = y = z = radius = NULL;
+	element = NULL;
+	count = capacity = 0;
+	owned = true;
+	*this = other;
+}
+
+Atoms::~Atoms()
+{
+	release();
+}
+
+Atoms & Atoms::operator=(const Atoms & other)
+{
+	if (this != &other)
+	{
+		release();
+		reallocate(other.count);
+		count = other.count;
+		memcpy(x, other.x, count * sizeof(float));
+		memcpy(y, other.y, count * sizeof(float));
+		memcpy(z, other.z, count * sizeof(float));
+		memcpy(radius, other.radius, count * sizeof(float));
+		memcpy(element, other.element, count);
+	}
+	return *this;
 }
 
-void init_atom_data()
+void Atoms::release()
 {
-	static bool inited = false;
-	if (inited) {
-		return;
+	if (owned)
+	{
+		free(x);
+		free(y);
+		free(z);
+		free(element);
 	}
+	free(radius);
 	
-	knownElements["h"]	=		AtomData(1.20, 0.37, get_atomic_number("h"	));
-	knownElements["o"]	=		AtomData(1.52, 0.73, get_atomic_number("o"	));
-	knownElements["o_bg"]	=		AtomData(1.52, 0.73, get_atomic_number("o"	), true);	// background O
-	knownElements["al"]	=		AtomData(2.10, 1.18, get_atomic_number("al"	));
-	knownElements["al_bg"]	=		AtomData(2.10, 1.18, get_atomic_number("al"	), true);	// background Al
-	knownElements["c"]	= 		AtomData(1.70, 0.77, get_atomic_number("c"	));
-	knownElements["si"]	=		AtomData(2.10, 1.11, get_atomic_number("si"	));
+	x = y = z = radius = NULL;
+	element = NULL;
+	count = capacity = 0;
+	owned = true;
+}
+
+void Atoms::reallocate(size_t newCapacity)
+{
+	float * nX = alloc_column<float>(newCapacity);
+	float * nY = alloc_column<float>(newCapacity);
+	float * nZ = alloc_column<float>(newCapacity);
+	float * nRadius = alloc_column<float>(newCapacity);
+	unsigned char * nElement = alloc_column<unsigned char>(newCapacity);
 	
-	inited = true;
+	const size_t keep = min(count, newCapacity);
+	if (keep > 0)
+	{
+		memcpy(nX, x, keep * sizeof(float));
+		memcpy(nY, y, keep * sizeof(float));
+		memcpy(nZ, z, keep * sizeof(float));
+		memcpy(nRadius, radius, keep * sizeof(float));
+		memcpy(nElement, element, keep);
+	}
+	
+	const size_t n = keep;
+	release();
+	
+	x = nX; y = nY; z = nZ;
+	radius = nRadius;
+	element = nElement;
+	count = n;
+	capacity = newCapacity;
+	owned = true;
 }
 
-const AtomData & lookUpAtom(string symbol)
+void Atoms::reserve(size_t n)
 {
-	std::transform(symbol.begin(), symbol.end(), symbol.begin(), ::tolower);
-	map<string, AtomData>::const_iterator it = knownElements.find(symbol);
+	if (n > capacity || !owned) {
+		reallocate(max(n, count));
+	}
+}
+
+void Atoms::resize(size_t n)
+{
+	reserve(n);
+	if (n > count)
+	{
+		memset(x + count, 0, (n - count) * sizeof(float));
+		memset(y + count, 0, (n - count) * sizeof(float));
+		memset(z + count, 0, (n - count) * sizeof(float));
+		memset(radius + count, 0, (n - count) * sizeof(float));
+		memset(element + count, ELEMENT_UNKNOWN, n - count);
+	}
+	count = n;
+}
+
+void Atoms::clear()
+{
+	release();
+}
+
+void Atoms::push_back(const Atom & anAtom)
+{
+	if (count == capacity || !owned) {
+		reallocate(max((size_t) 1024, 2 * capacity));
+	}
+	set(count++, anAtom);
+}
+
+void Atoms::append(const Atoms & other)
+{
+	const size_t n = other.count;
+	if (count + n > capacity || !owned) {
+		reallocate(max(count + n, 2 * capacity));
+	}
+	memcpy(x + count, other.x, n * sizeof(float));
+	memcpy(y + count, other.y, n * sizeof(float));
+	memcpy(z + count, other.z, n * sizeof(float));
+	memcpy(radius + count, other.radius, n * sizeof(float));
+	memcpy(element + count, other.element, n);
+	count += n;
+}
+
+void Atoms::wrap(size_t n, float * _x, float * _y, float * _z, unsigned char * _element)
+{
+	release();
 	
-	if (it == knownElements.end())
+	x = _x;
+	y = _y;
+	z = _z;
+	element = _element;
+	radius = alloc_column<float>(n);
+	count = capacity = n;
+	owned = false;
+	
+	updateRadii(0, n);
+}
+
+Atom Atoms::get(size_t i) const
+{
+	Atom anAtom;
+	anAtom.x = x[i];
+	anAtom.y = y[i];
+	anAtom.z = z[i];
+	anAtom.element = element[i];
+	return anAtom;
+}
+
+void Atoms::set(size_t i, const Atom & anAtom)
+{
+	x[i] = anAtom.x;
+	y[i] = anAtom.y;
+	z[i] = anAtom.z;
+	element[i] = (unsigned char) anAtom.element;
+	radius[i] = anAtom.radius();
+}
+
+void Atoms::updateRadii(size_t begin, size_t end)
+{
+	float radii[256];
+	for (int e = 0; e < 256; e++) {
+		radii[e] = ELEMENT_TABLE[e < ELEMENT_COUNT ? e : ELEMENT_UNKNOWN].vdw_radius;
+	}
+	
+	end = min(end, count);
+#ifdef __linux__
+#pragma omp parallel for simd
+#endif
+	for (long i = (long) begin; i < (long) end; i++) {
+		radius[i] = radii[ element[i] ];
+	}
+}
+
+void Atoms::extendBounds(vec3 & wMin, vec3 & wMax) const
+{
+	float minX = wMin.x(), minY = wMin.y(), minZ = wMin.z();
+	float maxX = wMax.x(), maxY = wMax.y(), maxZ = wMax.z();
+	const long n = (long) count;
+	
+#ifdef __linux__
+#pragma omp parallel for simd reduction(min: minX, minY, minZ) reduction(max: maxX, maxY, maxZ)
+#endif
+	for (long i = 0; i < n; i++)
 	{
-		return unknownElement;
+		const float r = radius[i];
+		minX = min(minX, x[i] - r);
+		minY = min(minY, y[i] - r);
+		minZ = min(minZ, z[i] - r);
+		maxX = max(maxX, x[i] + r);
+		maxY = max(maxY, y[i] + r);
+		maxZ = max(maxZ, z[i] + r);
 	}
-	else
+	
+	wMin = vec3(minX, minY, minZ);
+	wMax = vec3(maxX, maxY, maxZ);
+}
+
+void Atoms::permute(const vector<size_t> & order)
+{
+	Atoms permuted;
+	permuted.resize(order.size());
+	
+#ifdef __linux__
+#pragma omp parallel for
+#endif
+	for (long i = 0; i < (long) order.size(); i++)
 	{
-		return it->second;
+		const size_t j = order[i];
+		permuted.x[i] = x[j];
+		permuted.y[i] = y[j];
+		permuted.z[i] = z[j];
+		permuted.radius[i] = radius[j];
+		permuted.element[i] = element[j];
 	}
+	
+	// take over permuted's columns
+	release();
+	x = permuted.x;
+	y = permuted.y;
+	z = permuted.z;
+	radius = permuted.radius;
+	element = permuted.element;
+	count = permuted.count;
+	capacity = permuted.capacity;
+	owned = true;
+	
+	permuted.x = permuted.y = permuted.z = permuted.radius = NULL;
+	permuted.element = NULL;
+	permuted.count = permuted.capacity = 0;
 }
 
+/* -----------------------------------------------
+ * Morton order
+ * -----------------------------------------------
+ */
+
+// spreads the lower 21 bits of v so that there are two zero bits between each
+static inline uint64_t spread_bits(uint64_t v)
+{
+	v &= 0x1fffff;
+	v = (v | v << 32) & 0x1f00000000ffffULL;
+	v = (v | v << 16) & 0x1f0000ff0000ffULL;
+	v = (v | v << 8)  & 0x100f00f00f00f00fULL;
+	v = (v | v << 4)  & 0x10c30c30c30c30c3ULL;
+	v = (v | v << 2)  & 0x1249249249249249ULL;
+	return v;
+}
 
+uint64_t morton_encode(uint32_t x, uint32_t y, uint32_t z)
+{
+	return spread_bits(x) | (spread_bits(y) << 1) | (spread_bits(z) << 2);
+}
+
+void morton_order(const Atoms & atoms, const vec3 & wMin, const vec3 & wMax, vector<size_t> & order)
+{
+	static const float CELLS = float((1 << 21) - 1);
+	const long n = (long) atoms.size();
+	
+	const vec3 extent = wMax - wMin;
+	const float sx = extent.x() > 0.0f ? CELLS / extent.x() : 0.0f;
+	const float sy = extent.y() > 0.0f ? CELLS / extent.y() : 0.0f;
+	const float sz = extent.z() > 0.0f ? CELLS / extent.z() : 0.0f;
+	
+	// (key, atom) pairs; ties keep the original order
+	vector< pair<uint64_t, size_t> > keys(n);
+	
+#ifdef __linux__
+#pragma omp parallel for
+#endif
+	for (long i = 0; i < n; i++)
+	{
+		const float cx = min(max((atoms.x[i] - wMin.x()) * sx, 0.0f), CELLS);
+		const float cy = min(max((atoms.y[i] - wMin.y()) * sy, 0.0f), CELLS);
+		const float cz = min(max((atoms.z[i] - wMin.z()) * sz, 0.0f), CELLS);
+		keys[i] = make_pair( morton_encode(cx, cy, cz), (size_t) i );
+	}
+	
+	sort(keys.begin(), keys.end());
+	
+	order.resize(n);
+	for (long i = 0; i < n; i++) {
+		order[i] = keys[i].second;
+	}
+}
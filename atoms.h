@@ -21,6 +21,7 @@
 #include <map>
 #include <vector>
 #include <string.h>
+#include <stdint.h>
 #include "VectorT.hxx"
 
 static const int atom_count = 119;
@@ -35,24 +36,76 @@ static const char atom_table[119][4] = {"", "H", "He", "Li", "Be", "B", "C", "N"
   
 using namespace std;
 
+// compact ids for the element types we know about. These are stored in
+// binary atom files, so only ever append to this list
+enum ElementId
+{
+	ELEMENT_UNKNOWN = 0,
+	ELEMENT_H,
+	ELEMENT_O,
+	ELEMENT_O_BG,
+	ELEMENT_AL,
+	ELEMENT_AL_BG,
+	ELEMENT_C,
+	ELEMENT_SI,
+	
+	ELEMENT_COUNT
+};
+
+struct AtomData
+{
+	float vdw_radius;
+	float covalent_radius;
+	
+	int atomic_number;
+	int shader_index;			// index of atom data in the balls shader (-1: not renderable)
+	
+	bool background;			// background atoms (used in some datasets)
+	bool nonexisting;			// indicates that this is a non-valid entry (i.e. no such atom)
+	
+	constexpr AtomData():
+		vdw_radius(0.0f), covalent_radius(0.0f), atomic_number(-1), shader_index(-1),
+		background(false), nonexisting(true)
+	{}
+	
+	constexpr AtomData(float _vdw, float _covalent, int _atomic_number, int _shader_index, bool bg = false):
+		vdw_radius(_vdw), covalent_radius(_covalent), atomic_number(_atomic_number), shader_index(_shader_index),
+		background(bg), nonexisting(false)
+	{}
+};
+
+// atom data for every ElementId
+static constexpr AtomData ELEMENT_TABLE[ELEMENT_COUNT] = {
+	AtomData(),						// unknown
+	AtomData(1.20f, 0.37f,  1, -1),				// h
+	AtomData(1.52f, 0.73f,  8,  0),				// o
+	AtomData(1.52f, 0.73f,  8,  0, true),			// o_bg: background O
+	AtomData(2.10f, 1.18f, 13,  2),				// al
+	AtomData(2.10f, 1.18f, 13,  2, true),			// al_bg: background Al
+	AtomData(1.70f, 0.77f,  6,  4),				// c
+	AtomData(2.10f, 1.11f, 14,  1),				// si
+};
+
+inline const AtomData & lookUpElement(int elementId) { return ELEMENT_TABLE[elementId]; }
+
 // A single atom
 struct Atom
 {
 	float x;
 	float y;
 	float z;
-	float radius;
 	
-	// element type (one of the symbols in atom_table)
-	string atomType;
+	// element type (ElementId)
+	unsigned short element;
+	unsigned short reserved;
 	
-	Atom()
-	{
-		radius = 1.5;		// angstroms
-	}
+	Atom(): x(0.0f), y(0.0f), z(0.0f), element(ELEMENT_UNKNOWN), reserved(0) {}
 	
-	vec3 xyz_minus_rad() const	{ return vec3(x - radius, y - radius, z - radius); }
-	vec3 xyz_plus_rad() const	{ return vec3(x + radius, y + radius, z + radius); }
+	// Van der Waals radius
+	float radius() const		{ return ELEMENT_TABLE[element].vdw_radius; }
+	
+	vec3 xyz_minus_rad() const	{ const float r = radius(); return vec3(x - r, y - r, z - r); }
+	vec3 xyz_plus_rad() const	{ const float r = radius(); return vec3(x + r, y + r, z + r); }
 	vec3 xyz() const		{ return vec3(x, y, z); }
 };
 
@@ -60,42 +113,73 @@ struct Atom
 struct gpuAtom
 {
 	float x, y, z, index;
-	gpuAtom & operator=(const Atom & anAtom);
 } __attribute__((packed));
 
-// vector of atoms
-typedef vector<Atom>		Atoms;
-
-struct AtomData
+// All atoms of a time slice, stored as a structure of arrays. Every column is
+// 64-byte aligned. x/y/z/element are either owned, or wrap memory owned by 
+// someone else (e.g. a mapped .atoms file); radius is always owned and is
+// derived from element.
+class Atoms
 {
-	float vdw_radius;
-	float covalent_radius;
+public:
+	Atoms();
+	Atoms(const Atoms & other);
+	~Atoms();
+	Atoms & operator=(const Atoms & other);
 	
-	int atomic_number;
+	size_t size() const	{ return count; }
+	bool empty() const	{ return count == 0; }
 	
-	bool background;			// background atoms (used in some datasets)
-	bool nonexisting;			// indicates that this is a non-valid entry (i.e. no such atom)
+	void resize(size_t n);
+	void reserve(size_t n);
+	void clear();
+	void push_back(const Atom & anAtom);
+	void append(const Atoms & other);
+	
+	// serve atoms from external columns (must outlive this object)
+	void wrap(size_t n, float * _x, float * _y, float * _z, unsigned char * _element);
+	bool isWrapped() const	{ return count > 0 && !owned; }
+	
+	// single atom access
+	Atom get(size_t i) const;
+	void set(size_t i, const Atom & anAtom);
+	vec3 xyz(size_t i) const	{ return vec3(x[i], y[i], z[i]); }
 	
-	AtomData()
-	{
-		nonexisting = true;
-		atomic_number = -1;
-	}
-	
-	AtomData(float _vdw, float _covalent, int _atomic_number, bool bg = false)
-	{
-		vdw_radius = _vdw;
-		covalent_radius = _covalent;
-		atomic_number = _atomic_number;
-		
-		nonexisting = false;
-		background = bg;
-	}
+	// recompute radius column from element ids in [begin, end)
+	void updateRadii(size_t begin, size_t end);
+	
+	// grows [wMin, wMax] to include all atoms, taking Van der Waals radius into account
+	void extendBounds(vec3 & wMin, vec3 & wMax) const;
+	
+	// reorders atoms so that atom i becomes atoms[order[i]]
+	void permute(const vector<size_t> & order);
+	
+	// columns
+	float *			x;
+	float *			y;
+	float *			z;
+	float *			radius;
+	unsigned char *		element;		// ElementId
+	
+private:
+	void reallocate(size_t newCapacity);
+	void release();
+	
+	size_t			count;
+	size_t			capacity;
+	bool			owned;
 };
 
-void init_atom_data();
 static const char * lookUpAtomType(int atomic_number) { return atom_table[atomic_number]; }
-const AtomData & lookUpAtom(string symbol);
 
-#endif
+// 3D Morton (Z-order) code of a cell with 21 bit coordinates
+uint64_t morton_encode(uint32_t x, uint32_t y, uint32_t z);
+
+// order of atoms along a Morton curve through [wMin, wMax]
+void morton_order(const Atoms & atoms, const vec3 & wMin, const vec3 & wMax, vector<size_t> & order);
 
+// element type (e.g. "si", "al_bg") <-> ElementId
+int lookUpElementId(string symbol);
+const char * lookUpElementSymbol(int elementId);
+
+#endif
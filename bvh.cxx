@@ -0,0 +1,545 @@
+/* -----------------------------------------------
+ * Super nanovol
+ * Khairi Reda, 2013
+ * Electronic Visualization Laboratory
+ * www.evl.uic.edu/kreda
+ *
+ * GPL v2 License:
+ * http://www.gnu.org/licenses/gpl-2.0.html
+ * bvh.cxx
+ *
+ * -----------------------------------------------
+ */
+
+#include <float.h>
+#include <math.h>
+#include <algorithm>
+#include <iostream>
+#ifdef __linux__
+#include <omp.h>
+#endif
+#include "bvh.h"
+#include "Timer.h"
+
+static const int BVH_BINS		= 16;		// per axis
+static const unsigned int BVH_LEAF_MAX	= 8;		// atoms; larger ranges are always split
+static const int BVH_MAX_DEPTH		= 64;		// ranges this deep become leaves (traversal stack)
+static const size_t BVH_SUBTREE_MIN	= 1 << 12;	// atoms of the smallest subtree built by one thread
+
+// SAH weights, in units of one ray-sphere test
+static const double BVH_COST_NODE	= 1.0;		// box test
+static const double BVH_COST_ATOM	= 1.0;
+
+struct BuildSphere
+{
+	gpuAtom		atom;
+	float		r;
+};
+
+struct BuildBox
+{
+	float lo[3], hi[3];
+
+	void clear()
+	{
+		for (int a = 0; a < 3; a++)
+		{
+			lo[a] = FLT_MAX;
+			hi[a] = -FLT_MAX;
+		}
+	}
+	void grow(const gpuAtom & c, float r)
+	{
+		lo[0] = min(lo[0], c.x - r);	hi[0] = max(hi[0], c.x + r);
+		lo[1] = min(lo[1], c.y - r);	hi[1] = max(hi[1], c.y + r);
+		lo[2] = min(lo[2], c.z - r);	hi[2] = max(hi[2], c.z + r);
+	}
+	void grow(const BuildBox & b)
+	{
+		for (int a = 0; a < 3; a++)
+		{
+			lo[a] = min(lo[a], b.lo[a]);
+			hi[a] = max(hi[a], b.hi[a]);
+		}
+	}
+
+	// half the surface area (0 when empty)
+	float area() const
+	{
+		if (lo[0] > hi[0]) return 0.0f;
+		const float dx = hi[0] - lo[0], dy = hi[1] - lo[1], dz = hi[2] - lo[2];
+		return dx*dy + dy*dz + dz*dx;
+	}
+};
+
+struct BuildBin
+{
+	BuildBox	box;
+	BuildBox	centers;
+	size_t		count;
+
+	void clear() { box.clear(); centers.clear(); count = 0; }
+	void grow(const BuildBin & b) { box.grow(b.box); centers.grow(b.centers); count += b.count; }
+};
+
+// a node, the spheres [begin, end) it covers and their bounds
+struct BuildRange
+{
+	unsigned int	node;
+	size_t		begin, end;
+	int		depth;
+	BuildBox	box, centers;
+
+	BuildRange(unsigned int n, size_t b, size_t e, int d, const BuildBox & _box, const BuildBox & _centers): 
+		node(n), begin(b), end(e), depth(d), box(_box), centers(_centers) {}
+};
+
+static inline float center(const gpuAtom & a, int axis)
+{
+	return axis == 0 ? a.x : (axis == 1 ? a.y : a.z);
+}
+
+static inline int center_bin(const gpuAtom & a, int axis, float lo, float scale)
+{
+	return min(BVH_BINS - 1, int((center(a, axis) - lo) * scale));
+}
+
+// std::partition predicate: sphere goes left of the split
+struct LeftOfSplit
+{
+	int axis, bin;
+	float lo, scale;
+	bool operator()(const BuildSphere & s) const { return center_bin(s.atom, axis, lo, scale) < bin; }
+};
+
+// grows box and centers by the spheres [begin, end) and their centers
+static void grow_bounds(const BuildSphere * spheres, size_t begin, size_t end, BuildBox & box, BuildBox & centers)
+{
+	for (size_t i = begin; i < end; i++)
+	{
+		box.grow(spheres[i].atom, spheres[i].r);
+		centers.grow(spheres[i].atom, 0.0f);
+	}
+}
+
+// adds the spheres [begin, end) to the bins of every axis with a scale
+static void fill_bins(const BuildSphere * spheres, size_t begin, size_t end, const BuildBox & centers, const float scale[3], BuildBin bins[3][BVH_BINS])
+{
+	for (size_t i = begin; i < end; i++)
+	{
+		const BuildSphere & s = spheres[i];
+		for (int a = 0; a < 3; a++)
+		{
+			if (scale[a] == 0.0f) continue;
+			BuildBin & bin = bins[a][ center_bin(s.atom, a, centers.lo[a], scale[a]) ];
+			bin.box.grow(s.atom, s.r);
+			bin.centers.grow(s.atom, 0.0f);
+			bin.count++;
+		}
+	}
+}
+
+// this thread's share of [begin, end) in a parallel region (all of it outside)
+static void thread_share(size_t begin, size_t end, size_t & first, size_t & last)
+{
+	first = begin;
+	last = end;
+#ifdef __linux__
+	const size_t t = omp_get_thread_num(), threads = omp_get_num_threads();
+	first = begin + (end - begin) * t / threads;
+	last = begin + (end - begin) * (t + 1) / threads;
+#endif
+}
+
+// bounds of the spheres [begin, end) and of their centers, with all threads
+static void range_bounds(const vector<BuildSphere> & spheres, size_t begin, size_t end, BuildBox & box, BuildBox & centers)
+{
+	box.clear();
+	centers.clear();
+#ifdef __linux__
+#pragma omp parallel
+#endif
+	{
+		BuildBox myBox, myCenters;
+		myBox.clear();
+		myCenters.clear();
+		size_t first, last;
+		thread_share(begin, end, first, last);
+		grow_bounds(&spheres[0], first, last, myBox, myCenters);
+#ifdef __linux__
+#pragma omp critical
+#endif
+		{
+			box.grow(myBox);
+			centers.grow(myCenters);
+		}
+	}
+}
+
+// Finds the binned SAH split of spheres [begin, end) and partitions them around
+// it ([begin, mid) goes left), with the bounds of both sides. False if the range
+// is better off as a leaf. parallel bins with all threads (for the top levels: a
+// parallel region per node costs too much further down).
+static bool split_range(vector<BuildSphere> & spheres, size_t begin, size_t end, const BuildBox & box, const BuildBox & centers, 
+	bool parallel, size_t & mid, BuildBin & left, BuildBin & right)
+{
+	const size_t count = end - begin;
+	if (count <= 1) {
+		return false;
+	}
+
+	// bins over the centers' extent on each axis
+	float scale[3];
+	for (int a = 0; a < 3; a++)
+	{
+		const float extent = centers.hi[a] - centers.lo[a];
+		scale[a] = extent > 0.0f ? BVH_BINS / extent : 0.0f;
+	}
+
+	BuildBin bins[3][BVH_BINS];
+	for (int a = 0; a < 3; a++)
+		for (int k = 0; k < BVH_BINS; k++) {
+			bins[a][k].clear();
+		}
+
+	if (!parallel) {
+		fill_bins(&spheres[0], begin, end, centers, scale, bins);
+	}
+	else
+	{
+#ifdef __linux__
+#pragma omp parallel
+#endif
+		{
+			BuildBin myBins[3][BVH_BINS];
+			for (int a = 0; a < 3; a++)
+				for (int k = 0; k < BVH_BINS; k++) {
+					myBins[a][k].clear();
+				}
+			size_t first, last;
+			thread_share(begin, end, first, last);
+			fill_bins(&spheres[0], first, last, centers, scale, myBins);
+#ifdef __linux__
+#pragma omp critical
+#endif
+			for (int a = 0; a < 3; a++)
+				for (int k = 0; k < BVH_BINS; k++) {
+					bins[a][k].grow(myBins[a][k]);
+				}
+		}
+	}
+
+	// SAH of splitting in front of bin k, swept from both ends
+	double bestCost = DBL_MAX;
+	int bestAxis = -1, bestBin = 0;
+	for (int a = 0; a < 3; a++)
+	{
+		if (scale[a] == 0.0f) continue;
+
+		float rightArea[BVH_BINS];
+		size_t rightCount[BVH_BINS];
+		BuildBox sweep;
+		sweep.clear();
+		size_t n = 0;
+		for (int k = BVH_BINS - 1; k > 0; k--)
+		{
+			sweep.grow(bins[a][k].box);
+			n += bins[a][k].count;
+			rightArea[k] = sweep.area();
+			rightCount[k] = n;
+		}
+
+		sweep.clear();
+		n = 0;
+		for (int k = 1; k < BVH_BINS; k++)
+		{
+			sweep.grow(bins[a][k-1].box);
+			n += bins[a][k-1].count;
+			if (n == 0 || rightCount[k] == 0) continue;
+
+			const double cost = (double) sweep.area() * n + (double) rightArea[k] * rightCount[k];
+			if (cost < bestCost)
+			{
+				bestCost = cost;
+				bestAxis = a;
+				bestBin = k;
+			}
+		}
+	}
+
+	if (bestAxis < 0)
+	{
+		// all centers coincide: halve the range if it is too big for a leaf
+		if (count <= BVH_LEAF_MAX) {
+			return false;
+		}
+		mid = begin + count / 2;
+		left.clear();
+		right.clear();
+		grow_bounds(&spheres[0], begin, mid, left.box, left.centers);
+		grow_bounds(&spheres[0], mid, end, right.box, right.centers);
+		return true;
+	}
+
+	const double splitCost = BVH_COST_NODE + BVH_COST_ATOM * bestCost / max((double) box.area(), (double) FLT_MIN);
+	if (count <= BVH_LEAF_MAX && splitCost >= BVH_COST_ATOM * count) {
+		return false;
+	}
+
+	left.clear();
+	right.clear();
+	for (int k = 0; k < BVH_BINS; k++) {
+		(k < bestBin ? left : right).grow(bins[bestAxis][k]);
+	}
+
+	LeftOfSplit isLeft;
+	isLeft.axis = bestAxis;
+	isLeft.bin = bestBin;
+	isLeft.lo = centers.lo[bestAxis];
+	isLeft.scale = scale[bestAxis];
+	mid = partition(spheres.begin() + begin, spheres.begin() + end, isLeft) - spheres.begin();
+	return true;
+}
+
+static void set_node(BVHNode & node, const BuildBox & box, unsigned int first, unsigned int count)
+{
+	for (int a = 0; a < 3; a++)
+	{
+		node.lo[a] = box.lo[a];
+		node.hi[a] = box.hi[a];
+	}
+	node.first = first;
+	node.count = count;
+}
+
+// Builds the subtree of out[local] over range r on one thread; children are
+// appended to out
+static void build_subtree(vector<BuildSphere> & spheres, vector<BVHNode> & out, size_t local, const BuildRange & r)
+{
+	size_t mid;
+	BuildBin left, right;
+	if (r.depth >= BVH_MAX_DEPTH - 1 || !split_range(spheres, r.begin, r.end, r.box, r.centers, false, mid, left, right))
+	{
+		set_node(out[local], r.box, r.begin, r.end - r.begin);
+		return;
+	}
+
+	const size_t child = out.size();
+	out.resize(child + 2);
+	set_node(out[local], r.box, child, 0);
+	build_subtree(spheres, out, child, BuildRange(0, r.begin, mid, r.depth + 1, left.box, left.centers));
+	build_subtree(spheres, out, child + 1, BuildRange(0, mid, r.end, r.depth + 1, right.box, right.centers));
+}
+
+AtomBVH::AtomBVH(const Atoms & vAtoms, vec3 worldMin, float vpa, float atomScale)
+{
+	cout << "Building BVH..." << endl;
+	Timer total, timer;
+	total.start();
+
+	// spheres are sized like the traversal tests them (by shader index)
+	shaderRadii2(atomScale * vpa, radius2);
+
+	const size_t n = vAtoms.size();
+	vector<BuildSphere> spheres(n);
+#ifdef __linux__
+#pragma omp parallel for
+#endif
+	for (long i = 0; i < (long) n; i++)
+	{
+		BuildSphere & s = spheres[i];
+		s.atom.x = (vAtoms.x[i] - worldMin.x()) * vpa;
+		s.atom.y = (vAtoms.y[i] - worldMin.y()) * vpa;
+		s.atom.z = (vAtoms.z[i] - worldMin.z()) * vpa;
+		s.atom.index = lookUpElement( vAtoms.element[i] ).shader_index;
+		s.r = sqrt(radius2[ int(s.atom.index) ]);
+	}
+
+	/* ---------------------------------------------
+	 * The top levels are split one node at a time,
+	 * binning each node's atoms with all threads.
+	 * Once ranges are small enough, subtrees are
+	 * built by one thread each into their own node
+	 * arrays, which are spliced in afterwards
+	 * (children of a node are always adjacent and
+	 * after it). Spheres are partitioned in place,
+	 * so they end up in leaf order.
+	 * ---------------------------------------------
+	 */
+	int threads = 1;
+#ifdef __linux__
+	threads = omp_get_max_threads();
+#endif
+	const size_t subtreeSize = max(BVH_SUBTREE_MIN, n / (16 * threads));
+
+	timer.start();
+	nodes.resize(1);
+	BuildBox box, centers;
+	range_bounds(spheres, 0, n, box, centers);
+	vector<BuildRange> open, subtrees;
+	open.push_back(BuildRange(0, 0, n, 0, box, centers));
+	while (!open.empty())
+	{
+		const BuildRange r = open.back();
+		open.pop_back();
+		if (r.end - r.begin <= subtreeSize)
+		{
+			subtrees.push_back(r);
+			continue;
+		}
+
+		size_t mid;
+		BuildBin left, right;
+		if (r.depth >= BVH_MAX_DEPTH - 1 || !split_range(spheres, r.begin, r.end, r.box, r.centers, true, mid, left, right))
+		{
+			set_node(nodes[r.node], r.box, r.begin, r.end - r.begin);
+			continue;
+		}
+		const unsigned int child = nodes.size();
+		nodes.resize(child + 2);
+		set_node(nodes[r.node], r.box, child, 0);
+		open.push_back(BuildRange(child + 1, mid, r.end, r.depth + 1, right.box, right.centers));
+		open.push_back(BuildRange(child, r.begin, mid, r.depth + 1, left.box, left.centers));
+	}
+	stats.topTime = timer.getElapsedTimeInSec();
+
+	timer.start();
+	vector< vector<BVHNode> > parts(subtrees.size());
+#ifdef __linux__
+#pragma omp parallel for schedule(dynamic, 1)
+#endif
+	for (long s = 0; s < (long) subtrees.size(); s++)
+	{
+		parts[s].resize(1);
+		build_subtree(spheres, parts[s], 0, subtrees[s]);
+	}
+
+	// part node k > 0 lands at base + k - 1
+	for (size_t s = 0; s < subtrees.size(); s++)
+	{
+		vector<BVHNode> & part = parts[s];
+		const unsigned int base = nodes.size();
+		for (size_t k = 0; k < part.size(); k++)
+		{
+			if (part[k].count == 0) {
+				part[k].first += base - 1;
+			}
+		}
+		nodes[ subtrees[s].node ] = part[0];
+		nodes.insert(nodes.end(), part.begin() + 1, part.end());
+		vector<BVHNode>().swap(part);
+	}
+	nodes.shrink_to_fit();
+	stats.subtreeTime = timer.getElapsedTimeInSec();
+
+	atoms.resize(n);
+#ifdef __linux__
+#pragma omp parallel for
+#endif
+	for (long i = 0; i < (long) n; i++) {
+		atoms[i] = spheres[i].atom;
+	}
+	stats.totalTime = total.getElapsedTimeInSec();
+
+	// children come after their parents, so depths fill in front to back
+	vector<int> depth(nodes.size(), 0);
+	for (size_t i = 0; i < nodes.size(); i++)
+	{
+		stats.depth = max(stats.depth, depth[i]);
+		if (nodes[i].count > 0 || n == 0) {
+			stats.leaves++;
+		}
+		else {
+			depth[ nodes[i].first ] = depth[ nodes[i].first + 1 ] = depth[i] + 1;
+		}
+	}
+	stats.nodes = nodes.size();
+	stats.subtrees = subtrees.size();
+	stats.leafAtoms = stats.leaves > 0 ? double(n) / stats.leaves : 0.0;
+	stats.bytes = (uint64_t) nodes.size() * sizeof(BVHNode) + (uint64_t) atoms.size() * sizeof(gpuAtom);
+
+	cout << "\t nodes: " << stats.nodes << ", leaves: " << stats.leaves << " (" << stats.leafAtoms << " atoms / leaf), depth: " << stats.depth
+		<< ", " << stats.bytes / (1024.0 * 1024.0) << " MB" << endl;
+	cout << "\t top levels: " << stats.topTime << " sec, " << stats.subtrees << " subtrees: " << stats.subtreeTime
+		<< " sec, total: " << stats.totalTime << " sec" << endl;
+}
+
+// where the ray enters the node's box, if that is before T
+static inline bool hit_box(const BVHNode & node, const vec3f & origin, const vec3f & invRay, float T, float & tnear)
+{
+	float t0 = 0.0f, t1 = T;
+	for (int a = 0; a < 3; a++)
+	{
+		const float ta = (node.lo[a] - origin[a]) * invRay[a];
+		const float tb = (node.hi[a] - origin[a]) * invRay[a];
+		t0 = max(t0, min(ta, tb));
+		t1 = min(t1, max(ta, tb));
+	}
+	tnear = t0;
+	return t0 <= t1;
+}
+
+float AtomBVH::trace(const vec3f & origin, const vec3f & ray, TraversalStats & stats) const
+{
+	stats.rays++;
+
+	float T = TRAVERSAL_MISS, tnear;
+	const vec3f invRay(1.0f / ray.x(), 1.0f / ray.y(), 1.0f / ray.z());
+	if (atoms.empty() || !hit_box(nodes[0], origin, invRay, T, tnear)) {
+		return TRAVERSAL_MISS;
+	}
+
+	// far children still to visit, with where the ray enters them
+	unsigned int stack[BVH_MAX_DEPTH];
+	float stackT[BVH_MAX_DEPTH];
+	int top = 0;
+	unsigned int node = 0;
+
+	for (;;)
+	{
+		const BVHNode & n = nodes[node];
+		stats.nodesVisited++;
+
+		if (n.count > 0)
+		{
+			stats.atomsTested += n.count;
+			for (unsigned int i = n.first; i < n.first + n.count; i++) {
+				intersectSphere(atoms[i], radius2[ int(atoms[i].index) ], origin, ray, T);
+			}
+		}
+		else
+		{
+			float tl, tr;
+			const bool hitLeft = hit_box(nodes[n.first], origin, invRay, T, tl);
+			const bool hitRight = hit_box(nodes[n.first + 1], origin, invRay, T, tr);
+			if (hitLeft && hitRight)
+			{
+				// nearer child first
+				const bool leftFirst = tl <= tr;
+				stack[top] = leftFirst ? n.first + 1 : n.first;
+				stackT[top++] = leftFirst ? tr : tl;
+				node = leftFirst ? n.first : n.first + 1;
+				continue;
+			}
+			else if (hitLeft || hitRight)
+			{
+				node = hitLeft ? n.first : n.first + 1;
+				continue;
+			}
+		}
+
+		// next far child that is not behind the closest hit
+		while (top > 0 && stackT[top-1] > T) {
+			top--;
+		}
+		if (top == 0) {
+			break;
+		}
+		node = stack[--top];
+	}
+
+	if (T < TRAVERSAL_MISS) {
+		stats.hits++;
+	}
+	return T;
+}
@@ -0,0 +1,78 @@
+/* -----------------------------------------------
+ * Super nanovol
+ * Khairi Reda, 2013
+ * Electronic Visualization Laboratory
+ * www.evl.uic.edu/kreda
+ *
+ * GPL v2 License:
+ * http://www.gnu.org/licenses/gpl-2.0.html
+ * bvh.h
+ *
+ * Bounding volume hierarchy over atoms, as an
+ * alternative to the uniform macrocell grid for
+ * structures of very uneven density. Built on the
+ * CPU with binned SAH into one flat node array.
+ * Atoms are in the macrocells' grid space (1 unit =
+ * 1 / vpa angstrom), so both are traced with the
+ * same rays.
+ * -----------------------------------------------
+ */
+
+#ifndef _BVH_H___
+#define _BVH_H___
+
+#include <stdint.h>
+#include <vector>
+#include "traversal.h"
+
+// 32 bytes
+struct BVHNode
+{
+	float		lo[3];
+	unsigned int	first;		// leaf: first atom; inner: left child (the right child follows it)
+	float		hi[3];
+	unsigned int	count;		// atoms in a leaf, 0 for inner nodes
+};
+
+struct BVHStats
+{
+	size_t		nodes;
+	size_t		leaves;
+	int		depth;
+	double		leafAtoms;		// mean atoms per leaf
+	uint64_t	bytes;			// nodes and atoms
+	size_t		subtrees;		// built in parallel after the top levels
+	double		topTime;		// seconds, top levels (binning in parallel)
+	double		subtreeTime;		// subtrees (one per thread at a time)
+	double		totalTime;
+
+	BVHStats(): nodes(0), leaves(0), depth(0), leafAtoms(0.0), bytes(0), subtrees(0), topTime(0.0), subtreeTime(0.0), totalTime(0.0) {}
+};
+
+class AtomBVH
+{
+public:
+	// atoms relative to worldMin, scaled by vpa (grid space of Macrocells with
+	// the same parameters)
+	AtomBVH(const Atoms & vAtoms, vec3 worldMin, float vpa, float atomScale);
+
+	// T of the closest atom hit (TRAVERSAL_MISS if none); nearer children are
+	// visited first and subtrees behind the closest hit so far are skipped
+	float trace(const vec3f & origin, const vec3f & ray, TraversalStats & stats) const;
+
+	const vector<BVHNode> & getNodes() const { return nodes; }
+
+	// atoms in leaf order
+	const vector<gpuAtom> & getAtoms() const { return atoms; }
+	const BVHStats & getStats() const { return stats; }
+
+private:
+	vector<BVHNode>		nodes;
+	vector<gpuAtom>		atoms;
+
+	// squared radius (grid space) by shader index
+	float			radius2[8];
+	BVHStats		stats;
+};
+
+#endif
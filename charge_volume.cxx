@@ -18,11 +18,13 @@
 #include <iostream>
 #include <stdlib.h>
 #include <string.h>
+#include <vector>
 #ifdef __linux__
 #include <omp.h>
 #endif
 #include "rbf.h"
 #include "atoms.h"
+#include "atom_file.h"
 #include "charge_volume.h"
 
 using namespace std;
@@ -107,11 +109,10 @@ ChargeDensityVolume::ChargeDensityVolume(
 #endif
 	for(unsigned int i = 0; i < vAtoms.size(); i++)
 	{
-		const Atom & atom = vAtoms[i];
-		const AtomData & atomData = lookUpAtom( atom.atomType );
+		const AtomData & atomData = lookUpElement( vAtoms.element[i] );
 		
 		// subtract worldMin
-		vec3 wsAtom(atom.x, atom.y, atom.z);
+		vec3 wsAtom(vAtoms.x[i], vAtoms.y[i], vAtoms.z[i]);
 		wsAtom -= worldMin;
 		
 		// create RBF function (in angstrom (world) space)
@@ -228,10 +229,22 @@ ChargeDensityVolume::~ChargeDensityVolume()
 
 bool ChargeDensityVolume::save( const char * filename )
 {
-	unsigned int dimensions[3];
-	dimensions[0] = gridDim.x();
-	dimensions[1] = gridDim.y();
-	dimensions[2] = gridDim.z();
+	const uint64_t voxelCount = (uint64_t) gridDim.x() * gridDim.y() * gridDim.z();
+	
+	VolumeFileHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, VOLUME_FILE_MAGIC, sizeof(VOLUME_FILE_MAGIC));
+	header.version			= VOLUME_FILE_VERSION;
+	header.byteOrder		= VOLUME_FILE_BYTE_ORDER;
+	header.headerSize		= sizeof(VolumeFileHeader);
+	header.voxelsPerAngstrom	= voxelsPerAngstrom;
+	header.maxDensity		= maxDensity;
+	header.minDensity		= minDensity;
+	header.gridDim[0]		= gridDim.x();
+	header.gridDim[1]		= gridDim.y();
+	header.gridDim[2]		= gridDim.z();
+	header.voxelCount		= voxelCount;
+	header.voxelsOffset		= atom_file_align( sizeof(header) );
 	
 	// open file for writing
 	ofstream output(filename, ios::binary);
@@ -239,23 +252,75 @@ bool ChargeDensityVolume::save( const char * filename )
 		return false;
 	}
 	
-	// write header
-	output.write( (char*) &voxelsPerAngstrom, sizeof(float) );
-	output.write( (char*) dimensions, sizeof(unsigned int) * 3 );
-	output.write( (char*) &maxDensity, sizeof(float) );
-	output.write( (char*) &minDensity, sizeof(float) );
+	// write header and pad up to the voxels
+	vector<char> padding(header.voxelsOffset - sizeof(header), 0);
+	output.write( (char*) &header, sizeof(header) );
+	output.write( &padding[0], padding.size() );
 	
 	// write data
-	output.write( (char*) volume.data, sizeof(float) * gridDim.x() * gridDim.y() * gridDim.z() );
+	output.write( (char*) volume.data, sizeof(float) * voxelCount );
 	
 	output << flush;
+	const bool good = output.good();
 	output.close();
 	
-	return true;
+	return good;
 }
 
-
 bool ChargeDensityVolume::load( const char * filename )
+{
+	// mapped copy-on-write, so the volume can still be changed in memory
+	if (!volumeFile.open(filename, true)) {
+		return false;
+	}
+	
+	VolumeFileHeader header;
+	if (	volumeFile.size() < sizeof(header) ||
+		memcmp(volumeFile.data(), VOLUME_FILE_MAGIC, sizeof(VOLUME_FILE_MAGIC)) != 0
+	)
+	{
+		// original format
+		volumeFile.close();
+		return load_stream(filename);
+	}
+	memcpy(&header, volumeFile.data(), sizeof(header));
+	
+	if (header.version > VOLUME_FILE_VERSION || header.headerSize != sizeof(header))
+	{
+		cerr << "Unsupported volume file version " << header.version << endl;
+		volumeFile.close();
+		return false;
+	}
+	if (header.byteOrder != VOLUME_FILE_BYTE_ORDER)
+	{
+		cerr << "Volume file was written on a machine of different byte order" << endl;
+		volumeFile.close();
+		return false;
+	}
+	
+	voxelsPerAngstrom	= header.voxelsPerAngstrom;
+	maxDensity		= header.maxDensity;
+	minDensity		= header.minDensity;
+	gridDim			= vec3i(header.gridDim[0], header.gridDim[1], header.gridDim[2]);
+	
+	const uint64_t voxelCount = (uint64_t) gridDim.x() * gridDim.y() * gridDim.z();
+	if (header.voxelCount != voxelCount || header.voxelsOffset + voxelCount * sizeof(float) > volumeFile.size())
+	{
+		cerr << "Truncated volume file" << endl;
+		volumeFile.close();
+		return false;
+	}
+	
+	cout << "\t dimensions: " << gridDim.x() << " x " << gridDim.y() << " x " << gridDim.z() << endl;
+	cout << "\t volume size: " << ((voxelCount * sizeof(float) / 1024) / 1024) << " MB (mapped)" << endl;
+	cout << "\t VPA: " << voxelsPerAngstrom << endl;
+	cout << "\t max density: " << maxDensity << endl;
+	
+	volume.wrap( gridDim.x(), gridDim.y(), gridDim.z(), (float *) (volumeFile.writableData() + header.voxelsOffset) );
+	return true;
+}
+
+bool ChargeDensityVolume::load_stream( const char * filename )
 {
 	unsigned int dimensions[3];
 	
@@ -9,12 +9,20 @@
  * charge_volume.h
  * Based of the original nanovol:
  * https://svn.ci.uchicago.edu/svn/nanovol
+ *
+ * .volume file, version 2:
+ *   VolumeFileHeader
+ *   voxels		(float per voxel, x fastest, starting
+ *			 on a page boundary so the file can be
+ *			 used in place through mmap)
+ * Headerless files of the original format are still read.
  * -----------------------------------------------
  */
  
 #ifndef _CHARGE_VOLUME_H__
 #define _CHARGE_VOLUME_H__
 
+#include <stdint.h>
 #include <string>
 #include "VectorT.hxx"
 #include "data.h"
@@ -29,6 +37,27 @@ enum VOLUME_TYPE
 };
 static const VOLUME_TYPE defaultVolType = VOL_FLOAT;
 
+static const char		VOLUME_FILE_MAGIC[8]	= {'S', 'N', 'V', 'V', 'O', 'L', 'U', 'M'};
+static const uint32_t		VOLUME_FILE_VERSION	= 2;
+static const uint32_t		VOLUME_FILE_BYTE_ORDER	= 0x01020304;
+
+struct VolumeFileHeader
+{
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	byteOrder;		// VOLUME_FILE_BYTE_ORDER as written by the producer
+	uint32_t	headerSize;		// sizeof(VolumeFileHeader)
+	
+	float		voxelsPerAngstrom;
+	float		maxDensity;
+	float		minDensity;
+	uint32_t	gridDim[3];
+	uint32_t	reserved;
+	
+	uint64_t	voxelCount;
+	uint64_t	voxelsOffset;		// byte offset from the start of the file
+};
+
 class ChargeDensityVolume
 {
 public:	
@@ -70,6 +99,9 @@ public:
 	float getDensityScale() const { return (volType == VOL_UCHAR) ? maxDensity - minDensity : 1.0f; }
 	float getDensityOffset() const { return (volType == VOL_UCHAR) ? minDensity : 0.0f; }
 	
+	// CPU side voxels
+	const Grid3<float> & getVolume() const { return volume; }
+	
 	VOLUME_TYPE getVolumeType() const { return volType; }
 	void setVolumeType(VOLUME_TYPE _volType) { volType = _volType; }
 private:
@@ -77,6 +109,7 @@ private:
 	// private functions
 	bool save(const char *);
 	bool load(const char *);
+	bool load_stream(const char *);		// original format
 	
 	// size of volume
 	vec3i				gridDim;
@@ -90,6 +123,9 @@ private:
 	float				maxDensity;
 	float				minDensity;
 		
+	// file the volume points into (when loaded from a version 2 file)
+	MappedFile			volumeFile;
+	
 	// the actual volume
 	Grid3<float>			volume;
 	
@@ -0,0 +1,116 @@
+/* -----------------------------------------------
+ * Super nanovol
+ * Khairi Reda, 2013
+ * Electronic Visualization Laboratory
+ * www.evl.uic.edu/kreda
+ *
+ * GPL v2 License:
+ * http://www.gnu.org/licenses/gpl-2.0.html
+ * convert_atoms.cxx
+ *
+ * Converts any atoms file AtomCube can read into
+ * the binary columnar .atoms format
+ * -----------------------------------------------
+ */
+
+#include <string>
+#include <iostream>
+#include <stdlib.h>
+#include "data.h"
+#include "atoms.h"
+#include "Timer.h"
+#include "graphics/misc.h"
+
+using namespace std;
+string inputFile, outputFile;
+bool sortAtoms = false;
+size_t blockSize = 16384;
+
+
+// not really used but needed by data.o
+float		voxelsPerAngstrom;
+float		chargeVoxelsPerAngstrom;
+float		atomScale;
+bool		loadMacrocells;
+bool		loadVolume;
+bool		buildMacrocells;
+bool		buildVolume;
+bool		loadRaw;
+bool		buildIfNeeded;
+
+
+void parseCmdLine(int argc, char ** argv)
+{
+	for (int i = 1; i < argc; i++)
+	{
+		if (0 == strcasecmp("-o", argv[i]) && i < argc-1)
+		{
+			outputFile = argv[++i];
+		}
+		else if (0 == strcasecmp("-sort", argv[i]))
+		{
+			sortAtoms = true;
+		}
+		else if (0 == strcasecmp("-block_size", argv[i]) && i < argc-1)
+		{
+			blockSize = max(1, atoi(argv[++i]));
+		}
+		else if (0 == strcasecmp("-type_map", argv[i]) && i < argc-1)
+		{
+			if (!setDATTypeMap(argv[++i])) {
+				exit(1);
+			}
+		}
+		else if (argv[i][0] == '-')
+		{
+			cerr << "Unrecognized option " << argv[i] << endl;
+			exit(1);
+		}
+		else
+		{
+			inputFile = argv[i];
+		}
+	}
+
+	if (inputFile.length() == 0) {
+		cerr << "USAGE: " << argv[0] << " <atoms file> [-o output.atoms] [-type_map file] [-sort [-block_size n]]" << endl;
+		exit(1);
+	}
+
+	if (outputFile.length() == 0) {
+		outputFile = fileName(inputFile) + ".atoms";
+	}
+}
+
+int main(int argc, char ** argv)
+{
+	parseCmdLine(argc, argv);
+
+	AtomCube cube;
+	if (!cube.load_file( inputFile.c_str() ))
+	{
+		cerr << "Could not read " << inputFile << endl;
+		exit(1);
+	}
+
+	Timer timer;
+	if (sortAtoms)
+	{
+		// Morton order + block table for region of interest loading
+		timer.start();
+		cout << "Sorting atoms..." << flush;
+		cube.sort_spatially();
+		cout << " OK (" << timer.getElapsedTimeInSec() << " sec)." << endl;
+	}
+	
+	timer.start();
+	cout << "Writing " << outputFile << "..." << flush;
+	if (!cube.save_binary( outputFile.c_str(), sortAtoms ? blockSize : 0 ))
+	{
+		cerr << "\nCould not write " << outputFile << endl;
+		exit(1);
+	}
+	cout << " OK (" << timer.getElapsedTimeInSec() << " sec)." << endl;
+
+	return 0;
+}
@@ -15,17 +15,25 @@
 #include <algorithm>
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <math.h>
 #include <stdio.h>
+#include <string.h>
+#ifdef __linux__
+#include <omp.h>
+#endif
 #include "atoms.h"
 #include "data.h"
 #include "macrocells.h"
 #include "charge_volume.h"
+#include "fast_io.h"
+#include "atom_file.h"
+#include "trajectory.h"
+#include "gz_reader.h"
+#include "Timer.h"
 #include "graphics/graphics.h"
 #include "graphics/misc.h"
 
-#define FOURTEEN_MIL		14900000.0
-
 using namespace std;
 
 void setMaxIncore(int t)
@@ -33,13 +41,73 @@ void setMaxIncore(int t)
 	MAX_INCORE_TIMESTEPS = t;
 }
 
-Timestep::Timestep(string _dataFile)
+static bool sequencePrefetch = false;
+
+void setSequencePrefetch(bool p)
+{
+	sequencePrefetch = p;
+}
+
+static LoadRegion loadRegion;
+
+void setLoadRegion(const vec3f & regionMin, const vec3f & regionMax)
+{
+	loadRegion.active = true;
+	loadRegion.min = regionMin;
+	loadRegion.max = regionMax;
+}
+
+string loadRegionTag()
+{
+	if (!loadRegion.active) {
+		return "";
+	}
+	ostringstream tag;
+	tag	<< ".roi_"
+		<< loadRegion.min.x() << "_" << loadRegion.min.y() << "_" << loadRegion.min.z() << "_"
+		<< loadRegion.max.x() << "_" << loadRegion.max.y() << "_" << loadRegion.max.z();
+	return tag.str();
+}
+
+bool LoadRegion::intersects(const vec3f & lo, const vec3f & hi) const
+{
+	return	lo.x() <= max.x() && hi.x() >= min.x() &&
+		lo.y() <= max.y() && hi.y() >= min.y() &&
+		lo.z() <= max.z() && hi.z() >= min.z();
+}
+
+Timestep::Timestep(string _dataFile, int _frame, uint64_t _frameOffset, uint64_t _frameLength)
 {
 	dataFile = _dataFile;
 	cube		= NULL;
 	macrocells	= NULL;
 	volume		= NULL;
 	hasData		= false;
+	frame		= _frame;
+	frameOffset	= _frameOffset;
+	frameLength	= _frameLength;
+}
+
+bool Timestep::load_atoms(AtomCube * theCube) const
+{
+	if (frame >= 0) {
+		return theCube->load_XYZ(dataFile.c_str(), frameOffset, frameLength);
+	}
+	else {
+		return theCube->load_file(dataFile.c_str());
+	}
+}
+
+string Timestep::baseName() const
+{
+	string name = fileName(dataFile);
+	if (frame >= 0)
+	{
+		char buffer[32];
+		sprintf(buffer, ".%05d", frame);
+		name += buffer;
+	}
+	return name;
 }
 
 void Timestep::release()
@@ -65,6 +133,7 @@ Timestep::~Timestep()
 AtomCube::AtomCube()
 {
 	hasAtoms = false;	
+	spatiallySorted = false;
 }
 
 AtomCube::~AtomCube()
@@ -73,245 +142,944 @@ AtomCube::~AtomCube()
 	hasAtoms = false;
 }
 
+void AtomAttributes::clear()
+{
+	id.clear();
+	temperature[0].clear();
+	temperature[1].clear();
+}
+
+void AtomAttributes::resize(size_t n)
+{
+	id.resize(n);
+	temperature[0].resize(n);
+	temperature[1].resize(n);
+}
+
+void AtomAttributes::append(const AtomAttributes & other)
+{
+	id.insert(id.end(), other.id.begin(), other.id.end());
+	for (int i = 0; i < 2; i++) {
+		temperature[i].insert(temperature[i].end(), other.temperature[i].begin(), other.temperature[i].end());
+	}
+}
+
 bool AtomCube::load_file(const char * filename)
 {
+	attributes.clear();
+	spatiallySorted = false;
+	
 	string extension = fileExtension(filename);
 	std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
 	
+	bool loaded;
 	if (extension == "dat")
 	{
-		return load_DAT(filename);
+		loaded = load_DAT(filename);
 	}
 	else if (extension == "xyz")
 	{
-		return load_XYZ(filename);
+		loaded = load_XYZ(filename);
 	}
 	else if (extension == "xyzw")
 	{
-		return load_ANP_text(filename);
+		loaded = load_ANP_text(filename);
+	}
+	else if (extension == "atoms")
+	{
+		// reads only what's inside the region itself
+		return load_binary(filename);
+	}
+	else if (extension == "gz")
+	{
+		loaded = load_compressed(filename);
 	}
 	else
 	{
 		cerr << "Unknown file extension: " << extension << endl;
 		return false;
 	}
+	
+	if (loaded && loadRegion.active) {
+		crop(loadRegion);
+	}
+	return loaded;
 }
 
-bool AtomCube::load_XYZ(const char * filename)
+void AtomCube::crop(const LoadRegion & region)
 {
-	FILE * file = fopen(filename, "r");
-	if (!file) {
-		cerr << "Failed to load " << filename << endl;
-		return false;
+	const bool hasAttributes = !attributes.empty();
+	size_t j = 0;
+	for (size_t i = 0; i < allAtoms.size(); i++)
+	{
+		const float r = allAtoms.radius[i];
+		const vec3f lo(allAtoms.x[i] - r, allAtoms.y[i] - r, allAtoms.z[i] - r);
+		const vec3f hi(allAtoms.x[i] + r, allAtoms.y[i] + r, allAtoms.z[i] + r);
+		if (region.intersects(lo, hi))
+		{
+			if (i != j)
+			{
+				allAtoms.set(j, allAtoms.get(i));
+				if (hasAttributes) attributes.move(i, j);
+			}
+			j++;
+		}
 	}
+	cout << "\t region: " << j << " of " << allAtoms.size() << " atoms." << endl;
 	
-	char buffer[1024];
-	unsigned int npts;
-	unsigned int lineNum = 1;
+	allAtoms.resize(j);
+	if (hasAttributes) {
+		attributes.resize(j);
+	}
 	
-	fscanf(file,"%d\n",&npts);
-	fscanf(file, "%s\n", buffer);
-	cout << "Reading .XYZ file with " << npts << " atoms." << endl;
-	lineNum++;
+	worldMin = vec3(FLT_MAX);
+	worldMax = vec3(FLT_MIN);
+	allAtoms.extendBounds(worldMin, worldMax);
+	worldMag = worldMax - worldMin;
+}
 
-	// min / max
-	worldMin = vec3(FLT_MAX, FLT_MAX, FLT_MAX);
-	worldMax = vec3(FLT_MIN, FLT_MIN, FLT_MIN);
+void AtomCube::sort_spatially()
+{
+	vector<size_t> order;
+	morton_order(allAtoms, worldMin, worldMax, order);
+	allAtoms.permute(order);
 	
-	for(unsigned int i = 0; i < npts; i++, lineNum++)
+	if (!attributes.empty())
 	{
-		char id[100];
-		Atom anAtom;
-		
-
-		fscanf(file, "%s ", id);
-		
-		// look up type
-		int atomicNumber;
-		anAtom.atomType = getAtomType(id);
-		if (anAtom.atomType.length() == 0 && lineNum == 2)
+		AtomAttributes sorted;
+		sorted.resize(order.size());
+		for (size_t i = 0; i < order.size(); i++)
 		{
-			// ignore second line, which could be problematic at time
-			continue;
-		}
-		else
-		{
-			assert(anAtom.atomType.length() > 0);
+			sorted.id[i] = attributes.id[order[i]];
+			sorted.temperature[0][i] = attributes.temperature[0][order[i]];
+			sorted.temperature[1][i] = attributes.temperature[1][order[i]];
 		}
+		attributes = sorted;
+	}
+	spatiallySorted = true;
+}
 
-		fscanf(file,  "%f %f %f\n", &anAtom.x, &anAtom.y, &anAtom.z);
-		const AtomData & atomData = lookUpAtom(anAtom.atomType);
-		assert(!atomData.nonexisting);
-		anAtom.radius = atomData.vdw_radius;
-		
-		
-		if (anAtom.radius < 0)
+/* -----------------------------------------------
+ * parallel text parsing
+ * -----------------------------------------------
+ */
+
+// caches the element of the last atom symbol seen, so that runs of
+// the same element don't go through getElementId every time
+struct AtomTypeCache
+{
+	char		symbol[100];
+	int		element;
+	
+	AtomTypeCache() { symbol[0] = '\0'; element = ELEMENT_UNKNOWN; }
+	
+	bool lookUp(const char * _symbol, Atom & atom, bool ANP = false)
+	{
+		if (strcmp(symbol, _symbol) != 0)
 		{
-			cerr << "Warning, discarding unknown atom: " << id << endl;
-			break;
+			strncpy(symbol, _symbol, sizeof(symbol)-1);
+			symbol[sizeof(symbol)-1] = '\0';
+			element = getElementId(symbol, ANP);
 		}
-		
-		allAtoms.push_back( anAtom );
-				
-		// min / max taking into account Van der Waals radius
-		worldMin = min(worldMin,  anAtom.xyz_minus_rad());
-		worldMax = max(worldMax, anAtom.xyz_plus_rad());
+		atom.element = element;
+		return element != ELEMENT_UNKNOWN;
 	}
-	worldMag = worldMax - worldMin;
+};
+
+// one parsed line: the atom and the optional per-atom attributes
+struct AtomRecord
+{
+	Atom			atom;
+	unsigned long		id;
+	float			temperature[2];
+};
+
+// parses a single line of text into a record
+typedef bool (*AtomRecordParser)(const char * line, const char * lineEnd, AtomRecord & record, AtomTypeCache & cache);
 
-	fclose(file);
+// XYZ record: <symbol> <x> <y> <z>
+static bool parse_XYZ_record(const char * p, const char * end, AtomRecord & record, AtomTypeCache & cache)
+{
+	Atom & atom = record.atom;
+	char symbol[100];
+	if (!(p = parse_token(p, end, symbol, sizeof(symbol)))) return false;
+	if (!cache.lookUp(symbol, atom)) return false;
+	
+	if (!(p = parse_float(p, end, atom.x))) return false;
+	if (!(p = parse_float(p, end, atom.y))) return false;
+	if (!(p = parse_float(p, end, atom.z))) return false;
 	return true;
 }
 
+/* -----------------------------------------------
+ * DAT type map: LAMMPS atom type id -> element
+ * -----------------------------------------------
+ */
+struct DATTypeMap
+{
+	vector<unsigned char>	elements;		// indexed by type id
+	unsigned char		defaultElement;
+	
+	// id 1 is oxygen, everything else silicon
+	DATTypeMap()
+	{
+		elements.resize(2, ELEMENT_SI);
+		elements[1] = ELEMENT_O;
+		defaultElement = ELEMENT_SI;
+	}
+	
+	int lookUp(long id) const
+	{
+		return id >= 0 && id < (long) elements.size() ? elements[id] : defaultElement;
+	}
+};
+static DATTypeMap datTypeMap;
 
-bool AtomCube::load_DAT(const char * filename)
+// Type map file: one '<type id> <element>' pair per line, plus an optional
+// 'default <element>' line for unlisted ids. Elements are named as in
+// lookUpElementId(). '#' starts a comment.
+bool setDATTypeMap(const char * filename)
 {
-	FILE* file = fopen(filename, "r");
-	   
-	if (!file)
+	ifstream input(filename);
+	if (!input.is_open())
 	{
-		cerr << "Failed to load " << filename << endl;
+		cerr << "Could not open type map: " << filename << endl;
 		return false;
 	}
-	    
-	unsigned int npts;
-	float r0, r1;
-	fscanf(file,"%f %f\n",&r0, &r1);
-	fscanf(file,"%d\n",&npts);
-	cout << "Reading .DAT file with " << npts << " atoms." << endl;
-  
-	// min / max
-	worldMin = vec3(FLT_MAX);
-	worldMax = vec3(FLT_MIN);
 	
-	for(unsigned int i = 0; i < npts; i++)
+	DATTypeMap typeMap;
+	typeMap.elements.clear();
+	
+	string line;
+	for (int lineNum = 1; getline(input, line); lineNum++)
 	{
-		Atom anAtom;
-		int id, pid_of_idx, blah;
+		size_t comment = line.find('#');
+		if (comment != string::npos) {
+			line.erase(comment);
+		}
+		
+		char key[100], symbol[100];
+		const char * p = line.c_str(), * end = p + line.length();
+		if (!(p = parse_token(p, end, key, sizeof(key)))) {
+			continue;
+		}
+		
+		int element = ELEMENT_UNKNOWN;
+		if (parse_token(p, end, symbol, sizeof(symbol))) {
+			element = lookUpElementId(symbol);
+		}
+		if (element == ELEMENT_UNKNOWN)
+		{
+			cerr << filename << ":" << lineNum << ": expected '<type id> <element>'." << endl;
+			return false;
+		}
 		
-		fscanf(file,"%d %d %f %f %f %d\n", &pid_of_idx, &id, &anAtom.x,&anAtom.y,&anAtom.z, &blah);
-		if (id == 1)
+		long id;
+		const char * keyEnd = key + strlen(key);
+		if (0 == strcasecmp(key, "default"))
 		{
-			// Oxygen
-			anAtom.atomType = "o";
-
+			typeMap.defaultElement = element;
+		}
+		else if (parse_long(key, keyEnd, id) == keyEnd && id >= 0 && id < 65536)
+		{
+			if (id >= (long) typeMap.elements.size()) {
+				typeMap.elements.resize(id + 1, ELEMENT_UNKNOWN);
+			}
+			typeMap.elements[id] = element;
 		}
 		else
 		{
-			//silicon
-			anAtom.atomType = "si";
+			cerr << filename << ":" << lineNum << ": invalid type id " << key << endl;
+			return false;
 		}
+	}
+	
+	// ids left unlisted below the largest one fall back to the default
+	for (size_t i = 0; i < typeMap.elements.size(); i++)
+	{
+		if (typeMap.elements[i] == ELEMENT_UNKNOWN) {
+			typeMap.elements[i] = typeMap.defaultElement;
+		}
+	}
+	
+	datTypeMap = typeMap;
+	return true;
+}
 
-		assert(anAtom.atomType.length() > 0);
-		const AtomData & atomData = lookUpAtom(anAtom.atomType);
-		assert(!atomData.nonexisting);
-		anAtom.radius = atomData.vdw_radius;
+// DAT record: <pid> <type id> <x> <y> <z> [...]
+static bool parse_DAT_record(const char * p, const char * end, AtomRecord & record, AtomTypeCache &)
+{
+	Atom & atom = record.atom;
+	long pid, id;
+	if (!(p = parse_long(p, end, pid))) return false;
+	if (!(p = parse_long(p, end, id))) return false;
+	atom.element = datTypeMap.lookUp(id);
+	
+	if (!(p = parse_float(p, end, atom.x))) return false;
+	if (!(p = parse_float(p, end, atom.y))) return false;
+	if (!(p = parse_float(p, end, atom.z))) return false;
+	return true;
+}
 
-		allAtoms.push_back( anAtom );
+// ANP xyzw record: <type> <x> <y> <z> <id> <temperature 0> <temperature 1>
+static bool parse_ANP_record(const char * p, const char * end, AtomRecord & record, AtomTypeCache & cache)
+{
+	Atom & atom = record.atom;
+	char symbol[100];
+	if (!(p = parse_token(p, end, symbol, sizeof(symbol)))) return false;
+	if (!cache.lookUp(symbol, atom, true)) return false;
+	
+	if (!(p = parse_float(p, end, atom.x))) return false;
+	if (!(p = parse_float(p, end, atom.y))) return false;
+	if (!(p = parse_float(p, end, atom.z))) return false;
+	
+	long id;
+	if (!(p = parse_long(p, end, id))) return false;
+	record.id = id;
+	if (!(p = parse_float(p, end, record.temperature[0]))) return false;
+	if (!(p = parse_float(p, end, record.temperature[1]))) return false;
+	return true;
+}
+
+// Parses up to maxAtoms records from [begin, end) in parallel. The text is split
+// into line-aligned chunks; a first pass counts records in each chunk so that
+// the second pass can parse every chunk directly into its place in atoms.
+// Records that fail to parse are discarded. If attributes is given, the id and
+// temperature of every record are kept there alongside atoms. Returns the
+// number of atoms parsed.
+static size_t parse_atom_records(
+	const char * begin, const char * end, size_t maxAtoms,
+	AtomRecordParser parser, Atoms & atoms, AtomAttributes * attributes = NULL
+)
+{
+	int threads = 1;
+#ifdef __linux__
+	threads = omp_get_max_threads();
+#endif
+	
+	// a few chunks per thread to even out the load
+	const size_t MIN_CHUNK = 1 << 20;
+	int chunkCount = min( threads * 8, int((end - begin) / MIN_CHUNK) + 1 );
+	
+	vector<const char *> bounds;
+	split_lines(begin, end, chunkCount, bounds);
+	
+	// count records in every chunk, then prefix sum to get chunk offsets
+	vector<size_t> offsets(chunkCount + 1, 0);
+	
+#ifdef __linux__
+#pragma omp parallel for schedule(dynamic)
+#endif
+	for (int c = 0; c < chunkCount; c++)
+	{
+		offsets[c + 1] = count_records(bounds[c], bounds[c + 1]);
+	}
+	for (int c = 0; c < chunkCount; c++)
+	{
+		offsets[c + 1] += offsets[c];
+	}
+	
+	const size_t base = atoms.size();
+	const size_t count = min(offsets[chunkCount], maxAtoms);
+	atoms.resize(base + count);
+	if (attributes) {
+		attributes->resize(base + count);
+	}
+	
+	vector<size_t> discarded(chunkCount, 0);
 
-		// min / max
-		worldMin = min(worldMin, anAtom.xyz_minus_rad());
-		worldMax = max(worldMax, anAtom.xyz_plus_rad());
+#ifdef __linux__
+#pragma omp parallel for schedule(dynamic)
+#endif
+	for (int c = 0; c < chunkCount; c++)
+	{
+		AtomTypeCache cache;
+		size_t index = base + offsets[c];
+		const char * p = bounds[c], * chunkEnd = bounds[c + 1];
 		
-		if (i % 100000 == 0)
+		while (p < chunkEnd && index < base + count)
 		{
-			cout << "\r  Loading data:\t\t" << floor(.5f + 100.0f * ((float) i / (float) npts));
-			cout << "%" << flush;
-		}	
+			const char * lineEnd = (const char *) memchr(p, '\n', chunkEnd - p);
+			if (!lineEnd) lineEnd = chunkEnd;
+			
+			if (skip_blanks(p, lineEnd) < lineEnd)
+			{
+				AtomRecord record;
+				if (!parser(p, lineEnd, record, cache))
+				{
+					// flag for removal
+					record.atom.element = ELEMENT_UNKNOWN;
+					discarded[c]++;
+				}
+				if (attributes) {
+					attributes->set(index, record.id, record.temperature);
+				}
+				atoms.set(index++, record.atom);
+			}
+			p = lineEnd + 1;
+		}
+	}
+	
+	size_t totalDiscarded = 0;
+	for (int c = 0; c < chunkCount; c++)
+	{
+		totalDiscarded += discarded[c];
+	}
+	
+	if (totalDiscarded > 0)
+	{
+		cerr << "Warning, discarding " << totalDiscarded << " unknown / malformed atom records." << endl;
+		size_t j = base;
+		for (size_t i = base; i < atoms.size(); i++)
+		{
+			if (atoms.element[i] != ELEMENT_UNKNOWN)
+			{
+				if (i != j)
+				{
+					atoms.set(j, atoms.get(i));
+					if (attributes) attributes->move(i, j);
+				}
+				j++;
+			}
+		}
+		atoms.resize(j);
+		if (attributes) {
+			attributes->resize(j);
+		}
+	}
+	return atoms.size() - base;
+}
+
+static void report_throughput(size_t atomCount, size_t bytes, double seconds)
+{
+	cout << "\t " << atomCount << " atoms read in " << seconds << " sec";
+	if (seconds > 0.0) {
+		cout << " (" << (double(bytes) / (1024.0 * 1024.0)) / seconds << " MB/s)";
 	}
 	cout << endl;
+}
+
+// offset / length select a single frame of a trajectory
+bool AtomCube::load_XYZ(const char * filename, uint64_t offset, uint64_t length)
+{
+	Timer timer;
+	timer.start();
+	
+	MappedFile file;
+	if (!file.open(filename, offset, length)) {
+		cerr << "Failed to load " << filename << endl;
+		return false;
+	}
+	
+	const char * p = file.data();
+	const char * end = p + file.size();
+	
+	// header: atom count followed by a comment line
+	long npts = 0;
+	if (!parse_long(p, end, npts) || npts < 0)
+	{
+		cerr << "Invalid .XYZ header in " << filename << endl;
+		return false;
+	}
+	p = skip_line(p, end);
+	p = skip_line(p, end);
+	cout << "Reading .XYZ file with " << npts << " atoms." << endl;
+
+	// min / max
+	worldMin = vec3(FLT_MAX, FLT_MAX, FLT_MAX);
+	worldMax = vec3(FLT_MIN, FLT_MIN, FLT_MIN);
+	
+	allAtoms.clear();
+	parse_atom_records(p, end, npts, &parse_XYZ_record, allAtoms);
+	
+	// min / max taking into account Van der Waals radius
+	allAtoms.extendBounds(worldMin, worldMax);
 	worldMag = worldMax - worldMin;
+	
+	report_throughput(allAtoms.size(), file.size(), timer.getElapsedTimeInSec());
+	return true;
+}
 
-	fclose(file);	
+
+bool AtomCube::load_DAT(const char * filename)
+{
+	Timer timer;
+	timer.start();
+	
+	MappedFile file;
+	if (!file.open(filename))
+	{
+		cerr << "Failed to load " << filename << endl;
+		return false;
+	}
+	const char * p = file.data();
+	const char * end = p + file.size();
+	
+	// header: two floats we don't use, followed by the number of atoms
+	p = skip_line(p, end);
+	
+	long npts = 0;
+	const char * lineEnd = skip_line(p, end);
+	if (!parse_long(p, lineEnd, npts) || npts < 0)
+	{
+		cerr << "Invalid .DAT header in " << filename << endl;
+		return false;
+	}
+	p = lineEnd;
+	cout << "Reading .DAT file with " << npts << " atoms." << endl;
+	
+	// min / max
+	worldMin = vec3(FLT_MAX);
+	worldMax = vec3(FLT_MIN);
+	
+	allAtoms.clear();
+	allAtoms.reserve(npts);
+	if (parse_atom_records(p, end, npts, &parse_DAT_record, allAtoms) < (size_t) npts) {
+		cerr << "Warning: " << filename << " has fewer than " << npts << " atoms." << endl;
+	}
+	
+	// min / max taking into account Van der Waals radius
+	allAtoms.extendBounds(worldMin, worldMax);
+	worldMag = worldMax - worldMin;
+	
+	report_throughput(allAtoms.size(), file.size(), timer.getElapsedTimeInSec());
 	return true;
 }
 
 
 bool AtomCube::load_ANP_text(const char * filename)
 {
-	char buffer[1024];
+	Timer timer;
+	timer.start();
 	
-	fstream input;
-	input.open(filename);
-	if (!input.is_open())
+	MappedFile file;
+	if (!file.open(filename))
 	{
 		cerr << "Could not open: " << filename << endl;
 		return false;
 	}
+	const char * p = file.data();
+	const char * end = p + file.size();
 	
 	// consume the first two lines
-	input.getline(buffer, 1024);
-	input.getline(buffer, 1024);
+	p = skip_line(p, end);
+	p = skip_line(p, end);
 	
-	unsigned long counter = 0;
-
 	// min / max
 	worldMin = vec3(FLT_MAX);
 	worldMax = vec3(FLT_MIN);
 	
-	// load all atoms in the file
-	while (!input.eof())
-	{	
-		char t;
-		unsigned long id;
-		float temp, X, Y, Z;
-		Atom anAtom;
+	allAtoms.clear();
+	parse_atom_records(p, end, (size_t) -1, &parse_ANP_record, allAtoms, &attributes);
+	
+	// min / max taking into account Van der Waals radius
+	allAtoms.extendBounds(worldMin, worldMax);
+	worldMag = worldMax - worldMin;
+	
+	report_throughput(allAtoms.size(), file.size(), timer.getElapsedTimeInSec());
+	return true;
+}
+
+
+bool AtomCube::load_binary(const char * filename)
+{
+	Timer timer;
+	timer.start();
+	
+	// atoms are served straight out of the mapping, copy-on-write so the 
+	// columns can be handed out as non-const (the file is never modified)
+	allAtoms.clear();
+	MappedFile & file = atomFile;
+	if (!file.open(filename, true)) {
+		cerr << "Failed to load " << filename << endl;
+		return false;
+	}
+	
+	// validate header
+	const AtomFileHeader * fileHeader = (const AtomFileHeader *) file.data();
+	if (	file.size() < ATOM_FILE_HEADER_V1_SIZE || 
+		memcmp(fileHeader->magic, ATOM_FILE_MAGIC, sizeof(ATOM_FILE_MAGIC)) != 0
+	)
+	{
+		cerr << filename << " is not a binary atoms file." << endl;
+		return false;
+	}
+	if (	fileHeader->version < 1 || fileHeader->version > ATOM_FILE_VERSION || 
+		fileHeader->byteOrder != ATOM_FILE_BYTE_ORDER || fileHeader->elementSize != 1 ||
+		fileHeader->headerSize > file.size()
+	)
+	{
+		cerr << "Unsupported atoms file version / byte order: " << filename << endl;
+		return false;
+	}
+	
+	// version 1 headers are a prefix of the current one
+	AtomFileHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(&header, fileHeader, min((size_t) fileHeader->headerSize, sizeof(header)));
+	
+	const uint64_t npts = header.atomCount;
+	if (	header.elementOffset + npts > file.size() ||
+		header.xOffset + npts * sizeof(float) > file.size() ||
+		header.yOffset + npts * sizeof(float) > file.size() ||
+		header.zOffset + npts * sizeof(float) > file.size() ||
+		header.blockOffset + header.blockCount * sizeof(AtomFileBlock) > file.size()
+	)
+	{
+		cerr << "Truncated atoms file: " << filename << endl;
+		return false;
+	}
+	cout << "Reading binary atoms file with " << npts << " atoms." << endl;
+	
+	char * base = file.writableData();
+	unsigned char * elements = (unsigned char *) (base + header.elementOffset);
+	const float * X = (const float *) (base + header.xOffset);
+	const float * Y = (const float *) (base + header.yOffset);
+	const float * Z = (const float *) (base + header.zOffset);
+	spatiallySorted = (header.flags & ATOM_FILE_MORTON_ORDER) != 0;
+	
+	if (loadRegion.active)
+	{
+		// only read the blocks that intersect the region
+		AtomFileBlock wholeFile;
+		memset(&wholeFile, 0, sizeof(wholeFile));
+		wholeFile.count = npts;
 		
-		input >> t;
-		input >> X;
-		input >> Y;
-		input >> Z;
+		const AtomFileBlock * blocks = &wholeFile;
+		size_t blockCount = 1;
+		if (header.blockCount > 0)
+		{
+			blocks = (const AtomFileBlock *) (base + header.blockOffset);
+			blockCount = header.blockCount;
+			file.adviseRandom();
+		}
+		else {
+			cerr << "Warning: " << filename << " has no block table, scanning all atoms for the region." << endl;
+		}
+		
+		size_t blocksRead = 0;
+		uint64_t bytesRead = 0;
+		for (size_t b = 0; b < blockCount; b++)
+		{
+			const AtomFileBlock & block = blocks[b];
+			if (header.blockCount > 0 && !loadRegion.intersects(
+				vec3(block.min[0], block.min[1], block.min[2]),
+				vec3(block.max[0], block.max[1], block.max[2]))
+			)
+			{
+				continue;
+			}
+			
+			blocksRead++;
+			const uint64_t end = min(block.first + block.count, npts);
+			bytesRead += (end - block.first) * (3 * sizeof(float) + 1);
+			for (uint64_t i = block.first; i < end; i++)
+			{
+				Atom anAtom;
+				anAtom.x = X[i];
+				anAtom.y = Y[i];
+				anAtom.z = Z[i];
+				anAtom.element = elements[i] < ELEMENT_COUNT ? elements[i] : ELEMENT_UNKNOWN;
+				if (loadRegion.intersects(anAtom.xyz_minus_rad(), anAtom.xyz_plus_rad())) {
+					allAtoms.push_back(anAtom);
+				}
+			}
+		}
+		file.close();
 		
-		anAtom.x = X;
-		anAtom.y = Y;
-		anAtom.z = Z;
+		cout << "\t region: " << allAtoms.size() << " atoms from " << blocksRead << " / " << blockCount << " blocks." << endl;
 		
-		// look up type
-		anAtom.atomType = getAtomType(&t, true);
-		assert(anAtom.atomType.length() > 0);
-		anAtom.radius = lookUpAtom(anAtom.atomType).vdw_radius;
-
-		// min / max
-		worldMin = min(worldMin, anAtom.xyz_minus_rad());
-		worldMax = max(worldMax, anAtom.xyz_plus_rad());
-
-		// read temperature values
-		input >> id;
-		input >> temp;
-		input >> temp;
+		worldMin = vec3(FLT_MAX);
+		worldMax = vec3(FLT_MIN);
+		allAtoms.extendBounds(worldMin, worldMax);
+		worldMag = worldMax - worldMin;
 		
-		// print some load status
-		if (counter++ % 100000 == 0)
+		report_throughput(allAtoms.size(), bytesRead, timer.getElapsedTimeInSec());
+		return true;
+	}
+	
+	// unknown ids would index past the element table
+	for (uint64_t i = 0; i < npts; i++)
+	{
+		if (elements[i] >= ELEMENT_COUNT) {
+			elements[i] = ELEMENT_UNKNOWN;
+		}
+	}
+	
+	allAtoms.wrap(
+		npts,
+		(float *) X,
+		(float *) Y,
+		(float *) Z,
+		elements
+	);
+	
+	// bounds come with the file
+	worldMin = vec3(header.worldMin[0], header.worldMin[1], header.worldMin[2]);
+	worldMax = vec3(header.worldMax[0], header.worldMax[1], header.worldMax[2]);
+	worldMag = worldMax - worldMin;
+	
+	report_throughput(allAtoms.size(), file.size(), timer.getElapsedTimeInSec());
+	return true;
+}
+
+// gzip compressed text (<name>.xyz.gz, .dat.gz, .xyzw.gz): one thread
+// decompresses into line-aligned blocks while the others parse them
+bool AtomCube::load_compressed(const char * filename)
+{
+	Timer timer;
+	timer.start();
+	
+	string format = fileExtension(fileName(filename));
+	std::transform(format.begin(), format.end(), format.begin(), ::tolower);
+	
+	AtomRecordParser parser = NULL;
+	bool hasAttributes = false;
+	if (format == "xyz") {
+		parser = &parse_XYZ_record;
+	}
+	else if (format == "dat") {
+		parser = &parse_DAT_record;
+	}
+	else if (format == "xyzw")
+	{
+		parser = &parse_ANP_record;
+		hasAttributes = true;
+	}
+	else
+	{
+		cerr << "Unknown compressed file format: " << format << endl;
+		return false;
+	}
+	
+	// all three formats have a two line header
+	vector<string> header;
+	GzipBlockReader reader;
+	if (!reader.open(filename, 2, header) || header.size() < 2)
+	{
+		cerr << "Failed to load " << filename << endl;
+		return false;
+	}
+	
+	// xyz: atom count on the first line, dat: on the second
+	long npts = -1;
+	if (format != "xyzw")
+	{
+		const string & countLine = header[format == "xyz" ? 0 : 1];
+		if (!parse_long(countLine.c_str(), countLine.c_str() + countLine.length(), npts) || npts < 0)
 		{
-			cout << "\rLoading data:\t\t" << floor(.5f + 100.0f * ((float) counter / FOURTEEN_MIL));
-			cout << "%" << flush;
+			cerr << "Invalid header in " << filename << endl;
+			return false;
+		}
+		cout << "Reading compressed ." << format << " file with " << npts << " atoms." << endl;
+	}
+	
+	// parsed blocks, indexed by their position in the file
+	struct ParsedBlock
+	{
+		Atoms		atoms;
+		AtomAttributes	attributes;
+	};
+	vector<ParsedBlock *> parsed;
+	
+#ifdef __linux__
+#pragma omp parallel
+#endif
+	{
+		TextBlock * block;
+		while ((block = reader.next()) != NULL)
+		{
+			ParsedBlock * result = new ParsedBlock;
+			parse_atom_records(
+				block->begin(), block->end(), (size_t) -1, parser,
+				result->atoms, hasAttributes ? &result->attributes : NULL
+			);
+			
+#ifdef __linux__
+#pragma omp critical
+#endif
+			{
+				if (parsed.size() <= block->sequence) {
+					parsed.resize(block->sequence + 1, NULL);
+				}
+				parsed[block->sequence] = result;
+			}
+			delete block;
+		}
+	}
+	
+	const bool ok = reader.close();
+	
+	// stitch blocks together in file order
+	size_t total = 0;
+	for (size_t b = 0; b < parsed.size(); b++) {
+		total += parsed[b] ? parsed[b]->atoms.size() : 0;
+	}
+	
+	allAtoms.clear();
+	allAtoms.reserve(total);
+	for (size_t b = 0; b < parsed.size(); b++)
+	{
+		if (parsed[b])
+		{
+			allAtoms.append(parsed[b]->atoms);
+			if (hasAttributes) {
+				attributes.append(parsed[b]->attributes);
+			}
+			delete parsed[b];
 		}
-		
-		allAtoms.push_back( anAtom );
 	}
+	
+	if (npts >= 0 && allAtoms.size() > (size_t) npts)
+	{
+		allAtoms.resize(npts);
+	}
+	
+	if (!ok)
+	{
+		cerr << "Failed to load " << filename << endl;
+		return false;
+	}
+	
+	// min / max taking into account Van der Waals radius
+	worldMin = vec3(FLT_MAX);
+	worldMax = vec3(FLT_MIN);
+	allAtoms.extendBounds(worldMin, worldMax);
 	worldMag = worldMax - worldMin;
 	
-	input.close();
+	report_throughput(allAtoms.size(), reader.uncompressedSize(), timer.getElapsedTimeInSec());
 	return true;
 }
 
+// writes zeros until the stream is at offset
+static void pad_to(ofstream & output, uint64_t offset)
+{
+	static const char zeros[512] = {0};
+	uint64_t pos = (uint64_t) output.tellp();
+	while (pos < offset)
+	{
+		const uint64_t n = min(offset - pos, (uint64_t) sizeof(zeros));
+		output.write(zeros, n);
+		pos += n;
+	}
+}
 
-CubeSequence::CubeSequence(string seqFile, int node_rank, int node_count)
+bool AtomCube::save_binary(const char * filename, size_t blockSize) const
 {
-	// open the sequence file and read it
-	ifstream input(seqFile.c_str());
-	while (!input.eof())
+	const uint64_t npts = allAtoms.size();
+	
+	// bounds of every run of blockSize atoms
+	vector<AtomFileBlock> blocks;
+	if (blockSize > 0)
 	{
-		char buffer[1024*3];
-		input.getline(buffer, 1024*3-1);
+		blocks.resize( (npts + blockSize - 1) / blockSize );
 		
-		string dataFile = trim(string(buffer));
-		if (dataFile.length() == 0) {
-			continue;
+#ifdef __linux__
+#pragma omp parallel for
+#endif
+		for (long b = 0; b < (long) blocks.size(); b++)
+		{
+			AtomFileBlock & block = blocks[b];
+			block.first = b * blockSize;
+			block.count = min((uint64_t) blockSize, npts - block.first);
+			
+			vec3 bMin(FLT_MAX), bMax(-FLT_MAX);
+			for (uint64_t i = block.first; i < block.first + block.count; i++)
+			{
+				const Atom anAtom = allAtoms.get(i);
+				bMin = min(bMin, anAtom.xyz_minus_rad());
+				bMax = max(bMax, anAtom.xyz_plus_rad());
+			}
+			for (int c = 0; c < 3; c++)
+			{
+				block.min[c] = bMin[c];
+				block.max[c] = bMax[c];
+			}
+		}
+	}
+	
+	AtomFileHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, ATOM_FILE_MAGIC, sizeof(ATOM_FILE_MAGIC));
+	header.version		= ATOM_FILE_VERSION;
+	header.byteOrder	= ATOM_FILE_BYTE_ORDER;
+	header.headerSize	= sizeof(AtomFileHeader);
+	header.elementSize	= 1;
+	header.atomCount	= npts;
+	for (int i = 0; i < 3; i++)
+	{
+		header.worldMin[i] = worldMin[i];
+		header.worldMax[i] = worldMax[i];
+	}
+	header.elementOffset	= atom_file_align(sizeof(AtomFileHeader));
+	header.xOffset		= atom_file_align(header.elementOffset + npts);
+	header.yOffset		= atom_file_align(header.xOffset + npts * sizeof(float));
+	header.zOffset		= atom_file_align(header.yOffset + npts * sizeof(float));
+	header.flags		= spatiallySorted ? ATOM_FILE_MORTON_ORDER : 0;
+	header.blockSize	= blockSize;
+	header.blockCount	= blocks.size();
+	header.blockOffset	= blocks.empty() ? 0 : atom_file_align(header.zOffset + npts * sizeof(float));
+	
+	ofstream output(filename, ios::binary);
+	if (!output.is_open()) {
+		return false;
+	}
+	output.write( (const char *) &header, sizeof(header) );
+	
+	pad_to(output, header.elementOffset);
+	output.write( (const char *) allAtoms.element, npts );
+	
+	const uint64_t offsets[3] = {header.xOffset, header.yOffset, header.zOffset};
+	const float * columns[3] = {allAtoms.x, allAtoms.y, allAtoms.z};
+	for (int c = 0; c < 3; c++)
+	{
+		pad_to(output, offsets[c]);
+		output.write( (const char *) columns[c], npts * sizeof(float) );
+	}
+	
+	if (!blocks.empty())
+	{
+		pad_to(output, header.blockOffset);
+		output.write( (const char *) &blocks[0], blocks.size() * sizeof(AtomFileBlock) );
+	}
+	
+	output << flush;
+	bool ok = output.good();
+	output.close();
+	return ok;
+}
+
+
+CubeSequence::CubeSequence(string seqFile, int node_rank, int node_count)
+{
+	if (0 == strcasecmp(fileExtension(seqFile).c_str(), "seq"))
+	{
+		// open the sequence file and read it
+		ifstream input(seqFile.c_str());
+		while (!input.eof())
+		{
+			char buffer[1024*3];
+			input.getline(buffer, 1024*3-1);
+			
+			string dataFile = trim(string(buffer));
+			if (dataFile.length() == 0) {
+				continue;
+			}
+			timesteps.push_back( new Timestep(dataFile) );
+		}
+		input.close();
+	}
+	else
+	{
+		// a trajectory: one timestep per frame
+		FrameIndex index;
+		if (index.open(seqFile))
+		{
+			for (size_t f = 0; f < index.frameCount(); f++) {
+				timesteps.push_back( new Timestep(seqFile, f, index.frameOffset(f), index.frameLength(f)) );
+			}
 		}
-		timesteps.push_back( new Timestep(dataFile) );
 	}
-	input.close();
 	
 	if (node_rank >= 0 && node_count > 1)
 	{
@@ -346,10 +1114,13 @@ CubeSequence::CubeSequence(string seqFile, int node_rank, int node_count)
 		length = timesteps.size();
 	}
 	current = start;
+	prefetching = false;
+	prefetchIndex = -1;
 }
 
 CubeSequence::~CubeSequence()
 {
+	finish_prefetch();
 	for (int i = 0; i < timesteps.size(); i++) {
 		delete timesteps[i];
 	}
@@ -357,18 +1128,79 @@ CubeSequence::~CubeSequence()
 
 const Timestep * CubeSequence::getCurrentTimestep()
 {
+	finish_prefetch();
+	
 	Timestep * t = timesteps[current];
 	if (!t->hasData)
 	{
 		cout << "Loading data for " << t->dataFile << endl;
 		load_data(t);
 	}
+	else if (find(loadedTimesteps.begin(), loadedTimesteps.end(), t) == loadedTimesteps.end())
+	{
+		// prefetched
+		make_room();
+		loadedTimesteps.push_back( t );
+	}
+	
+	if (sequencePrefetch) {
+		start_prefetch();
+	}
 	return t;
 }
 
+void CubeSequence::start_prefetch()
+{
+	const int next = current + 1;
+	if (prefetching || next >= start + length || timesteps[next]->hasData) {
+		return;
+	}
+	
+	prefetchIndex = next;
+	if (0 != pthread_create(&prefetchThread, NULL, &CubeSequence::prefetchThreadEntry, this))
+	{
+		cerr << "CubeSequence: could not start prefetch thread." << endl;
+		return;
+	}
+	prefetching = true;
+}
+
+void CubeSequence::finish_prefetch()
+{
+	if (!prefetching) {
+		return;
+	}
+	pthread_join(prefetchThread, NULL);
+	prefetching = false;
+	
+	// moved elsewhere in the meantime
+	if (prefetchIndex != current) {
+		timesteps[prefetchIndex]->release();
+	}
+}
+
+void * CubeSequence::prefetchThreadEntry(void * arg)
+{
+	CubeSequence * sequence = (CubeSequence *) arg;
+	Timestep * t = sequence->timesteps[ sequence->prefetchIndex ];
+	
+	Timer timer;
+	timer.start();
+	cout << "Prefetching data for " << t->dataFile << endl;
+	sequence->load_timestep(t, sequence->prefetchIndex);
+	
+	// CPU side of the GPU upload (the GL calls stay on the render thread)
+	if (t->macrocells) {
+		t->macrocells->stage_GLSL( t->macrocells->getRefMode() );
+	}
+	cout << "Prefetched " << t->dataFile << " in " << timer.getElapsedTimeInSec() << " sec" << endl;
+	return NULL;
+}
+
 
 const AtomCube * CubeSequence::getCube(string & filename)
 {
+	finish_prefetch();
 	Timestep * t = timesteps[current];
 	if (t->cube == NULL)
 	{
@@ -383,19 +1215,56 @@ const AtomCube * CubeSequence::getCube(string & filename)
 	
 		// load raw atoms
 		t->cube = new AtomCube;
-		t->cube->load_file( t->dataFile.c_str() );
+		t->load_atoms( t->cube );
 		t->macrocells = NULL;
 		t->volume = NULL;
 		t->hasData = true;
 		
 		loadedTimesteps.push_back( t );
 	}
-	filename = t->dataFile;
+	filename = t->frame >= 0 ? t->baseName() : t->dataFile;
 	return t->cube;
 }
 
 
+const Macrocells * CubeSequence::adjacentMacrocells(int index) const
+{
+	for (int d = -1; d <= 1; d += 2)
+	{
+		const int i = index + d;
+		if (i < start || i >= start + length) {
+			continue;
+		}
+		
+		const Macrocells * m = timesteps[i]->macrocells;
+		if (timesteps[i]->hasData && m && m->canUpdate()) {
+			return m;
+		}
+	}
+	return NULL;
+}
+
+void CubeSequence::make_room()
+{
+	while (!loadedTimesteps.empty() && loadedTimesteps.size() >= MAX_INCORE_TIMESTEPS)
+	{
+		// delete the first loaded timestep
+		list<Timestep*>::iterator first = loadedTimesteps.begin();
+		(*first)->release();
+		loadedTimesteps.erase(first);
+	}
+}
+
 void CubeSequence::load_data(Timestep * t)
+{
+	// evict only once t is built, so that the neighbour it is updated from
+	// is still in core (one timestep more than the limit in the meantime)
+	load_timestep(t, current);
+	make_room();
+	loadedTimesteps.push_back( t );
+}
+
+void CubeSequence::load_timestep(Timestep * t, int index)
 {
 	// globals defined in main.cxx
 	extern float		voxelsPerAngstrom;
@@ -416,18 +1285,10 @@ void CubeSequence::load_data(Timestep * t)
 	
 	static const bool SAVE_DATA		= false;
 	static const bool DONT_RECREATE	= false;
-
-	if (loadedTimesteps.size() == MAX_INCORE_TIMESTEPS)
-	{
-		// delete the first loaded timestep
-		list<Timestep*>::iterator first = loadedTimesteps.begin();
-		(*first)->release();
-		loadedTimesteps.erase(first);
-	}
 	
-	string rawFile			= fileName(t->dataFile);
-	string volumeFile		= rawFile + ".volume";
-	string macrocellsFile		= rawFile + ".macrocells";
+	string rawFile			= t->baseName();
+	string volumeFile		= rawFile + loadRegionTag() + ".volume";
+	string macrocellsFile		= rawFile + loadRegionTag() + ".macrocells";
 	
 	AtomCube * theCube		= NULL;
 	Macrocells * macrocells	= NULL;
@@ -479,25 +1340,59 @@ void CubeSequence::load_data(Timestep * t)
 	if (_loadRaw)
 	{
 		// load raw atoms
-		AtomCube * theCube = new AtomCube;
-		theCube->load_file( t->dataFile.c_str() );
+		theCube = new AtomCube;
+		t->load_atoms( theCube );
 			
 		if (_buildMacrocells)
 		{
-			macrocells = new Macrocells(
-				theCube->allAtoms, 
-				voxelsPerAngstrom, atomScale,
-				theCube->worldMin, theCube->worldMax, 
-				(SAVE_DATA ? macrocellsFile : "")
-			);
+			// consecutive frames of a trajectory mostly have the same cells,
+			// so start from a neighbour's macrocells when there is one
+			const Macrocells * previous = adjacentMacrocells(index);
+			if (voxelsPerAngstrom == MC_AUTO_VPA)
+			{
+				// chosen once, from the first timestep built
+				voxelsPerAngstrom = chooseMacrocellVPA(theCube->allAtoms, atomScale, theCube->worldMin, theCube->worldMax);
+			}
+			if (previous)
+			{
+				macrocells = new Macrocells(
+					*previous,
+					theCube->allAtoms,
+					theCube->worldMin, theCube->worldMax,
+					(SAVE_DATA ? macrocellsFile : "")
+				);
+			}
+			else if (timesteps.size() > 1)
+			{
+				// leave slack around the atoms for the frames updated from this one
+				vec3 gridOrigin;
+				vec3i gridDim;
+				macrocellUpdateGrid(theCube->worldMin, theCube->worldMax, voxelsPerAngstrom, gridOrigin, gridDim);
+				macrocells = new Macrocells(
+					theCube->allAtoms, 
+					voxelsPerAngstrom, atomScale,
+					gridOrigin, gridDim, 
+					(SAVE_DATA ? macrocellsFile : "")
+				);
+			}
+			else
+			{
+				macrocells = new Macrocells(
+					theCube->allAtoms, 
+					voxelsPerAngstrom, atomScale,
+					theCube->worldMin, theCube->worldMax, 
+					(SAVE_DATA ? macrocellsFile : "")
+				);
+			}
 		}
 			
 		if (_buildVolume)
 		{
+			// (an updated grid starts at the neighbour's origin)
 			assert(macrocells);
 			volume = new ChargeDensityVolume(
 				theCube->allAtoms,
-				theCube->worldMin,
+				macrocells->canUpdate() ? macrocells->getOrigin() : theCube->worldMin,
 					
 				macrocells->getVPA(),
 				chargeVoxelsPerAngstrom,
@@ -511,34 +1406,10 @@ void CubeSequence::load_data(Timestep * t)
 	t->macrocells	= macrocells;
 	t->volume	= volume;
 	t->hasData	= true;
-	
-	loadedTimesteps.push_back( t );
 }
 
 
-// Given an atomic number, this tells us the index of atom data in the const
-// of the shader
-int getShaderIndex(int atomicNumber)
-{
-	switch (atomicNumber)
-	{
-	case 8:		// O
-		return 0;
-		
-	case 14:	// Si
-		return 1;
-		
-	case 13:	// Al
-		return 2;
-	
-	case 6:		// carbon
-		return 4;
-	default:
-		return -1;
-	}
-}
-
-string getAtomType(const char * t, bool ANP)
+int getElementId(const char * t, bool ANP)
 {
 	if (ANP)
 	{
@@ -549,52 +1420,53 @@ string getAtomType(const char * t, bool ANP)
 		case 'C':
 		case 'D':
 		case 'F':
-			return "al";
+			return ELEMENT_AL;
 	
 		case 'G':
 		case 'I':
-			return "al_bg";
+			return ELEMENT_AL_BG;
 		
 		case 'B':
 		case 'E':
-			return "o";
+			return ELEMENT_O;
 			
 		case 'H':
-			return "o_bg";
+			return ELEMENT_O_BG;
 		default:
-			return "";
+			return ELEMENT_UNKNOWN;
 		}
 	}
 	else
 	{
-		string err;
-
 		switch (t[0])
 		{
 		case 'c':
 		case 'C':
 			// carbon
-			return "c";
+			return ELEMENT_C;
 		case 'o':
 		case 'O':
-			return "o";
+			return ELEMENT_O;
 		
 		case 's':
 		case 'S':
-			return "si";
+			return ELEMENT_SI;
 		default:
 			// search atom table
 			for (int i = 1; i < atom_count; i++) {
-				if (0 == strcasecmp(atom_table[i], t)) {
-					return atom_table[i];
+				if (0 == strcasecmp(atom_table[i], t)) 
+				{
+					int element = lookUpElementId(atom_table[i]);
+					if (element == ELEMENT_UNKNOWN) {
+						std::cerr << "WARNING: No atom data for element " << t << endl;
+					}
+					return element;
 				}
 			}
 			std::cerr << "WARNING: Can not find element " << t << endl;
 
-			return "";
+			return ELEMENT_UNKNOWN;
 			
 		}
 	}
 }
-
-
@@ -18,8 +18,10 @@
 #include <vector>
 #include <list>
 #include <assert.h>
+#include <pthread.h>
 #include "atoms.h"
 #include "grid.h"
+#include "fast_io.h"
 #include "VectorT.hxx"
 #include "graphics/graphics.h"
 
@@ -33,6 +35,32 @@ class ChargeDensityVolume;
 static int MAX_INCORE_TIMESTEPS = 1;		// max number of timesteps to keep loaded in core
 void setMaxIncore(int);
 
+// Sequences load the timestep after the current one on a worker thread, and
+// stage its macrocells for upload, while the current one renders (holds one
+// more timestep in core than MAX_INCORE_TIMESTEPS while it runs)
+void setSequencePrefetch(bool);
+
+// world-space box limiting what gets loaded
+struct LoadRegion
+{
+	bool active;
+	vec3f min, max;
+	
+	LoadRegion() { active = false; }
+	bool intersects(const vec3f & lo, const vec3f & hi) const;
+};
+
+// Only atoms whose spheres intersect the region are loaded. Spatially sorted
+// .atoms files (convert_atoms -sort) read just the blocks that intersect it.
+void setLoadRegion(const vec3f & regionMin, const vec3f & regionMax);
+
+// appended to the names of cached .macrocells / .volume files built from a
+// region, so they do not replace the caches of the whole dataset ("" if none)
+string loadRegionTag();
+
+// element mapping of LAMMPS type ids in .dat files (see data.cxx for the file format)
+bool setDATTypeMap(const char * filename);
+
 // a single timestep with all its associated data
 struct Timestep
 {
@@ -42,11 +70,48 @@ struct Timestep
 	Macrocells * macrocells;
 	ChargeDensityVolume * volume;
 	
+	// frame of a trajectory file (-1 if dataFile holds a single timestep)
+	int frame;
+	uint64_t frameOffset, frameLength;
+	
+	// reads the atoms of this timestep into cube
+	bool load_atoms(AtomCube * cube) const;
+	
+	// name to derive .macrocells / .volume / image names from
+	string baseName() const;
+	
 	void release();
-	Timestep(string _cubeFile);
+	Timestep(string _cubeFile, int _frame = -1, uint64_t _frameOffset = 0, uint64_t _frameLength = 0);
 	~Timestep();
 };
 
+// Optional per-atom scalar columns, parallel to AtomCube::allAtoms.
+// Only filled by loaders whose format carries them (ANP .xyzw), empty otherwise.
+struct AtomAttributes
+{
+	vector<unsigned long>	id;
+	vector<float>		temperature[2];
+	
+	bool empty() const		{ return id.empty(); }
+	size_t size() const		{ return id.size(); }
+	void clear();
+	void resize(size_t n);
+	void append(const AtomAttributes & other);
+	
+	void set(size_t i, unsigned long _id, const float * _temperature)
+	{
+		id[i] = _id;
+		temperature[0][i] = _temperature[0];
+		temperature[1][i] = _temperature[1];
+	}
+	void move(size_t from, size_t to)
+	{
+		id[to] = id[from];
+		temperature[0][to] = temperature[0][from];
+		temperature[1][to] = temperature[1][from];
+	}
+};
+
 // An atoms cube: contains all atoms in single time slice
 class AtomCube
 {
@@ -55,18 +120,40 @@ public:
 	~AtomCube();
 	
 	bool load_ANP_text(const char * filename);
-	bool load_XYZ(const char * filename);
+	bool load_XYZ(const char * filename, uint64_t offset = 0, uint64_t length = 0);
 	bool load_DAT(const char * filename);
+	bool load_binary(const char * filename);
+	bool load_compressed(const char * filename);
 	bool load_file(const char * filename);
 	
+	// write atoms in binary columnar format (.atoms, see atom_file.h),
+	// with a block table of blockSize atom runs if blockSize > 0
+	bool save_binary(const char * filename, size_t blockSize = 0) const;
+	
+	// sort atoms along a Morton curve
+	void sort_spatially();
+	
+	// drop atoms outside of region
+	void crop(const LoadRegion & region);
+	
 public:
 	vec3f				worldMin, worldMax, worldMag;
 	
+private:
+	// backing store when atoms come from a .atoms file (declared
+	// before allAtoms so that it outlives it)
+	MappedFile			atomFile;
+
+public:
 	// atoms
 	Atoms				allAtoms;
+	AtomAttributes			attributes;
 	
 	// whether we have loaded atoms / density grids
 	bool				hasAtoms;
+	
+	// atoms are in Morton order
+	bool				spatiallySorted;
 };
 
 static const float ATOM_RADII[5] = {
@@ -77,7 +164,9 @@ static const float ATOM_RADII[5] = {
 	1.7				// carbon
 };
 
-// CubeSequence: contains all time slices specified in a sequence
+// CubeSequence: contains all time slices specified in a sequence. This
+// is either a .seq file listing one data file per line, or a single
+// multi-frame XYZ trajectory (any other extension)
 class CubeSequence
 {
 public:
@@ -100,20 +189,39 @@ public:
 private:
 	void load_data(Timestep * t);
 	
+	// reads / builds the data of timestep index into t (no bookkeeping of
+	// loadedTimesteps, so that the prefetch thread can run it)
+	void load_timestep(Timestep * t, int index);
+	
+	// drops the oldest loaded timesteps to make room for one more
+	void make_room();
+	
+	// prefetch of the timestep after current
+	void start_prefetch();
+	void finish_prefetch();
+	static void * prefetchThreadEntry(void *);
+	
+	// macrocells of a timestep next to index that are still in core and
+	// can be updated to the positions of index (NULL if none)
+	const Macrocells * adjacentMacrocells(int index) const;
+	
 	int			start;
 	int			length;
 	int			current;
 	vector<Timestep*>	timesteps;
 	list<Timestep*>		loadedTimesteps;
 	
+	bool			prefetching;
+	int			prefetchIndex;
+	pthread_t		prefetchThread;
+	
 	// main() is our friend
 	friend int main(int, char**);
 };
 
 
 
-string getAtomType(const char * t, bool ANP = false);
-int getShaderIndex(int atomicNumber);
+int getElementId(const char * t, bool ANP = false);
 		
 #endif
 
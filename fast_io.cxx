@@ -0,0 +1,344 @@
+/* -----------------------------------------------
+ * Super nanovol
+ * Khairi Reda, 2013
+ * Electronic Visualization Laboratory
+ * www.evl.uic.edu/kreda
+ *
+ * GPL v2 License:
+ * http://www.gnu.org/licenses/gpl-2.0.html
+ * fast_io.cxx
+ *
+ * -----------------------------------------------
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "fast_io.h"
+
+/* -----------------------------------------------
+ * MappedFile
+ * -----------------------------------------------
+ */
+MappedFile::MappedFile()
+{
+	mapping = NULL;
+	mappedLength = 0;
+	skip = 0;
+	length = 0;
+	writable = false;
+}
+
+MappedFile::~MappedFile()
+{
+	close();
+}
+
+bool MappedFile::open(const char * filename, bool copyOnWrite)
+{
+	return open(filename, 0, 0, copyOnWrite);
+}
+
+bool MappedFile::open(const char * filename, uint64_t offset, uint64_t _length, bool copyOnWrite)
+{
+	close();
+
+	int fd = ::open(filename, O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (uint64_t) st.st_size <= offset)
+	{
+		::close(fd);
+		return false;
+	}
+	
+	const uint64_t available = st.st_size - offset;
+	if (_length == 0 || _length > available) {
+		_length = available;
+	}
+
+	// mmap offsets must be page aligned
+	const uint64_t pageSize = sysconf(_SC_PAGESIZE);
+	const uint64_t mapOffset = offset - offset % pageSize;
+	
+	const int prot = copyOnWrite ? PROT_READ | PROT_WRITE : PROT_READ;
+	void * m = mmap(NULL, _length + (offset - mapOffset), prot, MAP_PRIVATE, fd, mapOffset);
+	::close(fd);
+
+	if (m == MAP_FAILED) {
+		return false;
+	}
+
+	// we read the file front to back
+	madvise(m, _length + (offset - mapOffset), MADV_SEQUENTIAL);
+
+	mapping = m;
+	mappedLength = _length + (offset - mapOffset);
+	skip = offset - mapOffset;
+	length = _length;
+	writable = copyOnWrite;
+	return true;
+}
+
+void MappedFile::close()
+{
+	if (mapping)
+	{
+		munmap(mapping, mappedLength);
+		mapping = NULL;
+		mappedLength = 0;
+		skip = 0;
+		length = 0;
+		writable = false;
+	}
+}
+
+void MappedFile::adviseRandom()
+{
+	if (mapping) {
+		madvise(mapping, mappedLength, MADV_RANDOM);
+	}
+}
+
+/* -----------------------------------------------
+ * line handling
+ * -----------------------------------------------
+ */
+const char * skip_line(const char * p, const char * end)
+{
+	const char * nl = (const char *) memchr(p, '\n', end - p);
+	return nl ? nl + 1 : end;
+}
+
+const char * skip_lines(const char * p, const char * end, size_t n)
+{
+	for (; n > 0 && p < end; n--)
+	{
+		const char * nl = (const char *) memchr(p, '\n', end - p);
+		p = nl ? nl + 1 : end;
+	}
+	return p;
+}
+
+void split_lines(const char * begin, const char * end, int chunkCount, vector<const char *> & boundaries)
+{
+	boundaries.clear();
+	boundaries.push_back(begin);
+
+	const size_t len = end - begin;
+	for (int i = 1; i < chunkCount; i++)
+	{
+		const char * p = begin + (len * i) / chunkCount;
+		if (p < boundaries.back()) {
+			p = boundaries.back();
+		}
+
+		// move to the start of the next line
+		if (p > begin && p[-1] != '\n') {
+			p = skip_line(p, end);
+		}
+		boundaries.push_back(p);
+	}
+	boundaries.push_back(end);
+}
+
+size_t count_records(const char * begin, const char * end)
+{
+	size_t count = 0;
+	const char * p = begin;
+	while (p < end)
+	{
+		const char * lineEnd = (const char *) memchr(p, '\n', end - p);
+		if (!lineEnd) lineEnd = end;
+
+		if (skip_blanks(p, lineEnd) < lineEnd) {
+			count++;
+		}
+		p = lineEnd + 1;
+	}
+	return count;
+}
+
+/* -----------------------------------------------
+ * number parsing
+ * -----------------------------------------------
+ */
+
+// exact powers of ten representable in a double
+static const double POW10[23] = {
+	1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static const char * token_end(const char * p, const char * end)
+{
+	while (p < end && !is_blank(*p) && *p != '\n') p++;
+	return p;
+}
+
+// slow path: hand the token to the C library
+static const char * parse_float_libc(const char * p, const char * end, float & value)
+{
+	const char * tEnd = token_end(p, end);
+	char buffer[128];
+	size_t len = tEnd - p;
+	if (len >= sizeof(buffer)) {
+		len = sizeof(buffer) - 1;
+	}
+	memcpy(buffer, p, len);
+	buffer[len] = '\0';
+
+	char * stop;
+	value = strtof(buffer, &stop);
+	return stop == buffer ? NULL : p + (stop - buffer);
+}
+
+const char * parse_float(const char * p, const char * end, float & value)
+{
+	p = skip_blanks(p, end);
+	const char * start = p;
+
+	bool negative = false;
+	if (p < end && (*p == '-' || *p == '+'))
+	{
+		negative = *p == '-';
+		p++;
+	}
+
+	unsigned long long mantissa = 0;
+	int digits = 0, exponent = 0;
+	bool anyDigits = false, truncated = false;
+
+	// integer part
+	for (; p < end && *p >= '0' && *p <= '9'; p++)
+	{
+		anyDigits = true;
+		if (digits < 19)
+		{
+			if (mantissa || *p != '0') digits++;
+			mantissa = mantissa * 10 + (*p - '0');
+		}
+		else
+		{
+			exponent++;
+			truncated |= *p != '0';
+		}
+	}
+
+	// fractional part
+	if (p < end && *p == '.')
+	{
+		for (p++; p < end && *p >= '0' && *p <= '9'; p++)
+		{
+			anyDigits = true;
+			if (digits < 19)
+			{
+				if (mantissa || *p != '0') digits++;
+				mantissa = mantissa * 10 + (*p - '0');
+				exponent--;
+			}
+			else
+			{
+				truncated |= *p != '0';
+			}
+		}
+	}
+
+	if (!anyDigits || (p < end && (*p == 'x' || *p == 'X')))
+	{
+		// inf, nan, hex floats, or garbage
+		return parse_float_libc(start, end, value);
+	}
+
+	// exponent
+	if (p < end && (*p == 'e' || *p == 'E'))
+	{
+		const char * e = p + 1;
+		bool negExp = false;
+		if (e < end && (*e == '-' || *e == '+'))
+		{
+			negExp = *e == '-';
+			e++;
+		}
+		if (e < end && *e >= '0' && *e <= '9')
+		{
+			int exp10 = 0;
+			for (; e < end && *e >= '0' && *e <= '9'; e++)
+			{
+				if (exp10 < 100000) exp10 = exp10 * 10 + (*e - '0');
+			}
+			exponent += negExp ? -exp10 : exp10;
+			p = e;
+		}
+	}
+
+	// fast path: mantissa and power of ten are exact doubles, so the
+	// quotient/product is the correctly rounded double
+	if (!truncated && mantissa <= (1ULL << 53) && exponent >= -22 && exponent <= 22)
+	{
+		double d = (double) mantissa;
+		d = exponent < 0 ? d / POW10[-exponent] : d * POW10[exponent];
+
+		// double -> float rounding gives the correctly rounded float unless
+		// d landed exactly half way between two floats
+		float f = (float) d;
+		if ((double) f != d)
+		{
+			float g = nextafterf(f, (double) f < d ? HUGE_VALF : -HUGE_VALF);
+			if (((double) f + (double) g) * 0.5 == d) {
+				return parse_float_libc(start, end, value);
+			}
+		}
+		value = negative ? -f : f;
+		return p;
+	}
+
+	return parse_float_libc(start, end, value);
+}
+
+const char * parse_long(const char * p, const char * end, long & value)
+{
+	p = skip_blanks(p, end);
+
+	bool negative = false;
+	if (p < end && (*p == '-' || *p == '+'))
+	{
+		negative = *p == '-';
+		p++;
+	}
+
+	if (p == end || *p < '0' || *p > '9') {
+		return NULL;
+	}
+
+	long v = 0;
+	for (; p < end && *p >= '0' && *p <= '9'; p++) {
+		v = v * 10 + (*p - '0');
+	}
+	value = negative ? -v : v;
+	return p;
+}
+
+const char * parse_token(const char * p, const char * end, char * buffer, size_t bufferSize)
+{
+	p = skip_blanks(p, end);
+	const char * tEnd = token_end(p, end);
+	if (tEnd == p) {
+		return NULL;
+	}
+
+	size_t len = tEnd - p;
+	if (len >= bufferSize) {
+		len = bufferSize - 1;
+	}
+	memcpy(buffer, p, len);
+	buffer[len] = '\0';
+	return tEnd;
+}
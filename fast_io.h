@@ -0,0 +1,90 @@
+/* -----------------------------------------------
+ * Super nanovol
+ * Khairi Reda, 2013
+ * Electronic Visualization Laboratory
+ * www.evl.uic.edu/kreda
+ *
+ * GPL v2 License:
+ * http://www.gnu.org/licenses/gpl-2.0.html
+ * fast_io.h
+ *
+ * Memory mapped file access and fast, locale-free
+ * text parsing used by the atom loaders
+ * -----------------------------------------------
+ */
+
+#ifndef _FAST_IO_H___
+#define _FAST_IO_H___
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+using namespace std;
+
+// A memory mapping of a file. The mapping is read-only unless opened
+// copy-on-write: writes then go to private pages and never reach the file.
+class MappedFile
+{
+public:
+	MappedFile();
+	~MappedFile();
+
+	bool open(const char * filename, bool copyOnWrite = false);
+	
+	// maps only [offset, offset+length) of the file (length 0: up to the end)
+	bool open(const char * filename, uint64_t offset, uint64_t length, bool copyOnWrite = false);
+	void close();
+
+	bool isOpen() const { return mapping != NULL; }
+	const char * data() const { return (const char *) mapping + skip; }
+	char * writableData() { return writable ? (char *) mapping + skip : NULL; }
+	size_t size() const { return length; }
+	
+	// tell the kernel we will jump around rather than read front to back
+	void adviseRandom();
+
+private:
+	// no copying
+	MappedFile(const MappedFile &);
+	MappedFile & operator=(const MappedFile &);
+
+	void *				mapping;
+	size_t				mappedLength;
+	size_t				skip;		// from page boundary to the requested offset
+	size_t				length;
+	bool				writable;
+};
+
+// whitespace within a line (newlines are record separators)
+inline bool is_blank(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+inline const char * skip_blanks(const char * p, const char * end)
+{
+	while (p < end && is_blank(*p)) p++;
+	return p;
+}
+
+// returns pointer to the first character of the next line
+const char * skip_line(const char * p, const char * end);
+
+// skips n lines; returns end if the text has fewer
+const char * skip_lines(const char * p, const char * end, size_t n);
+
+// splits [begin, end) into (at most) chunkCount line-aligned pieces
+// boundaries will contain chunkCount+1 pointers
+void split_lines(const char * begin, const char * end, int chunkCount, vector<const char *> & boundaries);
+
+// counts lines that have at least one non-blank character
+size_t count_records(const char * begin, const char * end);
+
+// Number parsers: skip leading blanks, parse a number and return a pointer
+// past it, or NULL if there is no number. parse_float gives results identical
+// to strtof / scanf("%f") (correctly rounded) but does not depend on the locale
+const char * parse_float(const char * p, const char * end, float & value);
+const char * parse_long(const char * p, const char * end, long & value);
+
+// copies the next whitespace delimited token into buffer (NULL if none)
+const char * parse_token(const char * p, const char * end, char * buffer, size_t bufferSize);
+
+#endif
@@ -19,8 +19,8 @@ template<typename T>
 class Grid3
 {
 public:
-	Grid3(): d1(0), d2(0), d3(0), data(0) {}
-	Grid3(int _d1, int _d2, int _d3): d1(0), d2(0), d3(0), data(0) 
+	Grid3(): d1(0), d2(0), d3(0), data(0), owned(true) {}
+	Grid3(int _d1, int _d2, int _d3): d1(0), d2(0), d3(0), data(0), owned(true)
 	{
 		resize(_d1, _d2, _d3);
 	}
@@ -32,7 +32,10 @@ public:
 	
 	void resize(int i, int j, int k)
 	{
-		delete [] data;
+		if (owned) {
+			delete [] data;
+		}
+		owned = true;
 		d1 = i;
 		d2 = j;
 		d3 = k;
@@ -49,10 +52,24 @@ public:
 		data = new T[ d1*d2*d3 ];
 	}
 	
+	// uses memory owned by someone else (e.g. a mapped file)
+	void wrap(int i, int j, int k, T * p)
+	{
+		release();
+		d1 = i;
+		d2 = j;
+		d3 = k;
+		data = p;
+		owned = false;
+	}
+	
 	void release()
 	{
-		delete [] data;
+		if (owned) {
+			delete [] data;
+		}
 		data = NULL;
+		owned = true;
 		d1 = d2 = d3 = 0;
 	}
 	
@@ -63,6 +80,7 @@ public:
 	
 	int d1, d2, d3;
 	T * data;
+	bool owned;
 };
 
 #endif
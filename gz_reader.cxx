@@ -0,0 +1,221 @@
+/* -----------------------------------------------
+ * Super nanovol
+ * Khairi Reda, 2013
+ * Electronic Visualization Laboratory
+ * www.evl.uic.edu/kreda
+ *
+ * GPL v2 License:
+ * http://www.gnu.org/licenses/gpl-2.0.html
+ * gz_reader.cxx
+ *
+ * -----------------------------------------------
+ */
+
+#include <iostream>
+#include <string.h>
+#include <sys/stat.h>
+#include "gz_reader.h"
+
+// uncompressed bytes per block, and how many blocks may wait in the queue
+static const size_t	BLOCK_SIZE	= 4 << 20;
+static const size_t	QUEUE_LENGTH	= 8;
+
+GzipBlockReader::GzipBlockReader()
+{
+	file = NULL;
+	fileSize = 0;
+	bytesRead = 0;
+	running = false;
+	finished = false;
+	failed = false;
+
+	pthread_mutex_init(&lock, NULL);
+	pthread_cond_init(&notEmpty, NULL);
+	pthread_cond_init(&notFull, NULL);
+}
+
+GzipBlockReader::~GzipBlockReader()
+{
+	close();
+
+	pthread_cond_destroy(&notFull);
+	pthread_cond_destroy(&notEmpty);
+	pthread_mutex_destroy(&lock);
+}
+
+bool GzipBlockReader::open(const char * filename, int headerLines, vector<string> & header)
+{
+	close();
+
+	struct stat st;
+	if (stat(filename, &st) != 0) {
+		return false;
+	}
+	fileSize = st.st_size;
+
+	file = gzopen(filename, "rb");
+	if (!file) {
+		return false;
+	}
+	gzbuffer(file, 1 << 20);
+
+	// header lines are read right away
+	header.clear();
+	for (int i = 0; i < headerLines; i++)
+	{
+		string line;
+		char buffer[4096];
+		bool complete = false;
+		while (!complete && gzgets(file, buffer, sizeof(buffer)))
+		{
+			line += buffer;
+			complete = line[line.length()-1] == '\n';
+		}
+		if (line.length() == 0) {
+			break;
+		}
+		bytesRead += line.length();
+		header.push_back(line);
+	}
+
+	finished = false;
+	failed = false;
+	running = true;
+	if (0 != pthread_create(&readThread, NULL, &GzipBlockReader::readThreadEntry, this))
+	{
+		running = false;
+		gzclose(file);
+		file = NULL;
+		return false;
+	}
+	return true;
+}
+
+bool GzipBlockReader::close()
+{
+	if (running)
+	{
+		// unblock the reader if nobody consumed everything
+		pthread_mutex_lock(&lock);
+		finished = true;
+		pthread_cond_broadcast(&notFull);
+		pthread_mutex_unlock(&lock);
+
+		pthread_join(readThread, NULL);
+		running = false;
+	}
+
+	while (blocks.size() > 0)
+	{
+		delete blocks.front();
+		blocks.pop_front();
+	}
+
+	if (file)
+	{
+		gzclose(file);
+		file = NULL;
+	}
+	return !failed;
+}
+
+TextBlock * GzipBlockReader::next()
+{
+	pthread_mutex_lock(&lock);
+	while (blocks.size() == 0 && !finished) {
+		pthread_cond_wait(&notEmpty, &lock);
+	}
+
+	TextBlock * block = NULL;
+	if (blocks.size() > 0)
+	{
+		block = blocks.front();
+		blocks.pop_front();
+		pthread_cond_signal(&notFull);
+	}
+	pthread_mutex_unlock(&lock);
+	return block;
+}
+
+void GzipBlockReader::push(TextBlock * block)
+{
+	pthread_mutex_lock(&lock);
+	while (blocks.size() >= QUEUE_LENGTH && !finished) {
+		pthread_cond_wait(&notFull, &lock);
+	}
+
+	if (finished)
+	{
+		// reader was closed early
+		delete block;
+	}
+	else
+	{
+		blocks.push_back(block);
+		pthread_cond_signal(&notEmpty);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+void GzipBlockReader::readThreadLoop()
+{
+	// partial line left over from the previous block
+	vector<char> carry;
+	size_t sequence = 0;
+	bool eof = false;
+
+	while (!eof)
+	{
+		TextBlock * block = new TextBlock;
+		block->sequence = sequence++;
+		block->text.resize(carry.size() + BLOCK_SIZE);
+		if (carry.size() > 0) {
+			memcpy(&block->text[0], &carry[0], carry.size());
+		}
+
+		int n = gzread(file, &block->text[carry.size()], BLOCK_SIZE);
+		if (n < 0)
+		{
+			int err;
+			cerr << "gzip read error: " << gzerror(file, &err) << endl;
+			failed = true;
+			delete block;
+			break;
+		}
+		bytesRead += n;
+		eof = n < (int) BLOCK_SIZE;
+
+		size_t length = carry.size() + n;
+		size_t cut = length;
+		if (!eof)
+		{
+			// cut after the last newline, the rest goes to the next block
+			while (cut > 0 && block->text[cut-1] != '\n') {
+				cut--;
+			}
+		}
+
+		// (cut == 0: no line ends in this block, keep all of it for the next one)
+		carry.assign(block->text.begin() + cut, block->text.begin() + length);
+		block->text.resize(cut);
+
+		if (block->text.size() > 0) {
+			push(block);
+		}
+		else {
+			delete block;
+		}
+	}
+
+	pthread_mutex_lock(&lock);
+	finished = true;
+	pthread_cond_broadcast(&notEmpty);
+	pthread_mutex_unlock(&lock);
+}
+
+void * GzipBlockReader::readThreadEntry(void * p)
+{
+	GzipBlockReader * me = (GzipBlockReader *) p;
+	me->readThreadLoop();
+	return NULL;
+}
@@ -0,0 +1,81 @@
+/* -----------------------------------------------
+ * Super nanovol
+ * Khairi Reda, 2013
+ * Electronic Visualization Laboratory
+ * www.evl.uic.edu/kreda
+ *
+ * GPL v2 License:
+ * http://www.gnu.org/licenses/gpl-2.0.html
+ * gz_reader.h
+ *
+ * Decompresses a gzip file on a background thread
+ * into line-aligned blocks of text, handed to the
+ * parser threads through a bounded queue
+ * -----------------------------------------------
+ */
+
+#ifndef _GZ_READER_H___
+#define _GZ_READER_H___
+
+#include <list>
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include <zlib.h>
+
+using namespace std;
+
+// a run of complete lines
+struct TextBlock
+{
+	size_t			sequence;	// position of the block in the file
+	vector<char>		text;
+
+	const char * begin() const { return text.empty() ? NULL : &text[0]; }
+	const char * end() const { return begin() + text.size(); }
+};
+
+class GzipBlockReader
+{
+public:
+	GzipBlockReader();
+	~GzipBlockReader();
+
+	// Opens filename, reads the first headerLines lines into header and starts
+	// decompressing the rest in the background.
+	bool open(const char * filename, int headerLines, vector<string> & header);
+
+	// Next block in file order (any thread). Blocks while the queue is empty;
+	// returns NULL at the end of the file. The caller deletes the block.
+	TextBlock * next();
+
+	// waits for the decompression thread; false on a read error
+	bool close();
+
+	size_t compressedSize() const { return fileSize; }
+	size_t uncompressedSize() const { return bytesRead; }
+
+private:
+	// no copying
+	GzipBlockReader(const GzipBlockReader &);
+	GzipBlockReader & operator=(const GzipBlockReader &);
+
+	static void * readThreadEntry(void * p);
+	void readThreadLoop();
+	void push(TextBlock * block);
+
+	gzFile			file;
+	size_t			fileSize;
+	size_t			bytesRead;
+	bool			running;
+	bool			finished;
+	bool			failed;
+
+	pthread_t		readThread;
+	pthread_mutex_t		lock;
+	pthread_cond_t		notEmpty;
+	pthread_cond_t		notFull;
+	list<TextBlock *>	blocks;
+};
+
+#endif
@@ -12,259 +12,2363 @@
  */
 
 #include <assert.h>
+#include <float.h>
+#include <limits.h>
 #include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <fstream>
+#ifdef __linux__
+#include <omp.h>
+#endif
+#ifdef DO_MPI
+#include <mpi.h>
+#endif
 #include "atoms.h"
+#include "atom_file.h"
 #include "data.h"
 #include "macrocells.h"
+#include "charge_volume.h"
+#include "Timer.h"
 
-gpuAtom & gpuAtom::operator=(const Atom & anAtom)
+// memory we are willing to spend on per-thread cell histograms
+static const size_t HISTOGRAM_BUDGET = 512 << 20;
+
+// add atoms only to cells their sphere overlaps (rather than all cells
+// their bounding box overlaps)
+static bool exactCellOverlap = true;
+
+void setExactCellOverlap(bool exact)
+{
+	exactCellOverlap = exact;
+}
+
+// sort atoms and lay out cell index lists along a Z-order curve
+static bool mortonLayout = false;
+
+void setMortonLayout(bool morton)
+{
+	mortonLayout = morton;
+}
+
+static MC_REF_MODE refModeDefault = MC_REF_MODE_DEFAULT;
+
+void setMacrocellRefMode(MC_REF_MODE mode)
+{
+	refModeDefault = mode;
+}
+
+// incremental updates re-bin at most this fraction of the atoms
+static float churnLimit = 0.05f;
+
+void setMacrocellChurnLimit(float limit)
+{
+	churnLimit = limit;
+}
+
+// slack around the atoms of grids that are meant to be updated
+static float updateMargin = 3.0f;
+
+void setMacrocellUpdateMargin(float angstroms)
+{
+	updateMargin = max(0.0f, angstroms);
+}
+
+// split full builds across the MPI ranks
+static bool distributedBuild = false;
+
+void setDistributedBuild(bool distributed)
+{
+	distributedBuild = distributed;
+}
+
+// an atom's sphere in grid space (relative to worldMin, 1 unit = 1 macrocell).
+// Cells are assigned from this alone, so the same gpuAtom always lands in the
+// same cells (incremental updates rely on that).
+struct GridSphere
+{
+	float x, y, z, r;
+};
+
+static inline GridSphere grid_sphere(const Atoms & vAtoms, size_t i, const vec3f & worldMin, float vpa, float atomScale)
+{
+	// radius == Van der Waals radius
+	GridSphere s;
+	s.x = (vAtoms.x[i] - worldMin.x()) * vpa;
+	s.y = (vAtoms.y[i] - worldMin.y()) * vpa;
+	s.z = (vAtoms.z[i] - worldMin.z()) * vpa;
+	s.r = vAtoms.radius[i] * atomScale * vpa;
+	return s;
+}
+
+// range of cells the bounding box of the sphere overlaps
+static inline void sphere_cell_range(const GridSphere & s, const vec3f & gridDimMinusOne, vec3i & cellMin, vec3i & cellMax)
+{
+	vec3 ball_min(s.x - s.r, s.y - s.r, s.z - s.r);
+	vec3 ball_max(s.x + s.r, s.y + s.r, s.z + s.r);
+	
+	ball_min = max(ball_min, vec3(0.0, 0.0, 0.0));
+	ball_max = min(ball_max, gridDimMinusOne);
+	
+	cellMin = vec3i( int(ball_min.x()), int(ball_min.y()), int(ball_min.z()) );
+	cellMax = vec3i( int(ball_max.x()), int(ball_max.y()), int(ball_max.z()) );
+}
+
+// squared distance from x to the interval [c, c+1]
+static inline float cell_distance2(float x, int c)
+{
+	const float d = x < c ? c - x : (x > c + 1 ? x - (c + 1) : 0.0f);
+	return d * d;
+}
+
+// Calls add(cell index) for every cell the sphere is put in: all cells in its
+// bounding box, or (exactCellOverlap) only those it overlaps
+template<typename F>
+static inline void for_sphere_cells(
+	const GridSphere & s,
+	const vec3i & gridDim, const vec3f & gridDimMinusOne,
+	F & add
+)
+{
+	vec3i cMin, cMax;
+	sphere_cell_range(s, gridDimMinusOne, cMin, cMax);
+	
+	if (!exactCellOverlap)
+	{
+		for (int m = cMin.z(); m <= cMax.z(); m++)
+			for (int l = cMin.y(); l <= cMax.y(); l++)
+				for (int k = cMin.x(); k <= cMax.x(); k++)
+				{
+					add( k + gridDim.x() * (l + gridDim.y() * m) );
+				}
+		return;
+	}
+	
+	const float r2 = s.r * s.r;
+	for (int m = cMin.z(); m <= cMax.z(); m++)
+	{
+		const float dz2 = cell_distance2(s.z, m);
+		for (int l = cMin.y(); l <= cMax.y(); l++)
+		{
+			const float dyz2 = dz2 + cell_distance2(s.y, l);
+			if (dyz2 > r2) continue;
+			
+			for (int k = cMin.x(); k <= cMax.x(); k++)
+			{
+				if (dyz2 + cell_distance2(s.x, k) <= r2) {
+					add( k + gridDim.x() * (l + gridDim.y() * m) );
+				}
+			}
+		}
+	}
+}
+
+// for_sphere_cells callbacks for the count and scatter passes
+struct CountCell
+{
+	unsigned int * histogram;
+	void operator()(size_t c) { histogram[c]++; }
+};
+
+typedef pair<size_t, unsigned int> CellAtom;
+typedef vector<CellAtom> CellAtoms;
+
+struct CollectCell
+{
+	vector<size_t> * cells;
+	void operator()(size_t c) { cells->push_back(c); }
+};
+
+struct ScatterCell
+{
+	unsigned int * offsets;
+	unsigned int * indices;
+	const Macrocell * cells;
+	unsigned int atom;
+	void operator()(size_t c) { indices[ cells[c].ballStart + offsets[c]++ ] = atom; }
+};
+
+// cells in Z-order
+static void z_order_cells(const vec3i & gridDim, vector<size_t> & cellOrder)
+{
+	vector< pair<uint64_t, size_t> > cellKeys;
+	cellKeys.reserve( (size_t) gridDim.x() * gridDim.y() * gridDim.z() );
+	for (int m = 0; m < gridDim.z(); m++)
+		for (int l = 0; l < gridDim.y(); l++)
+			for (int k = 0; k < gridDim.x(); k++)
+			{
+				cellKeys.push_back( make_pair(morton_encode(k, l, m), k + gridDim.x() * (l + gridDim.y() * (size_t) m)) );
+			}
+	sort(cellKeys.begin(), cellKeys.end());
+	
+	cellOrder.resize(cellKeys.size());
+	for (size_t c = 0; c < cellKeys.size(); c++) {
+		cellOrder[c] = cellKeys[c].second;
+	}
+}
+
+// (cell, atom) pairs to per-cell runs of atoms: cell c owns atoms[start[c] .. start[c+1])
+static void group_by_cell(const CellAtoms & pairs, size_t totalCells, vector<size_t> & start, vector<unsigned int> & atoms)
+{
+	start.assign(totalCells + 1, 0);
+	for (size_t n = 0; n < pairs.size(); n++) {
+		start[ pairs[n].first + 1 ]++;
+	}
+	for (size_t c = 0; c < totalCells; c++) {
+		start[c+1] += start[c];
+	}
+
+	vector<size_t> next(start.begin(), start.end() - 1);
+	atoms.resize(pairs.size());
+	for (size_t n = 0; n < pairs.size(); n++) {
+		atoms[ next[ pairs[n].first ]++ ] = pairs[n].second;
+	}
+}
+
+#ifdef DO_MPI
+// MPI counts are ints: larger arrays are shared in pieces
+static const size_t MPI_PIECE = (size_t) 1 << 28;
+
+// every rank's range [first[r], first[r+1]) of data to all ranks
+static void allgather_ranges(unsigned int * data, const vector<size_t> & first)
 {
-	this->x = anAtom.x;
-	this->y = anAtom.y;
-	this->z = anAtom.z;
+	const int ranks = (int) first.size() - 1;
+	if (first.back() <= (size_t) INT_MAX)
+	{
+		vector<int> counts(ranks), displs(ranks);
+		for (int r = 0; r < ranks; r++)
+		{
+			counts[r] = (int) (first[r+1] - first[r]);
+			displs[r] = (int) first[r];
+		}
+		MPI_Allgatherv(MPI_IN_PLACE, 0, MPI_DATATYPE_NULL, data, &counts[0], &displs[0], MPI_UNSIGNED, MPI_COMM_WORLD);
+		return;
+	}
 	
-	int atomicNumber;
+	// offsets past INT_MAX: one rank at a time
+	for (int r = 0; r < ranks; r++)
+	{
+		for (size_t i = first[r]; i < first[r+1]; i += MPI_PIECE) {
+			MPI_Bcast(data + i, (int) min(MPI_PIECE, first[r+1] - i), MPI_UNSIGNED, r, MPI_COMM_WORLD);
+		}
+	}
+}
+
+// The cells a rank lists atoms for in a distributed build: a contiguous range
+// of the layout (memory or Z-order), so that their indices are contiguous too
+struct CellSlab
+{
+	const size_t *	position;		// layout position of every cell (NULL: memory order)
+	size_t		first, last;		// [first, last) of the layout
+	vec3i		lo, hi;			// cells the slab spans
 	
-	assert( anAtom.atomType.length() > 0);
-	atomicNumber = lookUpAtom( anAtom.atomType ).atomic_number;
-	assert(atomicNumber > 0);
-	this->index = getShaderIndex(atomicNumber);
-	assert(this->index >= 0);
+	bool owns(size_t c) const
+	{
+		const size_t n = position ? position[c] : c;
+		return n >= first && n < last;
+	}
+	bool overlaps(const vec3i & cMin, const vec3i & cMax) const
+	{
+		return	cMin.x() <= hi.x() && cMax.x() >= lo.x() &&
+			cMin.y() <= hi.y() && cMax.y() >= lo.y() &&
+			cMin.z() <= hi.z() && cMax.z() >= lo.z();
+	}
+};
+
+// for_sphere_cells callback passing on only the cells of the slab
+template<typename F>
+struct SlabCell
+{
+	const CellSlab * slab;
+	F * add;
+	void operator()(size_t c) { if (slab->owns(c)) (*add)(c); }
+};
+
+// Cuts the layout into one slab per rank, with about as many atom centers in
+// each (first[r]: first layout position of rank r)
+static void cut_slabs(
+	const Atoms & vAtoms, const vector<unsigned int> & atomOrder, vec3f worldMin, float vpa,
+	const vec3i & gridDim, const size_t * position, int ranks, vector<size_t> & first
+)
+{
+	const size_t atomsCount = vAtoms.size();
+	const size_t totalCells = (size_t) gridDim.x() * gridDim.y() * gridDim.z();
+	vector<unsigned int> centers(totalCells, 0);
+#ifdef __linux__
+#pragma omp parallel for
+#endif
+	for (long i = 0; i < (long) atomsCount; i++)
+	{
+		const size_t src = atomOrder.empty() ? i : atomOrder[i];
+		const int k = max(0, min(gridDim.x() - 1, int((vAtoms.x[src] - worldMin.x()) * vpa)));
+		const int l = max(0, min(gridDim.y() - 1, int((vAtoms.y[src] - worldMin.y()) * vpa)));
+		const int m = max(0, min(gridDim.z() - 1, int((vAtoms.z[src] - worldMin.z()) * vpa)));
+		const size_t c = k + gridDim.x() * (l + gridDim.y() * (size_t) m);
+#ifdef __linux__
+#pragma omp atomic
+#endif
+		centers[ position ? position[c] : c ]++;
+	}
 	
-	return *this;
+	first.assign(ranks + 1, totalCells);
+	first[0] = 0;
+	size_t n = 0, below = 0;
+	for (int r = 1; r < ranks; r++)
+	{
+		while (n < totalCells && below < atomsCount * r / ranks) {
+			below += centers[n++];
+		}
+		first[r] = n;
+	}
+}
+#endif
+
+// cells needed to cover [worldMin, worldMax]
+static vec3i world_grid_dim(vec3f worldMin, vec3f worldMax, float vpa)
+{
+	const vec3 worldMag = worldMax - worldMin;
+	return vec3i(
+		(int) ceil( worldMag.x() * vpa ),
+		(int) ceil( worldMag.y() * vpa ),
+		(int) ceil( worldMag.z() * vpa )
+	);
+}
+
+void macrocellUpdateGrid(vec3f worldMin, vec3f worldMax, float vpa, vec3f & gridOrigin, vec3i & gridDim)
+{
+	const vec3 margin(updateMargin, updateMargin, updateMargin);
+	gridOrigin = worldMin - margin;
+	gridDim = world_grid_dim(gridOrigin, worldMax + margin, vpa);
 }
 
 Macrocells::Macrocells(const Atoms & vAtoms, float vpa, float _atomScale, vec3f worldMin, vec3f worldMax, string saveFile)
 {
-	refMode = MC_REF_MODE_DEFAULT;
+	refMode = refModeDefault;
+	compactRange = 0.0f;
+	hasGPUData = false;
+	blocksTex = 0;
+	visibleTex = 0;
+	macrocellsTex = 0;
+	stagedCells = NULL;
+	stagedRef = NULL;
+	stagedRefMode = refMode;
+	updated = false;
+	voxelsPerAngstrom = vpa;
+	atomScale = _atomScale;
+	
+	Timer timer;
+	timer.start();
+	build(vAtoms, worldMin, world_grid_dim(worldMin, worldMax, vpa));
+	compute_stats();
+	stats.totalTime = timer.getElapsedTimeInSec();
+	save_file(saveFile);
+}
+
+Macrocells::Macrocells(const Atoms & vAtoms, float vpa, float _atomScale, vec3f gridOrigin, vec3i gridDim, string saveFile)
+{
+	refMode = refModeDefault;
+	compactRange = 0.0f;
 	hasGPUData = false;
+	blocksTex = 0;
+	visibleTex = 0;
+	macrocellsTex = 0;
+	stagedCells = NULL;
+	stagedRef = NULL;
+	stagedRefMode = refMode;
+	updated = false;
 	voxelsPerAngstrom = vpa;
 	atomScale = _atomScale;
 	
+	Timer timer;
+	timer.start();
+	build(vAtoms, gridOrigin, gridDim);
+	compute_stats();
+	stats.totalTime = timer.getElapsedTimeInSec();
+	save_file(saveFile);
+}
+
+void Macrocells::build(const Atoms & vAtoms, vec3f gridOrigin, const vec3i & dim)
+{
+	const float vpa = voxelsPerAngstrom;
 	cout << "Building macrocells..." << endl;
+	stats = MacrocellStats();
+	stats.mode = "build";
 
 	// calculate integer square root
 	atomsCount = vAtoms.size();
-	atomsSqrt = ceil(sqrt(atomsCount));
+	if (atomsCount > UINT_MAX)
+	{
+		cerr << "Macrocells: " << atomsCount << " atoms do not fit 32-bit indices." << endl;
+		exit(1);
+	}
+	atomsSqrt = textureSide(atomsCount);
 	cout << "\t atomsCount: " << atomsCount << ", sqrt: " << atomsSqrt << ", atom scale: " << atomScale << endl; 
 	
 	// allocate memory for all atoms
-	const float fAtomsCount = (float) atomsCount;
 	allAtoms = new gpuAtom[ atomsSqrt * atomsSqrt ];
 	
-	vec3 worldMag = worldMax - worldMin;
-	gridDim.x() = (int) ceil( worldMag.x() * vpa );
-	gridDim.y() = (int) ceil( worldMag.y() * vpa );
-	gridDim.z() = (int) ceil( worldMag.z() * vpa );
+	gridDim = dim;
 	vec3f gridDimMinusOne( gridDim.x() - 1, gridDim.y() - 1, gridDim.z() - 1);
+	origin = gridOrigin;
+	hasOrigin = true;
+	exactCells = exactCellOverlap;
 	
-	// allocate memory for all temp macrocells
-	tempMacrocells.resize(gridDim.x(), gridDim.y(), gridDim.z());
 	macrocells.resize(gridDim.x(), gridDim.y(), gridDim.z());
+	const size_t totalCells = (size_t) gridDim.x() * gridDim.y() * gridDim.z();
 	
-	if (tempMacrocells.data && macrocells.data)
+	/* ---------------------------------------------
+	 * Indices are built as a compressed sparse row
+	 * structure in three passes:
+	 *   count:	atoms per cell, one histogram per
+	 *		contiguous range of atoms
+	 *   prefix sum:	cell starts, plus where each atom
+	 *		range begins within every cell
+	 *   scatter:	write atom indices into place
+	 * Atom ranges are in order, so every cell lists
+	 * its atoms in increasing index order.
+	 * A distributed build gives every MPI rank a
+	 * slab of cells, contiguous in the layout: each
+	 * rank runs both passes over the atoms that
+	 * reach its slab, and the cell counts and then
+	 * the indices of all slabs are gathered, so
+	 * that all ranks end up with the whole
+	 * structure.
+	 * ---------------------------------------------
+	 */
+	int threads = 1;
+#ifdef __linux__
+	threads = omp_get_max_threads();
+#endif
+	int rank = 0, ranks = 1;
+#ifdef DO_MPI
+	int mpiInitialized = 0;
+	MPI_Initialized(&mpiInitialized);
+	if (distributedBuild && mpiInitialized)
 	{
-		cout << "\t mem allocated." << endl;
+		MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+		MPI_Comm_size(MPI_COMM_WORLD, &ranks);
 	}
-	else
+#endif
+	Timer timer;
+	double combineTime = 0.0;
+	
+	// Morton layout: atoms are sorted by the Z-order code of their cell
+	// (keeping file order within a cell), cells are laid out in Z-order
+	vector<size_t> cellOrder;
+	double sortTime = 0.0;
+	if (mortonLayout)
+	{
+		timer.start();
+		
+		vector< pair<uint64_t, unsigned int> > keys(atomsCount);
+#ifdef __linux__
+#pragma omp parallel for
+#endif
+		for (long i = 0; i < (long) atomsCount; i++)
+		{
+			const int k = max(0, min(gridDim.x() - 1, int((vAtoms.x[i] - gridOrigin.x()) * vpa)));
+			const int l = max(0, min(gridDim.y() - 1, int((vAtoms.y[i] - gridOrigin.y()) * vpa)));
+			const int m = max(0, min(gridDim.z() - 1, int((vAtoms.z[i] - gridOrigin.z()) * vpa)));
+			keys[i] = make_pair( morton_encode(k, l, m), (unsigned int) i );
+		}
+		sort(keys.begin(), keys.end());
+		
+		atomOrder.resize(atomsCount);
+		for (size_t i = 0; i < atomsCount; i++) {
+			atomOrder[i] = keys[i].second;
+		}
+		
+		z_order_cells(gridDim, cellOrder);
+		sortTime = timer.getElapsedTimeInSec();
+	}
+	
+#ifdef DO_MPI
+	// this rank's slab
+	CellSlab slab;
+	vector<size_t> position, slabFirst;
+	if (ranks > 1)
+	{
+		if (!cellOrder.empty())
+		{
+			position.resize(totalCells);
+			for (size_t n = 0; n < totalCells; n++) {
+				position[ cellOrder[n] ] = n;
+			}
+		}
+		slab.position = position.empty() ? NULL : &position[0];
+		cut_slabs(vAtoms, atomOrder, gridOrigin, vpa, gridDim, slab.position, ranks, slabFirst);
+		slab.first = slabFirst[rank];
+		slab.last = slabFirst[rank+1];
+		
+		slab.lo = gridDim;
+		slab.hi = vec3i(-1, -1, -1);
+		for (size_t n = slab.first; n < slab.last; n++)
+		{
+			const size_t c = cellOrder.empty() ? n : cellOrder[n];
+			const vec3i cell(c % gridDim.x(), (c / gridDim.x()) % gridDim.y(), c / ((size_t) gridDim.x() * gridDim.y()));
+			slab.lo = vec3i( min(slab.lo.x(), cell.x()), min(slab.lo.y(), cell.y()), min(slab.lo.z(), cell.z()) );
+			slab.hi = vec3i( max(slab.hi.x(), cell.x()), max(slab.hi.y(), cell.y()), max(slab.hi.z(), cell.z()) );
+		}
+	}
+#endif
+	
+	const int partitions = (int) max((size_t) 1, min((size_t) threads, HISTOGRAM_BUDGET / (totalCells * sizeof(unsigned int))));
+	vector<unsigned int> counts( (size_t) partitions * totalCells, 0 );
+	
+	if (counts.size() == 0 || !macrocells.data)
 	{
 		cerr << "\t Could not allocate memory!" << endl;
 		exit(1);
 	}
+	cout << "\t mem allocated (" << partitions << " histograms";
+	if (ranks > 1) {
+		cout << ", rank " << rank << " of " << ranks;
+	}
+	cout << ")." << endl;
 	
-	cout << "\t looking at all atoms..." << flush;
+	timer.start();
 	
-	// loop through all atoms
-	size_t counter = 0;
-	size_t indicesSize = 0;
+	// count pass (also converts atoms to their GPU form; every rank converts
+	// all of them, which is cheaper than sending them around)
+	size_t boxIndices = 0;
+#ifdef __linux__
+#pragma omp parallel for schedule(static, 1) reduction(+: boxIndices)
+#endif
+	for (int p = 0; p < partitions; p++)
+	{
+		CountCell count;
+		count.histogram = &counts[(size_t) p * totalCells];
+		const size_t begin = atomsCount * p / partitions;
+		const size_t end = atomsCount * (p + 1) / partitions;
+		
+		for (size_t i = begin; i < end; i++)
+		{
+			const size_t src = atomOrder.empty() ? i : atomOrder[i];
+			const GridSphere sphere = grid_sphere(vAtoms, src, gridOrigin, vpa, atomScale);
+			
+			// copy atom, relative to the grid origin and scaled to grid space
+			gpuAtom & a = allAtoms[i];
+			a.x = sphere.x;
+			a.y = sphere.y;
+			a.z = sphere.z;
+			a.index = lookUpElement( vAtoms.element[src] ).shader_index;
+			assert(a.index >= 0);
+			
+			// cells the bounding box covers, for reporting
+			vec3i cMin, cMax;
+			sphere_cell_range(sphere, gridDimMinusOne, cMin, cMax);
+			boxIndices += (size_t) (cMax.x() - cMin.x() + 1) * (cMax.y() - cMin.y() + 1) * (cMax.z() - cMin.z() + 1);
+			
+#ifdef DO_MPI
+			if (ranks > 1)
+			{
+				if (slab.overlaps(cMin, cMax))
+				{
+					SlabCell<CountCell> inSlab = { &slab, &count };
+					for_sphere_cells(sphere, gridDim, gridDimMinusOne, inSlab);
+				}
+				continue;
+			}
+#endif
+			for_sphere_cells(sphere, gridDim, gridDimMinusOne, count);
+		}
+	}
+	const double countTime = timer.getElapsedTimeInSec();
+	timer.start();
+	
+	// prefix sum: per cell over partitions, turning histograms into offsets within the cell...
 	size_t maxMC = 0;
+#ifdef __linux__
+#pragma omp parallel for reduction(max: maxMC)
+#endif
+	for (long c = 0; c < (long) totalCells; c++)
+	{
+		unsigned int running = 0;
+		for (int p = 0; p < partitions; p++)
+		{
+			unsigned int & count = counts[(size_t) p * totalCells + c];
+			const unsigned int n = count;
+			count = running;
+			running += n;
+		}
+		macrocells.data[c].ballCount = running;
+		maxMC = max(maxMC, (size_t) running);
+	}
 	
-	for (size_t i = 0; i < atomsCount; i++, counter++)
+#ifdef DO_MPI
+	// ...then gathered from the ranks owning the cells...
+	if (ranks > 1)
 	{
-		// copy atom
-		allAtoms[i] = vAtoms[i];
-		gpuAtom & a = allAtoms[i];
-
-		// radius == Van der Waals radius		
-		float radius = vAtoms[i].radius;
-		
-		// start from worldMin
-		a.x -= worldMin.x();
-		a.y -= worldMin.y();
-		a.z -= worldMin.z();
-		vec3f aLoc(a.x, a.y, a.z);
-
-		vec3 ball_min = aLoc - vec3(radius*atomScale, radius*atomScale, radius*atomScale);
-		vec3 ball_max = aLoc + vec3(radius*atomScale, radius*atomScale, radius*atomScale);
+		Timer combineTimer;
+		combineTimer.start();
+		vector<unsigned int> slabCounts(totalCells);
+		for (size_t n = slab.first; n < slab.last; n++) {
+			slabCounts[n] = macrocells.data[ cellOrder.empty() ? n : cellOrder[n] ].ballCount;
+		}
+		allgather_ranges(&slabCounts[0], slabFirst);
 		
-		ball_min *= vpa;
-		ball_max *= vpa;
+		maxMC = 0;
+		for (size_t n = 0; n < totalCells; n++)
+		{
+			macrocells.data[ cellOrder.empty() ? n : cellOrder[n] ].ballCount = slabCounts[n];
+			maxMC = max(maxMC, (size_t) slabCounts[n]);
+		}
+		combineTime += combineTimer.getElapsedTimeInSec();
+	}
+#endif
 	
-		ball_min = max(ball_min, vec3(0.0, 0.0, 0.0));
-		ball_max = min(ball_max, gridDimMinusOne);
-
-		// add atom to cells it crosses
-		for (int m = int(ball_min.z()); m <= int(ball_max.z()); m++)
-			for (int l = int(ball_min.y()); l <= int(ball_max.y()); l++)
-				for (int k = int(ball_min.x()); k <= int(ball_max.x()); k++)
+	// ...then over cells in memory (or Z-) order
+	size_t indicesSize = 0;
+	for (size_t n = 0; n < totalCells; n++)
+	{
+		const size_t c = cellOrder.empty() ? n : cellOrder[n];
+		macrocells.data[c].ballStart = indicesSize;
+		indicesSize += macrocells.data[c].ballCount;
+	}
+	const double prefixTime = timer.getElapsedTimeInSec();
+	timer.start();
+	
+	this->indicesCount = indicesSize;
+	this->maxMCDensity = maxMC;
+	
+	// make memory for indices
+	indicesSqrt = textureSide(indicesCount);
+ 	indices = new unsigned int[ indicesSqrt * indicesSqrt ];
+	
+	// scatter pass
+#ifdef __linux__
+#pragma omp parallel for schedule(static, 1)
+#endif
+	for (int p = 0; p < partitions; p++)
+	{
+		ScatterCell scatter;
+		scatter.offsets = &counts[(size_t) p * totalCells];
+		scatter.indices = indices;
+		scatter.cells = macrocells.data;
+		const size_t begin = atomsCount * p / partitions;
+		const size_t end = atomsCount * (p + 1) / partitions;
+		
+		for (size_t i = begin; i < end; i++)
+		{
+			scatter.atom = i;
+			const GridSphere sphere = grid_sphere(vAtoms, atomOrder.empty() ? i : atomOrder[i], gridOrigin, vpa, atomScale);
+#ifdef DO_MPI
+			if (ranks > 1)
+			{
+				vec3i cMin, cMax;
+				sphere_cell_range(sphere, gridDimMinusOne, cMin, cMax);
+				if (slab.overlaps(cMin, cMax))
 				{
-					vector<unsigned int> & mc = tempMacrocells.get_data(k, l, m);
-					mc.push_back(i);
-					indicesSize++;
-					
-					maxMC = max(maxMC, mc.size());
+					SlabCell<ScatterCell> inSlab = { &slab, &scatter };
+					for_sphere_cells(sphere, gridDim, gridDimMinusOne, inSlab);
 				}
+				continue;
+			}
+#endif
+			for_sphere_cells(sphere, gridDim, gridDimMinusOne, scatter);
+		}
+	}
+	const double scatterTime = timer.getElapsedTimeInSec();
+	
+#ifdef DO_MPI
+	if (ranks > 1)
+	{
+		// the slabs' index ranges are contiguous, in slab order
+		timer.start();
+		vector<size_t> indexFirst(ranks + 1, indicesCount);
+		for (int r = 0; r < ranks; r++)
+		{
+			if (slabFirst[r] < totalCells) {
+				indexFirst[r] = macrocells.data[ cellOrder.empty() ? slabFirst[r] : cellOrder[ slabFirst[r] ] ].ballStart;
+			}
+		}
+		allgather_ranges(indices, indexFirst);
+		combineTime += timer.getElapsedTimeInSec();
+	}
+#endif
+	
+	cout << "\t max mc density: " << maxMC << endl;
+	cout << "\t indices: " << indicesCount;
+	if (exactCellOverlap && indicesCount > 0) {
+		cout << " (bounding boxes: " << boxIndices << ", reduction " << double(boxIndices) / double(indicesCount) << "x)";
+	}
+	cout << endl;
+	if (mortonLayout) {
+		cout << "\t morton sort: " << sortTime << " sec" << endl;
+	}
+	cout << "\t count: " << countTime << " sec, prefix sum: " << prefixTime << " sec, scatter: " << scatterTime << " sec";
+	if (ranks > 1) {
+		cout << ", combine (" << ranks << " ranks): " << combineTime << " sec";
+	}
+	cout << endl;
+	
+	stats.ranks = ranks;
+	stats.combineTime = combineTime;
+	stats.sortTime = sortTime;
+	stats.countTime = countTime;
+	stats.prefixTime = prefixTime;
+	stats.scatterTime = scatterTime;
+	
+	timer.start();
+	build_blocks();
+	stats.blocksTime = timer.getElapsedTimeInSec();
+	
+	timer.start();
+	build_distances();
+	stats.distancesTime = timer.getElapsedTimeInSec();
+	cout << "Done!" << endl;
+}
+
+Macrocells::Macrocells(const Macrocells & previous, const Atoms & vAtoms, vec3f worldMin, vec3f worldMax, string saveFile)
+{
+	refMode = refModeDefault;
+	compactRange = 0.0f;
+	hasGPUData = false;
+	blocksTex = 0;
+	visibleTex = 0;
+	macrocellsTex = 0;
+	stagedCells = NULL;
+	stagedRef = NULL;
+	stagedRefMode = refMode;
+	voxelsPerAngstrom = previous.voxelsPerAngstrom;
+	atomScale = previous.atomScale;
+	allAtoms = NULL;
+	indices = NULL;
+	
+	Timer timer;
+	timer.start();
+	updated = update(previous, vAtoms, worldMin, worldMax);
+	if (!updated)
+	{
+		// rebuild with slack again, so that the next frames can be updated
+		vec3f gridOrigin;
+		vec3i dim;
+		macrocellUpdateGrid(worldMin, worldMax, voxelsPerAngstrom, gridOrigin, dim);
+		build(vAtoms, gridOrigin, dim);
+	}
+	compute_stats();
+	stats.totalTime = timer.getElapsedTimeInSec();
+	save_file(saveFile);
+}
+
+bool Macrocells::update(const Macrocells & previous, const Atoms & vAtoms, vec3f worldMin, vec3f worldMax)
+{
+	if (	churnLimit <= 0.0f || !previous.hasOrigin || 
+		previous.exactCells != exactCellOverlap ||
+		previous.atomsCount != vAtoms.size()
+	)
+	{
+		return false;
+	}
+	
+	// atoms have to stay within the previous grid
+	const float vpa = voxelsPerAngstrom;
+	const vec3i & prevDim = previous.gridDim;
+	const vec3 gridMax = previous.origin + vec3(prevDim.x(), prevDim.y(), prevDim.z()) / vpa;
+	if (	worldMin.x() < previous.origin.x() || worldMin.y() < previous.origin.y() || worldMin.z() < previous.origin.z() ||
+		worldMax.x() > gridMax.x() || worldMax.y() > gridMax.y() || worldMax.z() > gridMax.z()
+	)
+	{
+		cout << "Atoms left the macrocell grid, rebuilding." << endl;
+		return false;
+	}
+	
+	cout << "Updating macrocells..." << endl;
+	Timer timer;
+	timer.start();
+	
+	gridDim = prevDim;
+	origin = previous.origin;
+	hasOrigin = true;
+	exactCells = previous.exactCells;
+	atomOrder = previous.atomOrder;
+	atomsCount = previous.atomsCount;
+	atomsSqrt = previous.atomsSqrt;
+	
+	const vec3f gridDimMinusOne( gridDim.x() - 1, gridDim.y() - 1, gridDim.z() - 1);
+	const size_t totalCells = (size_t) gridDim.x() * gridDim.y() * gridDim.z();
+	
+	// new positions, and which atoms changed cells
+	allAtoms = new gpuAtom[ atomsSqrt * atomsSqrt ];
+	vector<unsigned char> changed(atomsCount, 0);
+	size_t changedCount = 0, elementChanges = 0;
+	
+	// a thread past the limit on its own means the total is too, so it can stop early
+	const size_t churnCount = (size_t) (churnLimit * atomsCount);
+	
+#ifdef __linux__
+#pragma omp parallel reduction(+: changedCount, elementChanges)
+#endif
+	{
+		vector<size_t> before, after;
+		CollectCell collectBefore, collectAfter;
+		collectBefore.cells = &before;
+		collectAfter.cells = &after;
 		
-		// scale atom position
-		a.x *= vpa;
-		a.y *= vpa;
-		a.z *= vpa;
-		
-		if (counter > 1000)
+#ifdef __linux__
+#pragma omp for
+#endif
+		for (long i = 0; i < (long) atomsCount; i++)
 		{
-			cout << "\r\t looking at all atoms..." << "\t\t" << 
-				floor( .5 + 100.0f * (float) i / (float) fAtomsCount) << "%" << flush;
-			counter = 0;
+			if (changedCount > churnCount || elementChanges > 0) {
+				continue;
+			}
+			
+			const size_t src = atomOrder.empty() ? i : atomOrder[i];
+			const GridSphere sphere = grid_sphere(vAtoms, src, origin, vpa, atomScale);
+			
+			gpuAtom & a = allAtoms[i];
+			a.x = sphere.x;
+			a.y = sphere.y;
+			a.z = sphere.z;
+			a.index = lookUpElement( vAtoms.element[src] ).shader_index;
+			
+			const gpuAtom & old = previous.allAtoms[i];
+			if (old.index != a.index)
+			{
+				elementChanges++;
+				continue;
+			}
+			if (old.x == a.x && old.y == a.y && old.z == a.z) {
+				continue;
+			}
+			
+			GridSphere oldSphere = sphere;
+			oldSphere.x = old.x;
+			oldSphere.y = old.y;
+			oldSphere.z = old.z;
+			
+			before.clear();
+			after.clear();
+			for_sphere_cells(oldSphere, gridDim, gridDimMinusOne, collectBefore);
+			for_sphere_cells(sphere, gridDim, gridDimMinusOne, collectAfter);
+			if (before != after)
+			{
+				changed[i] = 1;
+				changedCount++;
+			}
+		}
+	}
+	
+	if (elementChanges > 0 || changedCount > churnCount)
+	{
+		if (elementChanges > 0) {
+			cout << "\t " << elementChanges << " atoms changed type, rebuilding." << endl;
+		}
+		else {
+			cout << "\t more than " << 100.0 * churnLimit << "% of the atoms changed cells, rebuilding." << endl;
+		}
+		delete [] allAtoms;
+		allAtoms = NULL;
+		atomOrder.clear();
+		return false;
+	}
+	const double detectTime = timer.getElapsedTimeInSec();
+	timer.start();
+	cout << "\t " << changedCount << " atoms changed cells (" << (atomsCount > 0 ? 100.0 * changedCount / atomsCount : 0.0) << "%)" << endl;
+	
+	// (cell, atom) pairs leaving and entering cells
+	CellAtoms removed, added;
+	vector<size_t> cells;
+	CollectCell collect;
+	collect.cells = &cells;
+	for (size_t i = 0; i < atomsCount; i++)
+	{
+		if (!changed[i]) continue;
+		
+		const gpuAtom & old = previous.allAtoms[i];
+		GridSphere sphere;
+		sphere.r = vAtoms.radius[ atomOrder.empty() ? i : atomOrder[i] ] * atomScale * vpa;
+		
+		sphere.x = old.x; sphere.y = old.y; sphere.z = old.z;
+		cells.clear();
+		for_sphere_cells(sphere, gridDim, gridDimMinusOne, collect);
+		for (size_t n = 0; n < cells.size(); n++) {
+			removed.push_back( CellAtom(cells[n], i) );
+		}
+		
+		sphere.x = allAtoms[i].x; sphere.y = allAtoms[i].y; sphere.z = allAtoms[i].z;
+		cells.clear();
+		for_sphere_cells(sphere, gridDim, gridDimMinusOne, collect);
+		for (size_t n = 0; n < cells.size(); n++) {
+			added.push_back( CellAtom(cells[n], i) );
+		}
+	}
+	
+	// group both lists by cell with a counting sort; pairs were generated in
+	// atom order, so every cell's run comes out in increasing atom order
+	vector<size_t> removedStart, addedStart;
+	vector<unsigned int> removedAtoms, addedAtoms;
+	group_by_cell(removed, totalCells, removedStart, removedAtoms);
+	group_by_cell(added, totalCells, addedStart, addedAtoms);
+	
+	// new cell sizes
+	macrocells.resize(gridDim.x(), gridDim.y(), gridDim.z());
+	for (size_t c = 0; c < totalCells; c++)
+	{
+		macrocells.data[c].ballCount = previous.macrocells.data[c].ballCount
+			- (removedStart[c+1] - removedStart[c])
+			+ (addedStart[c+1] - addedStart[c]);
+	}
+	
+	// cell starts, in the same cell order as a full build
+	vector<size_t> cellOrder;
+	if (!atomOrder.empty()) {
+		z_order_cells(gridDim, cellOrder);
+	}
+	size_t indicesSize = 0, maxMC = 0;
+	for (size_t n = 0; n < totalCells; n++)
+	{
+		Macrocell & mc = macrocells.data[ cellOrder.empty() ? n : cellOrder[n] ];
+		mc.ballStart = indicesSize;
+		indicesSize += mc.ballCount;
+		maxMC = max(maxMC, (size_t) mc.ballCount);
+	}
+	indicesCount = indicesSize;
+	maxMCDensity = maxMC;
+	indicesSqrt = textureSide(indicesCount);
+	indices = new unsigned int[ indicesSqrt * indicesSqrt ];
+	
+	// copy untouched lists, merge the rest (lists stay in increasing atom order)
+#ifdef __linux__
+#pragma omp parallel for schedule(dynamic, 4096)
+#endif
+	for (long c = 0; c < (long) totalCells; c++)
+	{
+		const Macrocell & prev = previous.macrocells.data[c];
+		const Macrocell & mc = macrocells.data[c];
+		const unsigned int * in = previous.indices + prev.ballStart;
+		const unsigned int * inEnd = in + prev.ballCount;
+		unsigned int * out = indices + mc.ballStart;
+		
+		const unsigned int * r = removedAtoms.data() + removedStart[c];
+		const unsigned int * rEnd = removedAtoms.data() + removedStart[c+1];
+		const unsigned int * a = addedAtoms.data() + addedStart[c];
+		const unsigned int * aEnd = addedAtoms.data() + addedStart[c+1];
+		
+		if (r == rEnd && a == aEnd)
+		{
+			copy(in, inEnd, out);
+			continue;
+		}
+		
+		for (; in < inEnd; in++)
+		{
+			if (r < rEnd && *r == *in)
+			{
+				r++;
+				continue;
+			}
+			for (; a < aEnd && *a < *in; a++) {
+				*out++ = *a;
+			}
+			*out++ = *in;
+		}
+		for (; a < aEnd; a++) {
+			*out++ = *a;
+		}
+		assert(out == indices + mc.ballStart + mc.ballCount);
+	}
+	const double patchTime = timer.getElapsedTimeInSec();
+	
+	cout << "\t max mc density: " << maxMCDensity << endl;
+	cout << "\t indices: " << indicesCount << " (" << removed.size() << " removed, " << added.size() << " added)" << endl;
+	cout << "\t detect: " << detectTime << " sec, patch: " << patchTime << " sec" << endl;
+	
+	stats = MacrocellStats();
+	stats.mode = "update";
+	stats.detectTime = detectTime;
+	stats.patchTime = patchTime;
+	
+	timer.start();
+	build_blocks();
+	stats.blocksTime = timer.getElapsedTimeInSec();
+	
+	timer.start();
+	build_distances();
+	stats.distancesTime = timer.getElapsedTimeInSec();
+	cout << "Done!" << endl;
+	return true;
+}
+
+void Macrocells::save_file(const string & saveFile)
+{
+	/* ----------------------------------
+	 * Save file if wanted
+	 * ----------------------------------
+	 */
+	if (saveFile.length() != 0)
+	{
+		cout << "Saving Macrocells to file: " << saveFile << endl;
+		bool res = save(saveFile.c_str());
+		if (!res) {
+			cerr << "Could not built Macrocells structure to file: " << saveFile << endl;
+		}
+		else
+		{
+			#ifndef DO_MPI
+			cout << "OK." << endl;
+			#endif
+		}
+	}
+}
+
+Macrocells::~Macrocells()
+{
+	// mapped arrays go away with mcFile
+	if (!mcFile.isOpen())
+	{
+		delete [] indices;
+		delete [] allAtoms;
+	}
+	
+	if (hasGPUData) {
+		GLuint TEX[4] = {macrocellsTex, tboIndices, tboAtoms, blocksTex};
+		glDeleteTextures(4, TEX);
+	}
+	release_staging();
+	if (visibleTex) {
+		glDeleteTextures(1, &visibleTex);
+	}
+}
+
+void Macrocells::build_blocks()
+{
+	blockDim = vec3i(
+		(gridDim.x() + MC_BLOCK_SIZE - 1) / MC_BLOCK_SIZE,
+		(gridDim.y() + MC_BLOCK_SIZE - 1) / MC_BLOCK_SIZE,
+		(gridDim.z() + MC_BLOCK_SIZE - 1) / MC_BLOCK_SIZE
+	);
+	blocks.resize(blockDim.x(), blockDim.y(), blockDim.z());
+	
+	const size_t totalBlocks = (size_t) blockDim.x() * blockDim.y() * blockDim.z();
+	memset(blocks.data, 0, totalBlocks);
+	
+	for (int m = 0; m < gridDim.z(); m++)
+		for (int l = 0; l < gridDim.y(); l++)
+			for (int k = 0; k < gridDim.x(); k++)
+			{
+				if (macrocells.get_data(k, l, m).ballCount > 0) {
+					blocks.get_data(k / MC_BLOCK_SIZE, l / MC_BLOCK_SIZE, m / MC_BLOCK_SIZE) = 1;
+				}
+			}
+	
+	size_t occupied = 0;
+	for (size_t b = 0; b < totalBlocks; b++) {
+		occupied += blocks.data[b];
+	}
+	
+	size_t occupiedCells = 0;
+	const size_t totalCells = (size_t) gridDim.x() * gridDim.y() * gridDim.z();
+	for (size_t c = 0; c < totalCells; c++) {
+		occupiedCells += macrocells.data[c].ballCount > 0 ? 1 : 0;
+	}
+	cout << "\t occupied cells: " << occupiedCells << " of " << totalCells;
+	if (occupiedCells > 0) {
+		cout << ", " << double(indicesCount) / occupiedCells << " atoms / occupied cell";
+	}
+	cout << endl;
+	cout << "\t blocks: " << blockDim.x() << " x " << blockDim.y() << " x " << blockDim.z()
+		<< " (" << MC_BLOCK_SIZE << "^3 macrocells), " << occupied << " occupied" << endl;
+}
+
+// One direction of g(i) = min over j of max(|i - j|, f(j)), the Chebyshev
+// distance along one more axis given the distances f over the others. Element i
+// is at [i * step]. The candidates j on the stack get closer and have larger f
+// towards the top; p is the first whose f is still above its distance to i.
+// Both only move forward, so the sweep is linear.
+static void chebyshev_sweep(const unsigned char * f, unsigned char * g, int n, int step, int * stack, bool first)
+{
+	int size = 0, p = 0;
+	for (int i = 0; i < n; i++)
+	{
+		const int fi = f[i * step];
+		while (size > 0 && f[stack[size - 1] * step] >= fi) {
+			size--;
+		}
+		stack[size++] = i;
+		
+		p = min(p, size - 1);
+		while (f[stack[p] * step] < i - stack[p]) {
+			p++;
+		}
+		int d = f[stack[p] * step];
+		if (p > 0) {
+			d = min(d, i - stack[p - 1]);
+		}
+		g[i * step] = (unsigned char) (first ? d : min(d, (int) g[i * step]));
+	}
+}
+
+// transforms the lines along the second axis of the dx x n planes f into g
+static void chebyshev_plane(const unsigned char * f, unsigned char * g, int dx, int n, int * stack)
+{
+	for (int k = 0; k < dx; k++)
+	{
+		chebyshev_sweep(f + k, g + k, n, dx, stack, true);
+		chebyshev_sweep(f + k + (size_t) (n - 1) * dx, g + k + (size_t) (n - 1) * dx, n, -dx, stack, false);
+	}
+}
+
+// x: distance to the nearest occupied cell in the row, both directions
+static void chebyshev_row(const Macrocell * cells, unsigned char * row, int dx)
+{
+	int d = MC_MAX_DISTANCE;
+	for (int k = 0; k < dx; k++)
+	{
+		d = cells[k].ballCount > 0 ? 0 : min(d + 1, MC_MAX_DISTANCE);
+		row[k] = (unsigned char) d;
+	}
+	d = MC_MAX_DISTANCE;
+	for (int k = dx - 1; k >= 0; k--)
+	{
+		d = cells[k].ballCount > 0 ? 0 : min(d + 1, MC_MAX_DISTANCE);
+		row[k] = (unsigned char) min((int) row[k], d);
+	}
+}
+
+// distances holding the x distances (chebyshev_row) of every row to the full
+// Chebyshev distance field: y, then z, a plane at a time (lines along the axis
+// are dx apart)
+static void chebyshev_yz(Grid3<unsigned char> & distances)
+{
+	const int dx = distances.d1, dy = distances.d2, dz = distances.d3;
+#ifdef __linux__
+#pragma omp parallel
+#endif
+	{
+		const size_t planeSize = (size_t) dx * max(dy, dz);
+		vector<unsigned char> f(planeSize), g(planeSize);
+		vector<int> stack(max(dy, dz));
+#ifdef __linux__
+#pragma omp for
+#endif
+		for (int m = 0; m < dz; m++)
+		{
+			unsigned char * plane = &distances.get_data(0, 0, m);
+			memcpy(&f[0], plane, (size_t) dx * dy);
+			chebyshev_plane(&f[0], plane, dx, dy, &stack[0]);
+		}
+		
+#ifdef __linux__
+#pragma omp for
+#endif
+		for (int l = 0; l < dy; l++)
+		{
+			for (int m = 0; m < dz; m++) {
+				memcpy(&f[(size_t) m * dx], &distances.get_data(0, l, m), dx);
+			}
+			chebyshev_plane(&f[0], &g[0], dx, dz, &stack[0]);
+			for (int m = 0; m < dz; m++) {
+				memcpy(&distances.get_data(0, l, m), &g[(size_t) m * dx], dx);
+			}
+		}
+	}
+}
+
+static void report_distances(const Grid3<unsigned char> & distances)
+{
+	const int dx = distances.d1, dy = distances.d2, dz = distances.d3;
+	uint64_t empty = 0, sum = 0;
+	const size_t totalCells = (size_t) dx * dy * dz;
+	for (size_t c = 0; c < totalCells; c++)
+	{
+		empty += distances.data[c] > 0 ? 1 : 0;
+		sum += distances.data[c];
+	}
+	cout << "\t distance field: " << (empty > 0 ? double(sum) / empty : 0.0) << " cells mean distance of empty cells" << endl;
+}
+
+void Macrocells::build_distances()
+{
+	const int dx = gridDim.x(), dy = gridDim.y(), dz = gridDim.z();
+	distances.resize(dx, dy, dz);
+	
+#ifdef __linux__
+#pragma omp parallel for
+#endif
+	for (int m = 0; m < dz; m++)
+		for (int l = 0; l < dy; l++) {
+			chebyshev_row(&macrocells.get_data(0, l, m), &distances.get_data(0, l, m), dx);
+		}
+	chebyshev_yz(distances);
+	report_distances(distances);
+}
+
+void Macrocells::buildDensityRange(const ChargeDensityVolume & volume)
+{
+	Timer timer;
+	timer.start();
+	
+	const Grid3<float> & voxels = volume.getVolume();
+	const vec3i & vDim = volume.getGridDim();
+	densityRange.resize(gridDim.x(), gridDim.y(), gridDim.z());
+	
+	// voxels per macrocell along each axis (both grids start at the world origin)
+	const vec3 & vExtent = volume.getVolumeGSExtent();
+	const vec3 scale(vDim.x() / vExtent.x(), vDim.y() / vExtent.y(), vDim.z() / vExtent.z());
+	
+	// first and last voxel a sample in [c, c+1) interpolates from
+	vector<int> first[3], last[3];
+	for (int a = 0; a < 3; a++)
+	{
+		first[a].resize(gridDim[a]);
+		last[a].resize(gridDim[a]);
+		for (int c = 0; c < gridDim[a]; c++)
+		{
+			first[a][c] = max(0, min(vDim[a] - 1, (int) floor(c * scale[a] - 0.5f)));
+			last[a][c] = max(0, min(vDim[a] - 1, (int) floor((c + 1) * scale[a] - 0.5f) + 1));
+		}
+	}
+	
+#ifdef __linux__
+#pragma omp parallel for
+#endif
+	for (int m = 0; m < gridDim.z(); m++)
+		for (int l = 0; l < gridDim.y(); l++)
+			for (int k = 0; k < gridDim.x(); k++)
+			{
+				DensityRange r;
+				r.lo = FLT_MAX;
+				r.hi = -FLT_MAX;
+				for (int z = first[2][m]; z <= last[2][m]; z++)
+					for (int y = first[1][l]; y <= last[1][l]; y++)
+					{
+						const float * row = &voxels.get_data(0, y, z);
+						for (int x = first[0][k]; x <= last[0][k]; x++)
+						{
+							r.lo = min(r.lo, row[x]);
+							r.hi = max(r.hi, row[x]);
+						}
+					}
+				densityRange.get_data(k, l, m) = r;
+			}
+	
+	visible.resize(gridDim.x(), gridDim.y(), gridDim.z());
+	memset(visible.data, 1, (size_t) gridDim.x() * gridDim.y() * gridDim.z());
+	cout << "\t macrocell density ranges: " << timer.getElapsedTimeInSec() << " sec" << endl;
+}
+
+size_t Macrocells::updateVisibility(const vector<float> & opacity, float maxValue, float tolerance)
+{
+	assert(hasDensityRange());
+	const int n = (int) opacity.size();
+	const size_t totalCells = (size_t) gridDim.x() * gridDim.y() * gridDim.z();
+	
+	// opaque bins up to each bin
+	vector<int> opaque(n + 1, 0);
+	for (int b = 0; b < n; b++) {
+		opaque[b + 1] = opaque[b] + (opacity[b] > 0.0f ? 1 : 0);
+	}
+	
+	// bins of a range, one more each way for the filtering of the TF texture
+	const float binsPerValue = maxValue > 0.0f ? n / maxValue : 0.0f;
+	size_t count = 0;
+#ifdef __linux__
+#pragma omp parallel for reduction(+:count)
+#endif
+	for (int64_t c = 0; c < (int64_t) totalCells; c++)
+	{
+		const DensityRange & r = densityRange.data[c];
+		const int lo = max(0, min(n - 1, (int) floor((r.lo - tolerance) * binsPerValue) - 1));
+		const int hi = max(0, min(n - 1, (int) floor((r.hi + tolerance) * binsPerValue) + 1));
+		const bool v = opaque[hi + 1] - opaque[lo] > 0;
+		visible.data[c] = v ? 1 : 0;
+		count += v ? 1 : 0;
+	}
+	
+	if (hasGPUData)
+	{
+		if (!visibleTex)
+		{
+			glGenTextures(1, &visibleTex);
+			glBindTexture(GL_TEXTURE_3D, visibleTex);
+			glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+			glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+			glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+			glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+			glTexImage3D(GL_TEXTURE_3D, 0, GL_R8, gridDim.x(), gridDim.y(), gridDim.z(), 0, GL_RED, GL_UNSIGNED_BYTE, visible.data);
+			glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+		}
+		else
+		{
+			glBindTexture(GL_TEXTURE_3D, visibleTex);
+			glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+			glTexSubImage3D(GL_TEXTURE_3D, 0, 0, 0, 0, gridDim.x(), gridDim.y(), gridDim.z(), GL_RED, GL_UNSIGNED_BYTE, visible.data);
+			glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+		}
+	}
+	return count;
+}
+
+void Macrocells::compute_stats()
+{
+	const uint64_t totalCells = (uint64_t) gridDim.x() * gridDim.y() * gridDim.z();
+	stats.vpa = voxelsPerAngstrom;
+	stats.gridDim[0] = gridDim.x();
+	stats.gridDim[1] = gridDim.y();
+	stats.gridDim[2] = gridDim.z();
+	stats.morton = !atomOrder.empty();
+	
+	stats.cells = totalCells;
+	stats.atoms = atomsCount;
+	stats.indices = indicesCount;
+	stats.emptyCells = 0;
+	stats.maxDensity = 0;
+	stats.histogram.assign(1, 0);
+	for (uint64_t c = 0; c < totalCells; c++)
+	{
+		const uint64_t n = macrocells.data[c].ballCount;
+		int bin = 0;
+		while ((n >> bin) > 0) {
+			bin++;
+		}
+		if (bin >= (int) stats.histogram.size()) {
+			stats.histogram.resize(bin + 1, 0);
+		}
+		stats.histogram[bin]++;
+		stats.maxDensity = max(stats.maxDensity, (unsigned int) n);
+	}
+	stats.emptyCells = stats.histogram[0];
+	
+	const uint64_t occupied = totalCells - stats.emptyCells;
+	stats.meanDensity = occupied > 0 ? double(indicesCount) / occupied : 0.0;
+	stats.duplication = atomsCount > 0 ? double(indicesCount) / atomsCount : 0.0;
+	
+	stats.macrocellBytes = totalCells * sizeof(Macrocell);
+	stats.indexBytes = (uint64_t) indicesSqrt * indicesSqrt * sizeof(unsigned int);
+	stats.atomBytes = (uint64_t) atomsSqrt * atomsSqrt * sizeof(gpuAtom);
+	stats.blockBytes = (uint64_t) blockDim.x() * blockDim.y() * blockDim.z();
+	stats.distanceBytes = totalCells;
+	stats.atomOrderBytes = atomOrder.size() * sizeof(unsigned int);
+	stats.directRefBytes = (uint64_t) indicesSqrt * indicesSqrt * sizeof(gpuAtom);
+	stats.compactRefBytes = (uint64_t) indicesSqrt * indicesSqrt * sizeof(compactAtom);
+}
+
+MacrocellStats::MacrocellStats()
+{
+	vpa = 0.0f;
+	gridDim[0] = gridDim[1] = gridDim[2] = 0;
+	morton = false;
+	cells = emptyCells = atoms = indices = 0;
+	maxDensity = 0;
+	meanDensity = duplication = 0.0;
+	macrocellBytes = indexBytes = atomBytes = blockBytes = distanceBytes = atomOrderBytes = directRefBytes = compactRefBytes = 0;
+	sortTime = countTime = prefixTime = scatterTime = 0.0;
+	detectTime = patchTime = blocksTime = distancesTime = loadTime = totalTime = 0.0;
+	stagingTime = uploadTime = 0.0;
+	ranks = 1;
+	combineTime = 0.0;
+}
+
+// lowest and highest atom count of histogram bin b
+static void histogram_bin(size_t b, uint64_t & lo, uint64_t & hi)
+{
+	lo = b == 0 ? 0 : (uint64_t) 1 << (b - 1);
+	hi = b == 0 ? 0 : ((uint64_t) 1 << b) - 1;
+}
+
+void MacrocellStats::print(ostream & out) const
+{
+	const double MB = 1024.0 * 1024.0;
+	out << "Macrocell statistics (" << mode << "):" << endl;
+	out << "\t grid: " << gridDim[0] << " x " << gridDim[1] << " x " << gridDim[2] << ", vpa " << vpa
+		<< (morton ? ", morton layout" : "") << endl;
+	out << "\t cells: " << cells << ", " << (cells > 0 ? 100.0 * emptyCells / cells : 0.0) << "% empty" << endl;
+	out << "\t atoms: " << atoms << ", indices: " << indices << " (duplication " << duplication << "x)" << endl;
+	out << "\t atoms / occupied cell: " << meanDensity << " mean, " << maxDensity << " max" << endl;
+	out << "\t occupancy histogram:" << endl;
+	for (size_t b = 0; b < histogram.size(); b++)
+	{
+		if (histogram[b] == 0) continue;
+		uint64_t lo, hi;
+		histogram_bin(b, lo, hi);
+		out << "\t\t " << lo;
+		if (hi != lo) {
+			out << " - " << hi;
+		}
+		out << " atoms: " << histogram[b] << " cells" << endl;
+	}
+	out << "\t memory: macrocells " << macrocellBytes / MB << " MB, indices " << indexBytes / MB 
+		<< " MB, atoms " << atomBytes / MB << " MB, blocks " << blockBytes / MB << " MB, distances " << distanceBytes / MB << " MB";
+	if (atomOrderBytes > 0) {
+		out << ", atom order " << atomOrderBytes / MB << " MB";
+	}
+	out << endl;
+	out << "\t direct reference on the GPU: " << directRefBytes / MB << " MB, compact " << compactRefBytes / MB 
+		<< " MB (saves " << (directRefBytes - compactRefBytes) / MB << " MB)" << endl;
+	
+	out << "\t time:";
+	if (mode == "load") {
+		out << " load " << loadTime;
+	}
+	else if (mode == "update") {
+		out << " detect " << detectTime << ", patch " << patchTime;
+	}
+	else 
+	{
+		if (morton) {
+			out << " sort " << sortTime << ",";
+		}
+		out << " count " << countTime << ", prefix sum " << prefixTime << ", scatter " << scatterTime;
+		if (ranks > 1) {
+			out << ", combine " << combineTime << " (" << ranks << " ranks)";
+		}
+	}
+	if (mode != "load") {
+		out << ", blocks " << blocksTime << ", distances " << distancesTime;
+	}
+	out << ", total " << totalTime << " sec" << endl;
+	if (uploadTime > 0.0) {
+		out << "\t GPU upload: staging " << stagingTime << ", upload " << uploadTime << " sec" << endl;
+	}
+}
+
+void MacrocellStats::write_json(ostream & out) const
+{
+	out << "{" << endl;
+	out << "  \"mode\": \"" << mode << "\"," << endl;
+	out << "  \"vpa\": " << vpa << "," << endl;
+	out << "  \"grid_dim\": [" << gridDim[0] << ", " << gridDim[1] << ", " << gridDim[2] << "]," << endl;
+	out << "  \"morton_layout\": " << (morton ? "true" : "false") << "," << endl;
+	out << "  \"ranks\": " << ranks << "," << endl;
+	out << "  \"cells\": " << cells << "," << endl;
+	out << "  \"empty_cells\": " << emptyCells << "," << endl;
+	out << "  \"empty_fraction\": " << (cells > 0 ? double(emptyCells) / cells : 0.0) << "," << endl;
+	out << "  \"atoms\": " << atoms << "," << endl;
+	out << "  \"indices\": " << indices << "," << endl;
+	out << "  \"duplication\": " << duplication << "," << endl;
+	out << "  \"max_density\": " << maxDensity << "," << endl;
+	out << "  \"mean_density\": " << meanDensity << "," << endl;
+	
+	out << "  \"histogram\": [";
+	for (size_t b = 0; b < histogram.size(); b++)
+	{
+		uint64_t lo, hi;
+		histogram_bin(b, lo, hi);
+		out << (b > 0 ? ", " : "") << "{\"min\": " << lo << ", \"max\": " << hi << ", \"cells\": " << histogram[b] << "}";
+	}
+	out << "]," << endl;
+	
+	out << "  \"bytes\": {\"macrocells\": " << macrocellBytes << ", \"indices\": " << indexBytes 
+		<< ", \"atoms\": " << atomBytes << ", \"blocks\": " << blockBytes << ", \"distances\": " << distanceBytes << ", \"atom_order\": " << atomOrderBytes 
+		<< ", \"direct_ref\": " << directRefBytes << ", \"compact_ref\": " << compactRefBytes << "}," << endl;
+	out << "  \"seconds\": {\"sort\": " << sortTime << ", \"count\": " << countTime << ", \"prefix_sum\": " << prefixTime
+		<< ", \"scatter\": " << scatterTime << ", \"combine\": " << combineTime << ", \"detect\": " << detectTime << ", \"patch\": " << patchTime
+		<< ", \"blocks\": " << blocksTime << ", \"distances\": " << distancesTime << ", \"load\": " << loadTime << ", \"total\": " << totalTime 
+		<< ", \"staging\": " << stagingTime << ", \"upload\": " << uploadTime << "}" << endl;
+	out << "}" << endl;
+}
+
+/* ---------------------------------------------
+ * Resolution cost model
+ * ---------------------------------------------
+ */
+
+// weights, in units of one ray-sphere test
+static const double COST_CELL_STEP	= 2.0;		// DDA step and macrocell fetch
+static const double COST_ATOM_TEST	= 1.0;		// index, atom fetch and sphere test
+
+static const size_t COST_SAMPLE_ATOMS	= 1 << 18;	// atoms binned per prediction
+static const size_t COST_MAX_CELLS	= 1 << 25;	// larger grids are not considered
+static const double COST_MEMORY_BUDGET	= 512.0 * 1024.0 * 1024.0;	// bytes, leaves room for the volume
+static const int    COST_PROBE_RAYS	= 32;		// per side, for each of three faces
+
+// candidates for -vpa auto
+static const float AUTO_VPA_MIN		= 0.1f;
+static const float AUTO_VPA_MAX		= 4.0f;
+static const float AUTO_VPA_STEP	= 1.25f;
+
+struct CountFootprint
+{
+	size_t cells;
+	void operator()(size_t) { cells++; }
+};
+
+void macrocellProbeRays(const vec3i & gridDim, int n, vector<vec3f> & origins, vector<vec3f> & directions)
+{
+	origins.clear();
+	directions.clear();
+	for (int a = 0; a < 3; a++)
+	{
+		const int b = (a + 1) % 3, c = (a + 2) % 3;
+		vec3f dir;
+		dir[a] = 1.0f;
+		dir[b] = 0.1f;
+		dir[c] = 0.05f;
+		dir = normalize(dir);
+		
+		for (int j = 0; j < n; j++)
+		{
+			for (int i = 0; i < n; i++)
+			{
+				vec3f o;
+				o[a] = 0.0f;
+				o[b] = gridDim[b] * (i + .5f) / n;
+				o[c] = gridDim[c] * (j + .5f) / n;
+				origins.push_back(o);
+				directions.push_back(dir);
+			}
+		}
+	}
+}
+
+MacrocellCost predictMacrocellCost(const Atoms & atoms, float vpa, float atomScale, vec3 worldMin, vec3 worldMax)
+{
+	MacrocellCost c;
+	const vec3 worldMag = worldMax - worldMin;
+	c.vpa = vpa;
+	c.gridDim = vec3i(
+		max(1, (int) ceil( worldMag.x() * vpa )),
+		max(1, (int) ceil( worldMag.y() * vpa )),
+		max(1, (int) ceil( worldMag.z() * vpa ))
+	);
+	c.indicesCount = c.occupiedCells = c.atomsPerCell = 0.0;
+	c.cellsPerRay = c.atomsPerRay = c.cost = 0.0;
+	
+	const vec3i & dim = c.gridDim;
+	const vec3f gridDimMinusOne(dim.x() - 1, dim.y() - 1, dim.z() - 1);
+	const size_t totalCells = (size_t) dim.x() * dim.y() * dim.z();
+	const size_t atomsCount = atoms.size();
+	
+	c.bytes = 3.0 * sizeof(float) * totalCells;
+	c.fits = totalCells <= COST_MAX_CELLS && c.bytes <= COST_MEMORY_BUDGET;
+	if (!c.fits || atomsCount == 0) {
+		return c;
+	}
+	
+	// bin an evenly strided sample
+	const size_t stride = max((size_t) 1, atomsCount / COST_SAMPLE_ATOMS);
+	vector<unsigned int> counts(totalCells, 0);
+	CountCell count;
+	count.histogram = &counts[0];
+	size_t sampled = 0;
+	for (size_t i = 0; i < atomsCount; i += stride, sampled++)
+	{
+		for_sphere_cells(grid_sphere(atoms, i, worldMin, vpa, atomScale), dim, gridDimMinusOne, count);
+	}
+	const double scale = double(atomsCount) / double(sampled);
+	
+	size_t entries = 0, occupied = 0;
+	for (size_t n = 0; n < totalCells; n++)
+	{
+		entries += counts[n];
+		occupied += counts[n] > 0 ? 1 : 0;
+	}
+	c.indicesCount = entries * scale;
+	c.occupiedCells = occupied;
+	c.atomsPerCell = occupied > 0 ? c.indicesCount / occupied : 0.0;
+	
+	const size_t entryBytes = 
+		refModeDefault == MC_DIRECT ? sizeof(gpuAtom) :
+		refModeDefault == MC_DIRECT_COMPACT ? sizeof(compactAtom) : 2 * sizeof(float);
+	c.bytes += c.indicesCount * entryBytes + atomsCount * sizeof(gpuAtom);
+	c.fits = c.bytes <= COST_MEMORY_BUDGET;
+	
+	// occupancy blocks, as in build_blocks
+	const vec3i blockDim(
+		(dim.x() + MC_BLOCK_SIZE - 1) / MC_BLOCK_SIZE,
+		(dim.y() + MC_BLOCK_SIZE - 1) / MC_BLOCK_SIZE,
+		(dim.z() + MC_BLOCK_SIZE - 1) / MC_BLOCK_SIZE
+	);
+	vector<unsigned char> blocks((size_t) blockDim.x() * blockDim.y() * blockDim.z(), 0);
+	for (int m = 0; m < dim.z(); m++)
+		for (int l = 0; l < dim.y(); l++)
+			for (int k = 0; k < dim.x(); k++)
+			{
+				if (counts[ k + dim.x() * (l + dim.y() * (size_t) m) ] > 0) {
+					blocks[ k / MC_BLOCK_SIZE + blockDim.x() * (l / MC_BLOCK_SIZE + blockDim.y() * (size_t) (m / MC_BLOCK_SIZE)) ] = 1;
+				}
+			}
+	
+	// march the probe rays up to the first occupied cell (taken to be a hit),
+	// stepping over empty blocks like the shader
+	vector<vec3f> origins, directions;
+	macrocellProbeRays(dim, COST_PROBE_RAYS, origins, directions);
+	for (size_t r = 0; r < origins.size(); r++)
+	{
+		const vec3f & o = origins[r];
+		const vec3f & d = directions[r];
+		int cell[3];
+		for (int a = 0; a < 3; a++) {
+			cell[a] = max(0, min(dim[a] - 1, (int) floor(o[a])));
+		}
+		
+		for (;;)
+		{
+			c.cellsPerRay++;
+			
+			// directions are positive on all axes, so the ray leaves through the
+			// upper faces of the cell (or of its block when the block is empty)
+			int lo[3], hi[3];
+			const int block[3] = { cell[0] / MC_BLOCK_SIZE, cell[1] / MC_BLOCK_SIZE, cell[2] / MC_BLOCK_SIZE };
+			if (blocks[ block[0] + blockDim.x() * (block[1] + blockDim.y() * (size_t) block[2]) ])
+			{
+				const unsigned int n = counts[ cell[0] + dim.x() * (cell[1] + dim.y() * (size_t) cell[2]) ];
+				if (n > 0)
+				{
+					c.atomsPerRay += n * scale;
+					break;
+				}
+				for (int a = 0; a < 3; a++)
+				{
+					lo[a] = cell[a];
+					hi[a] = cell[a] + 1;
+				}
+			}
+			else
+			{
+				for (int a = 0; a < 3; a++)
+				{
+					lo[a] = block[a] * MC_BLOCK_SIZE;
+					hi[a] = min(lo[a] + MC_BLOCK_SIZE, dim[a]);
+				}
+			}
+			
+			float tnext = FLT_MAX;
+			int axis = 0;
+			for (int a = 0; a < 3; a++)
+			{
+				const float t = (hi[a] - o[a]) / d[a];
+				if (t < tnext)
+				{
+					tnext = t;
+					axis = a;
+				}
+			}
+			for (int a = 0; a < 3; a++) {
+				cell[a] = a == axis ? hi[a] : max(lo[a], min(hi[a] - 1, (int) floor(o[a] + d[a] * tnext)));
+			}
+			if (cell[axis] >= dim[axis]) {
+				break;
+			}
+		}
+	}
+	c.cellsPerRay /= origins.size();
+	c.atomsPerRay /= origins.size();
+	c.cost = COST_CELL_STEP * c.cellsPerRay + COST_ATOM_TEST * c.atomsPerRay;
+	return c;
+}
+
+float chooseMacrocellVPA(const Atoms & atoms, float atomScale, vec3 worldMin, vec3 worldMax, MacrocellCost * chosen)
+{
+	cout << "Choosing macrocell resolution..." << endl;
+	MacrocellCost best;
+	best.fits = false;
+	for (float vpa = AUTO_VPA_MIN; vpa <= AUTO_VPA_MAX; vpa *= AUTO_VPA_STEP)
+	{
+		const MacrocellCost c = predictMacrocellCost(atoms, vpa, atomScale, worldMin, worldMax);
+		if (!c.fits) {
+			break;
+		}
+		if (!best.fits || c.cost < best.cost) {
+			best = c;
+		}
+	}
+	
+	if (!best.fits)
+	{
+		// nothing fits; the coarsest grid is the smallest
+		best = predictMacrocellCost(atoms, AUTO_VPA_MIN, atomScale, worldMin, worldMax);
+	}
+	cout << "\t vpa " << best << endl;
+	
+	if (chosen) {
+		*chosen = best;
+	}
+	return best.vpa;
+}
+
+ostream & operator<<(ostream & out, const MacrocellCost & c)
+{
+	out << c.vpa << ": " << c.gridDim.x() << " x " << c.gridDim.y() << " x " << c.gridDim.z() << " cells, "
+		<< size_t(c.indicesCount) << " indices, " << c.atomsPerCell << " atoms / occupied cell, "
+		<< c.cellsPerRay << " cells + " << c.atomsPerRay << " atoms / ray, "
+		<< c.bytes / (1024.0 * 1024.0) << " MB, cost " << c.cost;
+	return out;
+}
+
+Macrocells::Macrocells(string filename)
+{
+	refMode = refModeDefault;
+	compactRange = 0.0f;
+	hasGPUData = false;
+	blocksTex = 0;
+	visibleTex = 0;
+	macrocellsTex = 0;
+	stagedCells = NULL;
+	stagedRef = NULL;
+	stagedRefMode = refMode;
+	gridDim.x() = gridDim.y() = gridDim.z() = 0;
+	voxelsPerAngstrom = 0.0;
+	maxMCDensity = 0;
+	atomsCount = 0;
+	indicesCount = 0;
+	blockDim = vec3i(0, 0, 0);
+	hasOrigin = false;
+	updated = false;
+	exactCells = false;
+	
+	
+	allAtoms = NULL;
+	indices = NULL;
+
+	Timer timer;
+	timer.start();
+	if (!load(filename.c_str()))
+	{
+		cerr << "Could not read macrocells file: " << filename << endl;
+		return;
+	}
+	stats.mode = "load";
+	stats.loadTime = timer.getElapsedTimeInSec();
+	compute_stats();
+	stats.totalTime = timer.getElapsedTimeInSec();
+}
+
+// zeros up to offset
+static void pad_to(ofstream & output, uint64_t offset)
+{
+	static const char zeros[4096] = {0};
+	uint64_t pos = output.tellp();
+	while (pos < offset)
+	{
+		const size_t n = min((uint64_t) sizeof(zeros), offset - pos);
+		output.write(zeros, n);
+		pos += n;
+	}
+}
+
+// Header of a file with the given structure; everything but maxMCDensity. 
+// Sections are laid out after it (indices and atoms padded to their texture size).
+static void make_header(
+	MacrocellsFileHeader & header, uint32_t flags, float atomScale, float vpa, const vec3i & gridDim,
+	uint64_t atomsCount, uint64_t atomsSqrt, uint64_t indicesCount, uint64_t indicesSqrt
+)
+{
+	const uint64_t totalCells = (uint64_t) gridDim.x() * gridDim.y() * gridDim.z();
+	const uint64_t totalBlocks = 
+		(uint64_t) ((gridDim.x() + MC_BLOCK_SIZE - 1) / MC_BLOCK_SIZE) * 
+		((gridDim.y() + MC_BLOCK_SIZE - 1) / MC_BLOCK_SIZE) * 
+		((gridDim.z() + MC_BLOCK_SIZE - 1) / MC_BLOCK_SIZE);
+	
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, MACROCELLS_MAGIC, sizeof(MACROCELLS_MAGIC));
+	header.version			= MACROCELLS_VERSION;
+	header.byteOrder		= MACROCELLS_BYTE_ORDER;
+	header.headerSize		= sizeof(MacrocellsFileHeader);
+	header.flags			= flags;
+	header.atomScale		= atomScale;
+	header.voxelsPerAngstrom	= vpa;
+	header.gridDim[0]		= gridDim.x();
+	header.gridDim[1]		= gridDim.y();
+	header.gridDim[2]		= gridDim.z();
+	header.blockSize		= MC_BLOCK_SIZE;
+	header.atomsCount		= atomsCount;
+	header.indicesCount		= indicesCount;
+	
+	const uint64_t indicesSize	= (uint64_t) indicesSqrt * indicesSqrt * sizeof(unsigned int);
+	const uint64_t atomsSize	= (uint64_t) atomsSqrt * atomsSqrt * sizeof(gpuAtom);
+	header.macrocellsOffset		= atom_file_align( sizeof(header) );
+	header.indicesOffset		= atom_file_align( header.macrocellsOffset + totalCells * sizeof(Macrocell) );
+	header.atomsOffset		= atom_file_align( header.indicesOffset + indicesSize );
+	header.blocksOffset		= atom_file_align( header.atomsOffset + atomsSize );
+	if (header.flags & MACROCELLS_MORTON_LAYOUT) {
+		header.atomOrderOffset	= atom_file_align( header.blocksOffset + totalBlocks );
+	}
+	header.distancesOffset		= atom_file_align( header.atomOrderOffset ? 
+		header.atomOrderOffset + atomsCount * sizeof(unsigned int) : 
+		header.blocksOffset + totalBlocks
+	);
+}
+
+bool Macrocells::save( const char * filename )
+{
+	const uint64_t totalCells = (uint64_t) gridDim.x() * gridDim.y() * gridDim.z();
+	const uint64_t totalBlocks = (uint64_t) blockDim.x() * blockDim.y() * blockDim.z();
+	
+	MacrocellsFileHeader header;
+	make_header(header, atomOrder.empty() ? 0 : MACROCELLS_MORTON_LAYOUT, atomScale, voxelsPerAngstrom, gridDim,
+		atomsCount, atomsSqrt, indicesCount, indicesSqrt);
+	header.maxMCDensity		= maxMCDensity;
+	const uint64_t indicesSize	= (uint64_t) indicesSqrt * indicesSqrt * sizeof(unsigned int);
+	const uint64_t atomsSize	= (uint64_t) atomsSqrt * atomsSqrt * sizeof(gpuAtom);
+	
+	// open file for writing
+	ofstream output(filename, ios::binary);
+	if (!output.is_open()) {
+		return false;
+	}
+	
+	output.write( (char*) &header, sizeof(header) );
+	
+	pad_to(output, header.macrocellsOffset);
+	output.write( (char*) macrocells.data, sizeof(Macrocell) * totalCells );
+	
+	pad_to(output, header.indicesOffset);
+	output.write( (char*) indices, sizeof(unsigned int) * (uint64_t) indicesCount );
+	pad_to(output, header.indicesOffset + indicesSize);
+	
+	pad_to(output, header.atomsOffset);
+	output.write( (char*) allAtoms, sizeof(gpuAtom) * (uint64_t) atomsCount ); 
+	pad_to(output, header.atomsOffset + atomsSize);
+	
+	pad_to(output, header.blocksOffset);
+	output.write( (char*) blocks.data, totalBlocks );
+	
+	if (header.atomOrderOffset)
+	{
+		pad_to(output, header.atomOrderOffset);
+		output.write( (char*) &atomOrder[0], sizeof(unsigned int) * (uint64_t) atomsCount );
+	}
+	
+	pad_to(output, header.distancesOffset);
+	output.write( (char*) distances.data, totalCells );
+	
+	output << flush;
+	const bool good = output.good();
+	output.close();
+	
+	return good;
+}
+
+/* ---------------------------------------------
+ * Out-of-core build
+ * ---------------------------------------------
+ */
+
+// (cell within its bucket, atom)
+struct BucketPair
+{
+	uint32_t cell;
+	uint32_t atom;
+};
+
+// for_sphere_cells callbacks of the out-of-core passes
+struct CountPlane
+{
+	uint64_t * planes;
+	size_t planeSize;
+	void operator()(size_t c) { planes[c / planeSize]++; }
+};
+
+struct BucketCell
+{
+	vector<BucketPair> * buckets;
+	const int * planeBucket;
+	const size_t * bucketFirstCell;
+	size_t planeSize;
+	uint32_t atom;
+	void operator()(size_t c) 
+	{
+		const int b = planeBucket[c / planeSize];
+		BucketPair p;
+		p.cell = (uint32_t) (c - bucketFirstCell[b]);
+		p.atom = atom;
+		buckets[b].push_back(p);
+	}
+};
+
+// reads atoms [first, first + n) of an .atoms file into chunk
+static bool read_atoms_chunk(ifstream & input, const AtomFileHeader & header, uint64_t first, size_t n, Atoms & chunk)
+{
+	chunk.resize(n);
+	input.seekg(header.elementOffset + first);
+	input.read((char *) chunk.element, n);
+	input.seekg(header.xOffset + first * sizeof(float));
+	input.read((char *) chunk.x, n * sizeof(float));
+	input.seekg(header.yOffset + first * sizeof(float));
+	input.read((char *) chunk.y, n * sizeof(float));
+	input.seekg(header.zOffset + first * sizeof(float));
+	input.read((char *) chunk.z, n * sizeof(float));
+	
+	// unknown ids would index past the element table
+	for (size_t i = 0; i < n; i++)
+	{
+		if (chunk.element[i] >= ELEMENT_COUNT) {
+			chunk.element[i] = ELEMENT_UNKNOWN;
+		}
+	}
+	chunk.updateRadii(0, n);
+	return input.good();
+}
+
+static void write_at(ofstream & output, uint64_t offset, const void * data, uint64_t size)
+{
+	output.seekp(offset);
+	output.write((const char *) data, size);
+}
+
+bool buildMacrocellsOutOfCore(const string & atomsFile, float vpa, float atomScale, const string & outFile, uint64_t memoryBudget)
+{
+	cout << "Building macrocells out of core (" << (memoryBudget >> 20) << " MB)..." << endl;
+	if (mortonLayout)
+	{
+		cerr << "Macrocells: the out-of-core build does not do the Morton layout (sort the .atoms file with convert_atoms -sort instead)." << endl;
+		return false;
+	}
+	
+	ifstream input(atomsFile.c_str(), ios::binary);
+	AtomFileHeader header;
+	memset(&header, 0, sizeof(header));
+	input.read((char *) &header, sizeof(header));
+	if (	!input.is_open() || memcmp(header.magic, ATOM_FILE_MAGIC, sizeof(ATOM_FILE_MAGIC)) != 0 ||
+		header.version < 1 || header.version > ATOM_FILE_VERSION ||
+		header.byteOrder != ATOM_FILE_BYTE_ORDER || header.elementSize != 1
+	)
+	{
+		cerr << atomsFile << " is not a binary atoms file (convert it with convert_atoms first)." << endl;
+		return false;
+	}
+	input.clear();
+	
+	const uint64_t atomsCount = header.atomCount;
+	if (atomsCount > UINT_MAX)
+	{
+		cerr << "Macrocells: " << atomsCount << " atoms do not fit 32-bit indices." << endl;
+		return false;
+	}
+	
+	// the same grid the in-core build makes from the file's bounds
+	const vec3f worldMin(header.worldMin[0], header.worldMin[1], header.worldMin[2]);
+	const vec3f worldMax(header.worldMax[0], header.worldMax[1], header.worldMax[2]);
+	const vec3 worldMag = worldMax - worldMin;
+	const vec3i gridDim( (int) ceil(worldMag.x() * vpa), (int) ceil(worldMag.y() * vpa), (int) ceil(worldMag.z() * vpa) );
+	const vec3f gridDimMinusOne( gridDim.x() - 1, gridDim.y() - 1, gridDim.z() - 1 );
+	const size_t planeSize = (size_t) gridDim.x() * gridDim.y();
+	const size_t totalCells = planeSize * gridDim.z();
+	const vec3i blockDim(
+		(gridDim.x() + MC_BLOCK_SIZE - 1) / MC_BLOCK_SIZE,
+		(gridDim.y() + MC_BLOCK_SIZE - 1) / MC_BLOCK_SIZE,
+		(gridDim.z() + MC_BLOCK_SIZE - 1) / MC_BLOCK_SIZE
+	);
+	const size_t totalBlocks = (size_t) blockDim.x() * blockDim.y() * blockDim.z();
+	cout << "\t atomsCount: " << atomsCount << ", grid: " << gridDim.x() << " x " << gridDim.y() << " x " << gridDim.z() << endl;
+	
+	// the distance field, blocks and plane counts stay in memory throughout
+	const uint64_t fixedBytes = totalCells + totalBlocks + gridDim.z() * sizeof(uint64_t);
+	if (fixedBytes >= memoryBudget / 2)
+	{
+		cerr << "Macrocells: the distance field of " << totalCells << " cells needs " << (fixedBytes >> 20) 
+			<< " MB, raise the memory budget (or lower the vpa)." << endl;
+		return false;
+	}
+	const uint64_t workBytes = memoryBudget - fixedBytes;
+	
+	int threads = 1;
+#ifdef __linux__
+	threads = omp_get_max_threads();
+#endif
+	Timer timer, total;
+	total.start();
+	timer.start();
+	
+	/* ---------------------------------------------
+	 * pass 1: (cell, atom) pairs per z plane, to
+	 * size the buckets
+	 * ---------------------------------------------
+	 */
+	const size_t countChunk = max((uint64_t) 1 << 12, workBytes / 2 / (3 * sizeof(float) + 1 + sizeof(float)));
+	vector<uint64_t> planes(gridDim.z(), 0);
+	Atoms chunk;
+	for (uint64_t first = 0; first < atomsCount; first += countChunk)
+	{
+		const size_t n = (size_t) min((uint64_t) countChunk, atomsCount - first);
+		if (!read_atoms_chunk(input, header, first, n, chunk))
+		{
+			cerr << "Could not read " << atomsFile << endl;
+			return false;
+		}
+#ifdef __linux__
+#pragma omp parallel
+#endif
+		{
+			vector<uint64_t> local(gridDim.z(), 0);
+			CountPlane count;
+			count.planes = &local[0];
+			count.planeSize = planeSize;
+#ifdef __linux__
+#pragma omp for
+#endif
+			for (long i = 0; i < (long) n; i++) {
+				for_sphere_cells(grid_sphere(chunk, i, worldMin, vpa, atomScale), gridDim, gridDimMinusOne, count);
+			}
+#ifdef __linux__
+#pragma omp critical
+#endif
+			for (int m = 0; m < gridDim.z(); m++) {
+				planes[m] += local[m];
+			}
+		}
+	}
+	uint64_t indicesCount = 0;
+	for (int m = 0; m < gridDim.z(); m++) {
+		indicesCount += planes[m];
+	}
+	// buckets: runs of planes whose pairs, sorted indices and cells fit the budget
+	const uint64_t bytesPerPair = sizeof(BucketPair) + sizeof(unsigned int);
+	const uint64_t bytesPerCell = sizeof(Macrocell) + sizeof(uint64_t);
+	vector<int> planeBucket(gridDim.z());
+	vector<size_t> bucketFirstCell;
+	vector<uint64_t> bucketPairs;
+	uint64_t bucketBytes = 0;
+	for (int m = 0; m < gridDim.z(); m++)
+	{
+		const uint64_t planeBytes = planes[m] * bytesPerPair + planeSize * bytesPerCell;
+		if (	bucketFirstCell.empty() || bucketBytes + planeBytes > workBytes || 
+			(m + 1) * planeSize - bucketFirstCell.back() > UINT_MAX
+		)
+		{
+			if (planeBytes > workBytes) {
+				cerr << "\t warning: plane " << m << " alone needs " << (planeBytes >> 20) << " MB" << endl;
+			}
+			bucketFirstCell.push_back( m * planeSize );
+			bucketPairs.push_back(0);
+			bucketBytes = 0;
 		}
-		
+		planeBucket[m] = bucketFirstCell.size() - 1;
+		bucketPairs.back() += planes[m];
+		bucketBytes += planeBytes;
 	}
+	const int bucketCount = bucketFirstCell.size();
+	bucketFirstCell.push_back(totalCells);
+	const double countTime = timer.getElapsedTimeInSec();
+	cout << "\t indices: " << indicesCount << ", " << bucketCount << " buckets (count: " << countTime << " sec)" << endl;
 	
-	this->indicesCount = indicesSize;
-	this->maxMCDensity = maxMC;
+	static const int MAX_BUCKETS = 1000;
+	if (bucketCount > MAX_BUCKETS)
+	{
+		cerr << "Macrocells: " << bucketCount << " buckets are too many open files, raise the memory budget." << endl;
+		return false;
+	}
 	
-	cout << endl;
-	cout << "\t max mc density: " << maxMC << endl;
-	cout << "\t constructing indices..." << flush;
+	const uint64_t atomsSqrt = textureSide(atomsCount);
+	const uint64_t indicesSqrt = textureSide(indicesCount);
+	MacrocellsFileHeader mcHeader;
+	make_header(mcHeader, 0, atomScale, vpa, gridDim, atomsCount, atomsSqrt, indicesCount, indicesSqrt);
+	
+	// sections are written in place (gaps read back as zeros, like the padding of save())
+	ofstream output(outFile.c_str(), ios::binary | ios::trunc);
+	if (!output.is_open())
+	{
+		cerr << "Could not write " << outFile << endl;
+		return false;
+	}
+	vector<string> bucketFiles(bucketCount);
+	vector<ofstream *> buckets(bucketCount);
+	for (int b = 0; b < bucketCount; b++)
+	{
+		char suffix[32];
+		sprintf(suffix, ".bucket%d", b);
+		bucketFiles[b] = outFile + suffix;
+		buckets[b] = new ofstream(bucketFiles[b].c_str(), ios::binary | ios::trunc);
+		if (!buckets[b]->is_open()) {
+			cerr << "Could not write " << bucketFiles[b] << endl;
+		}
+	}
 	
-
 	/* ---------------------------------------------
-	 * Make indices
+	 * pass 2: atoms to the file, pairs to the 
+	 * buckets. Every thread bins a contiguous part
+	 * of the chunk and the parts are appended in
+	 * order, so buckets list pairs by atom.
 	 * ---------------------------------------------
 	 */
-	
-	// make memory for indices
-	indicesSqrt = ceil(sqrt(indicesCount));
- 	indices = new unsigned int[ indicesSqrt * indicesSqrt ];
-	counter = 0;
-	unsigned int curIndex = 0;
-	unsigned int totalCells = gridDim.x() * gridDim.y() * gridDim.z();
-	
-	for (size_t m = 0; m < gridDim.z(); m++)
-		for (size_t l = 0; l < gridDim.y(); l++)
-			for (size_t k = 0; k < gridDim.x(); k++)
+	timer.start();
+	const double pairsPerAtom = atomsCount > 0 ? double(indicesCount) / atomsCount : 0.0;
+	const size_t bucketChunk = max((uint64_t) 1 << 12, 
+		(uint64_t) (workBytes / 2 / (3 * sizeof(float) + 1 + sizeof(float) + sizeof(gpuAtom) + 2.0 * pairsPerAtom * sizeof(BucketPair)))
+	);
+	vector<gpuAtom> gpuAtoms;
+	vector< vector<BucketPair> > parts( (size_t) threads * bucketCount );
+	bool ok = true;
+	for (int b = 0; b < bucketCount; b++) {
+		ok = ok && buckets[b]->is_open();
+	}
+	for (uint64_t first = 0; first < atomsCount && ok; first += bucketChunk)
+	{
+		const size_t n = (size_t) min((uint64_t) bucketChunk, atomsCount - first);
+		if (!read_atoms_chunk(input, header, first, n, chunk))
+		{
+			cerr << "Could not read " << atomsFile << endl;
+			ok = false;
+			break;
+		}
+		gpuAtoms.resize(n);
+		
+#ifdef __linux__
+#pragma omp parallel for schedule(static, 1)
+#endif
+		for (int p = 0; p < threads; p++)
+		{
+			BucketCell bin;
+			bin.buckets = &parts[(size_t) p * bucketCount];
+			bin.planeBucket = &planeBucket[0];
+			bin.bucketFirstCell = &bucketFirstCell[0];
+			bin.planeSize = planeSize;
+			
+			for (size_t i = n * p / threads; i < n * (p + 1) / threads; i++)
 			{
-				// get location in temp macrocell struct
-				const vector<unsigned int> & tempMc = tempMacrocells.get_data(k, l, m);
-				Macrocell & mc = macrocells.get_data(k, l, m);
+				const GridSphere sphere = grid_sphere(chunk, i, worldMin, vpa, atomScale);
+				gpuAtom & a = gpuAtoms[i];
+				a.x = sphere.x;
+				a.y = sphere.y;
+				a.z = sphere.z;
+				a.index = lookUpElement( chunk.element[i] ).shader_index;
+				assert(a.index >= 0);
 				
-				// update macrocell structure
-				mc.ballStart = curIndex;
-				mc.ballCount = tempMc.size();				
-				
-				// add to indices
-				for (size_t i = 0; i < mc.ballCount; i++)
-				{
-					indices[ curIndex++ ] = tempMc[i];
+				bin.atom = (uint32_t) (first + i);
+				for_sphere_cells(sphere, gridDim, gridDimMinusOne, bin);
+			}
+		}
+		
+		write_at(output, mcHeader.atomsOffset + first * sizeof(gpuAtom), &gpuAtoms[0], n * sizeof(gpuAtom));
+		for (int b = 0; b < bucketCount; b++)
+			for (int p = 0; p < threads; p++)
+			{
+				vector<BucketPair> & part = parts[(size_t) p * bucketCount + b];
+				if (!part.empty()) {
+					buckets[b]->write((const char *) &part[0], part.size() * sizeof(BucketPair));
 				}
-
-				counter++;
-				if (counter > 1000)
-				{
-					cout << "\r\t constructing indices..." << "\t\t" << 
-						floor( .5 + 100.0f * (float) curIndex / (float) indicesCount) << "%" << flush;
-					counter = 0;
-				}								
+				part.clear();
 			}
+	}
+	ok = ok && output.good();
+	for (int b = 0; b < bucketCount; b++)
+	{
+		ok = ok && buckets[b]->good();
+		delete buckets[b];
+	}
+	// (release the pass 2 buffers before the merge)
+	vector< vector<BucketPair> >().swap(parts);
+	vector<gpuAtom>().swap(gpuAtoms);
+	chunk.clear();
+	const double bucketTime = timer.getElapsedTimeInSec();
+	cout << "\t bucket: " << bucketTime << " sec" << endl;
 	
-	cout << "\nDone!" << endl;
+	/* ---------------------------------------------
+	 * pass 3: sort every bucket by cell (stable, 
+	 * so cells list atoms in index order) into its
+	 * cells and indices, and the x distances and
+	 * blocks of its planes
+	 * ---------------------------------------------
+	 */
+	timer.start();
+	Grid3<unsigned char> distances, blocks;
+	distances.resize(gridDim.x(), gridDim.y(), gridDim.z());
+	blocks.resize(blockDim.x(), blockDim.y(), blockDim.z());
+	memset(blocks.data, 0, totalBlocks);
 	
-	// freeup temp memory
-	tempMacrocells.release();
+	// buffers for the largest bucket, reused (rather than reallocated, which
+	// leaves the heap holding on to more than a bucket)
+	size_t maxPairs = 1, maxCells = 1;
+	for (int b = 0; b < bucketCount; b++)
+	{
+		maxPairs = max(maxPairs, (size_t) bucketPairs[b]);
+		maxCells = max(maxCells, bucketFirstCell[b + 1] - bucketFirstCell[b]);
+	}
+	vector<BucketPair> pairs(maxPairs);
+	vector<unsigned int> bucketIndices(maxPairs);
+	vector<Macrocell> cells(maxCells);
+	vector<uint64_t> next(maxCells);
 	
-	/* ----------------------------------
-	 * Save file if wanted
-	 * ----------------------------------
-	 */
-	if (saveFile.length() != 0)
+	uint64_t indicesWritten = 0, maxMCDensity = 0, occupiedCells = 0;
+	for (int b = 0; b < bucketCount && ok; b++)
 	{
-		cout << "Saving Macrocells to file: " << saveFile << endl;
-		bool res = save(saveFile.c_str());
-		if (!res) {
-			cerr << "Could not built Macrocells structure to file: " << saveFile << endl;
+		const size_t firstCell = bucketFirstCell[b];
+		const size_t cellCount = bucketFirstCell[b + 1] - firstCell;
+		const size_t pairCount = bucketPairs[b];
+		
+		ifstream bucket(bucketFiles[b].c_str(), ios::binary);
+		bucket.read((char *) &pairs[0], pairCount * sizeof(BucketPair));
+		ok = ok && bucket.good();
+		bucket.close();
+		remove(bucketFiles[b].c_str());
+		
+		memset(&next[0], 0, cellCount * sizeof(uint64_t));
+		for (size_t i = 0; i < pairCount; i++) {
+			next[ pairs[i].cell ]++;
 		}
-		else
+		uint64_t running = 0;
+		for (size_t c = 0; c < cellCount; c++)
 		{
-			#ifndef DO_MPI
-			cout << "OK." << endl;
-			#endif
+			cells[c].ballStart = indicesWritten + running;
+			cells[c].ballCount = (unsigned int) next[c];
+			maxMCDensity = max(maxMCDensity, (uint64_t) next[c]);
+			occupiedCells += next[c] > 0 ? 1 : 0;
+			next[c] = running;
+			running += cells[c].ballCount;
+		}
+		for (size_t i = 0; i < pairCount; i++) {
+			bucketIndices[ next[ pairs[i].cell ]++ ] = pairs[i].atom;
 		}
+		
+		write_at(output, mcHeader.macrocellsOffset + firstCell * sizeof(Macrocell), &cells[0], cellCount * sizeof(Macrocell));
+		write_at(output, mcHeader.indicesOffset + indicesWritten * sizeof(unsigned int), &bucketIndices[0], pairCount * sizeof(unsigned int));
+		indicesWritten += pairCount;
+		
+		// planes of the bucket
+		const int firstPlane = firstCell / planeSize;
+		const int planeCount = cellCount / planeSize;
+#ifdef __linux__
+#pragma omp parallel for
+#endif
+		for (int m = 0; m < planeCount; m++)
+			for (int l = 0; l < gridDim.y(); l++)
+			{
+				const Macrocell * row = &cells[(size_t) m * planeSize + (size_t) l * gridDim.x()];
+				chebyshev_row(row, &distances.get_data(0, l, firstPlane + m), gridDim.x());
+				for (int k = 0; k < gridDim.x(); k++)
+				{
+					if (row[k].ballCount > 0) {
+						blocks.get_data(k / MC_BLOCK_SIZE, l / MC_BLOCK_SIZE, (firstPlane + m) / MC_BLOCK_SIZE) = 1;
+					}
+				}
+			}
+	}
+	for (int b = 0; b < bucketCount; b++) {
+		remove(bucketFiles[b].c_str());
+	}
+	if (!ok)
+	{
+		cerr << "Could not write macrocells to " << outFile << endl;
+		return false;
 	}
-}
-
-Macrocells::~Macrocells()
-{
-	delete [] indices;
-	delete [] allAtoms;
 	
-	if (hasGPUData) {
-		GLuint TEX[2] = {tboIndices, tboAtoms};
-		glDeleteTextures(2, TEX);
+	size_t occupiedBlocks = 0;
+	for (size_t b = 0; b < totalBlocks; b++) {
+		occupiedBlocks += blocks.data[b];
+	}
+	chebyshev_yz(distances);
+	const double mergeTime = timer.getElapsedTimeInSec();
+	
+	cout << "\t max mc density: " << maxMCDensity << endl;
+	cout << "\t occupied cells: " << occupiedCells << " of " << totalCells;
+	if (occupiedCells > 0) {
+		cout << ", " << double(indicesCount) / occupiedCells << " atoms / occupied cell";
+	}
+	cout << endl;
+	cout << "\t blocks: " << blockDim.x() << " x " << blockDim.y() << " x " << blockDim.z()
+		<< " (" << MC_BLOCK_SIZE << "^3 macrocells), " << occupiedBlocks << " occupied" << endl;
+	report_distances(distances);
+	
+	write_at(output, mcHeader.blocksOffset, blocks.data, totalBlocks);
+	write_at(output, mcHeader.distancesOffset, distances.data, totalCells);
+	mcHeader.maxMCDensity = maxMCDensity;
+	write_at(output, 0, &mcHeader, sizeof(mcHeader));
+	output << flush;
+	ok = output.good();
+	output.close();
+	
+	cout << "\t merge: " << mergeTime << " sec, total " << total.getElapsedTimeInSec() << " sec" << endl;
+	if (!ok) {
+		cerr << "Could not write macrocells to " << outFile << endl;
 	}
+	return ok;
 }
 
-Macrocells::Macrocells(string filename)
+bool Macrocells::load( const char * filename )
 {
-	refMode = MC_REF_MODE_DEFAULT;
-	hasGPUData = false;
-	gridDim.x() = gridDim.y() = gridDim.z() = 0;
-	voxelsPerAngstrom = 0.0;
-	maxMCDensity = 0;
-	atomsCount = 0;
-	indicesCount = 0;
+	// mapped copy-on-write, so the arrays can still be changed in memory
+	if (!mcFile.open(filename, true)) {
+		return false;
+	}
 	
+	MacrocellsFileHeader header;
+	if (	mcFile.size() < sizeof(header) ||
+		memcmp(mcFile.data(), MACROCELLS_MAGIC, sizeof(MACROCELLS_MAGIC)) != 0
+	)
+	{
+		// original format
+		mcFile.close();
+		return load_stream(filename);
+	}
+	memcpy(&header, mcFile.data(), sizeof(header));
 	
-	allAtoms = NULL;
-	indices = NULL;
-
-	if (!load(filename.c_str()))
+	if (header.version != MACROCELLS_VERSION || header.headerSize != sizeof(header))
 	{
-		cerr << "Could not read macrocells file: " << filename << endl;
+		cerr << "Unsupported macrocells file version " << header.version << endl;
+		mcFile.close();
+		return false;
+	}
+	if (header.byteOrder != MACROCELLS_BYTE_ORDER)
+	{
+		cerr << "Macrocells file was written on a machine of different byte order" << endl;
+		mcFile.close();
+		return false;
 	}
-}
-
-bool Macrocells::save( const char * filename )
-{
-	unsigned int dimensions[3];
-	dimensions[0] = gridDim.x();
-	dimensions[1] = gridDim.y();
-	dimensions[2] = gridDim.z();
 	
-	// open file for writing
-	ofstream output(filename, ios::binary);
-	if (!output.is_open()) {
+	atomScale		= header.atomScale;
+	voxelsPerAngstrom	= header.voxelsPerAngstrom;
+	gridDim			= vec3i(header.gridDim[0], header.gridDim[1], header.gridDim[2]);
+	maxMCDensity		= header.maxMCDensity;
+	atomsCount		= header.atomsCount;
+	indicesCount		= header.indicesCount;
+	atomsSqrt		= textureSide(atomsCount);
+	indicesSqrt		= textureSide(indicesCount);
+	blockDim = vec3i(
+		(gridDim.x() + MC_BLOCK_SIZE - 1) / MC_BLOCK_SIZE,
+		(gridDim.y() + MC_BLOCK_SIZE - 1) / MC_BLOCK_SIZE,
+		(gridDim.z() + MC_BLOCK_SIZE - 1) / MC_BLOCK_SIZE
+	);
+	
+	const uint64_t totalCells = (uint64_t) gridDim.x() * gridDim.y() * gridDim.z();
+	const uint64_t totalBlocks = (uint64_t) blockDim.x() * blockDim.y() * blockDim.z();
+	const bool morton = (header.flags & MACROCELLS_MORTON_LAYOUT) != 0;
+	
+	// every section has to be in the file
+	if (	header.macrocellsOffset + totalCells * sizeof(Macrocell) > mcFile.size() ||
+		header.indicesOffset + (uint64_t) indicesSqrt * indicesSqrt * sizeof(unsigned int) > mcFile.size() ||
+		header.atomsOffset + (uint64_t) atomsSqrt * atomsSqrt * sizeof(gpuAtom) > mcFile.size() ||
+		(header.blockSize == MC_BLOCK_SIZE && header.blocksOffset + totalBlocks > mcFile.size()) ||
+		(morton && header.atomOrderOffset + atomsCount * sizeof(unsigned int) > mcFile.size()) ||
+		header.distancesOffset + totalCells > mcFile.size()
+	)
+	{
+		cerr << "Truncated macrocells file" << endl;
+		mcFile.close();
 		return false;
 	}
 	
-	// write header
-	output.write( (char*) &atomScale, sizeof(float) );
-	output.write( (char*) &voxelsPerAngstrom, sizeof(float) );
-	output.write( (char*) dimensions, sizeof(unsigned int) * 3 );
-	output.write( (char*) &maxMCDensity, sizeof(unsigned int) );
-	output.write( (char*) &indicesCount, sizeof(unsigned int) );
-	output.write( (char*) &atomsCount, sizeof(unsigned int) );
+	cout << "\t dimensions: " << gridDim.x() << " x " << gridDim.y() << " x " << gridDim.z() << endl;
+	cout << "\t atoms: " << atomsCount << endl;
+	cout << "\t indices: " << indicesCount << endl;
+	cout << "\t macrocells: " << totalCells << endl;
+	cout << "\t VPA: " << voxelsPerAngstrom << endl;
+	cout << "\t atom scale: " << atomScale << endl;
+	cout << "\t max MC density: " << maxMCDensity << endl;
+	
+	// point into the mapping
+	char * base = mcFile.writableData();
+	macrocells.wrap( gridDim.x(), gridDim.y(), gridDim.z(), (Macrocell *) (base + header.macrocellsOffset) );
+	indices = (unsigned int *) (base + header.indicesOffset);
+	allAtoms = (gpuAtom *) (base + header.atomsOffset);
+	
+	if (header.blockSize == MC_BLOCK_SIZE) {
+		blocks.wrap( blockDim.x(), blockDim.y(), blockDim.z(), (unsigned char *) (base + header.blocksOffset) );
+	}
+	else {
+		build_blocks();
+	}
 	
-	// write data
-	output.write( (char*) macrocells.data, sizeof(Macrocell) * gridDim.x() * gridDim.y() * gridDim.z() );
-	output.write( (char*) indices, sizeof(unsigned int) * indicesCount );
-	output.write( (char*) allAtoms, sizeof(gpuAtom) * atomsCount ); 
+	distances.wrap( gridDim.x(), gridDim.y(), gridDim.z(), (unsigned char *) (base + header.distancesOffset) );
 	
-	output << flush;
-	output.close();
+	if (morton)
+	{
+		cout << "\t morton layout" << endl;
+		const unsigned int * order = (const unsigned int *) (base + header.atomOrderOffset);
+		atomOrder.assign(order, order + atomsCount);
+	}
+	cout << "\t mapped " << (mcFile.size() >> 20) << " MB" << endl;
 	
 	return true;
 }
 
-bool Macrocells::load( const char * filename )
+bool Macrocells::load_stream( const char * filename )
 {
 	unsigned int dimensions[3];
 	
@@ -279,9 +2383,11 @@ bool Macrocells::load( const char * filename )
 	input.read( (char*) &atomScale, sizeof(float) );
 	input.read( (char*) &voxelsPerAngstrom, sizeof(float) );
 	input.read( (char*) dimensions, sizeof(unsigned int) * 3 );
+	uint32_t counts[2];
 	input.read( (char*) &maxMCDensity, sizeof(unsigned int) );
-	input.read( (char*) &indicesCount, sizeof(unsigned int) );
-	input.read( (char*) &atomsCount, sizeof(unsigned int) );
+	input.read( (char*) counts, sizeof(uint32_t) * 2 );
+	indicesCount = counts[0];
+	atomsCount = counts[1];
 	
 	gridDim.x() = dimensions[0];
 	gridDim.y() = dimensions[1];
@@ -296,8 +2402,8 @@ bool Macrocells::load( const char * filename )
 	cout << "\t max MC density: " << maxMCDensity << endl;
 	
 	// calculate integer square root
-	atomsSqrt = ceil(sqrt(atomsCount));
-	indicesSqrt = ceil(sqrt(indicesCount));
+	atomsSqrt = textureSide(atomsCount);
+	indicesSqrt = textureSide(indicesCount);
 	
 	// allocate memory
 	cout << "Allocating memory for macrocells..." << endl;
@@ -308,37 +2414,248 @@ bool Macrocells::load( const char * filename )
 	cout << "Reading macrocells..." << flush;
 	
 	
-	// read data
-	input.read( (char*) macrocells.data, sizeof(Macrocell) * gridDim.x() * gridDim.y() * gridDim.z() );
+	// read data (cells with 32-bit starts)
+	const size_t totalCells = (size_t) gridDim.x() * gridDim.y() * gridDim.z();
+	vector<uint32_t> cells32(2 * totalCells);
+	input.read( (char*) &cells32[0], sizeof(uint32_t) * 2 * totalCells );
+	for (size_t c = 0; c < totalCells; c++)
+	{
+		macrocells.data[c].ballStart = cells32[2*c];
+		macrocells.data[c].ballCount = cells32[2*c + 1];
+	}
 	input.read( (char*) indices, sizeof(unsigned int) * indicesCount );
 	input.read( (char*) allAtoms, sizeof(gpuAtom) * atomsCount ); 	
-	
 	cout << " OK." << endl;
 	input.close();
 	
+	build_blocks();
+	build_distances();
+	
 	return true;
 }
 
 
-void Macrocells::upload_GLSL()
+uint64_t textureSide(uint64_t count)
+{
+	uint64_t side = (uint64_t) ceil(sqrt((double) count));
+	while (side * side < count) {
+		side++;
+	}
+	return side;
+}
+
+void encodeMacrocells(const Macrocell * cells, size_t count, float * out)
+{
+#ifdef __linux__
+#pragma omp parallel for
+#endif
+	for (int64_t c = 0; c < (int64_t) count; c++)
+	{
+		out[3*c + 0] = (float) (cells[c].ballStart % MC_FLOAT_SPLIT);
+		out[3*c + 1] = (float) (cells[c].ballStart / MC_FLOAT_SPLIT);
+		out[3*c + 2] = (float) cells[c].ballCount;
+	}
+}
+
+void decodeMacrocells(const float * in, size_t count, Macrocell * cells)
+{
+	for (size_t c = 0; c < count; c++, in += 3)
+	{
+		cells[c].ballStart = (uint64_t) in[0] + (uint64_t) in[1] * MC_FLOAT_SPLIT;
+		cells[c].ballCount = (unsigned int) in[2];
+	}
+}
+
+void encodeIndices(const unsigned int * indices, size_t count, float * out)
+{
+#ifdef __linux__
+#pragma omp parallel for
+#endif
+	for (int64_t i = 0; i < (int64_t) count; i++)
+	{
+		out[2*i + 0] = (float) (indices[i] % MC_FLOAT_SPLIT);
+		out[2*i + 1] = (float) (indices[i] / MC_FLOAT_SPLIT);
+	}
+}
+
+void decodeIndices(const float * in, size_t count, unsigned int * indices)
+{
+	for (size_t i = 0; i < count; i++, in += 2) {
+		indices[i] = (unsigned int) in[0] + (unsigned int) in[1] * MC_FLOAT_SPLIT;
+	}
+}
+
+// normalized 16-bit texel values
+static const float COMPACT_STEPS = 65535.0f;
+
+float compactAtomRange(const Grid3<Macrocell> & cells, const unsigned int * indices, const gpuAtom * atoms)
+{
+	float range = 0.0f;
+#ifdef __linux__
+#pragma omp parallel for reduction(max:range)
+#endif
+	for (int m = 0; m < cells.d3; m++)
+		for (int l = 0; l < cells.d2; l++)
+			for (int k = 0; k < cells.d1; k++)
+			{
+				const Macrocell & mc = cells.get_data(k, l, m);
+				for (uint64_t b = mc.ballStart; b < mc.ballStart + mc.ballCount; b++)
+				{
+					const gpuAtom & a = atoms[ indices[b] ];
+					range = max(range, max(k - a.x, a.x - (k + 1)));
+					range = max(range, max(l - a.y, a.y - (l + 1)));
+					range = max(range, max(m - a.z, a.z - (m + 1)));
+				}
+			}
+	return range;
+}
+
+static inline uint16_t quantize(float offset, float range)
+{
+	const float q = (offset + range) / (1.0f + 2.0f * range) * COMPACT_STEPS + 0.5f;
+	return (uint16_t) max(0.0f, min(COMPACT_STEPS, q));
+}
+
+void encodeCompactAtoms(const Grid3<Macrocell> & cells, const unsigned int * indices, const gpuAtom * atoms, float range, compactAtom * out)
+{
+#ifdef __linux__
+#pragma omp parallel for
+#endif
+	for (int m = 0; m < cells.d3; m++)
+		for (int l = 0; l < cells.d2; l++)
+			for (int k = 0; k < cells.d1; k++)
+			{
+				const Macrocell & mc = cells.get_data(k, l, m);
+				for (uint64_t b = mc.ballStart; b < mc.ballStart + mc.ballCount; b++)
+				{
+					const gpuAtom & a = atoms[ indices[b] ];
+					compactAtom & c = out[b];
+					c.x = quantize(a.x - k, range);
+					c.y = quantize(a.y - l, range);
+					c.z = quantize(a.z - m, range);
+					c.index = (uint16_t) max(0.0f, a.index);
+				}
+			}
+}
+
+gpuAtom decodeCompactAtom(const compactAtom & c, int k, int l, int m, float range)
 {
-	// make a 3D float3 texture
-	float * textureMem = new float[3 * gridDim.x() * gridDim.y() * gridDim.z()];
-	float  * pTexMem = textureMem;
+	const float scale = (1.0f + 2.0f * range) / COMPACT_STEPS;
+	gpuAtom a;
+	a.x = k - range + c.x * scale;
+	a.y = l - range + c.y * scale;
+	a.z = m - range + c.z * scale;
+	a.index = c.index;
+	return a;
+}
+
+float compactAtomError(float range)
+{
+	return 0.5f * (1.0f + 2.0f * range) / COMPACT_STEPS;
+}
+
+// warns about 2D textures the driver will refuse
+static void check_texture_side(const char * what, uint64_t side)
+{
+	GLint maxSize = 0;
+	glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxSize);
+	if (maxSize > 0 && side > (uint64_t) maxSize) {
+		cerr << "Macrocells: " << what << " texture needs " << side << "^2 texels, GL_MAX_TEXTURE_SIZE is " << maxSize << endl;
+	}
+}
+
+void Macrocells::stage_GLSL(MC_REF_MODE mode)
+{
+	Timer timer;
+	timer.start();
 	
-	for (int m = 0; m < gridDim.z(); m++)
-		for (int l = 0; l < gridDim.y(); l++)
-			for (int k = 0; k < gridDim.x(); k++)
-			{				
-				const Macrocell & mc = macrocells.get_data(k, l, m);
-				pTexMem[0] = mc.ballStart;
-				pTexMem[1] = mc.ballCount;
-				pTexMem[2] = m;
-				
-				pTexMem += 3;
+	// split (start, count) of every cell, once per upload
+	const size_t totalCells = (size_t) gridDim.x() * gridDim.y() * gridDim.z();
+	const bool stageCells = !macrocellsTex && !stagedCells;
+	if (stageCells)
+	{
+		stagedCells = new float[3 * totalCells];
+		encodeMacrocells(macrocells.data, totalCells, stagedCells);
+	}
+	
+	if (stagedRef && stagedRefMode != mode)
+	{
+		delete [] stagedRef;
+		stagedRef = NULL;
+	}
+	if (!stagedRef)
+	{
+		const uint64_t texels = indicesSqrt * indicesSqrt;
+		switch (mode)
+		{
+		case MC_DIRECT:
+		{
+			// copies of the atoms referenced, in index order
+			gpuAtom * atoms = (gpuAtom *) (stagedRef = new char[texels * sizeof(gpuAtom)]);
+		#ifdef __linux__
+		#pragma omp parallel for
+		#endif
+			for (int64_t i = 0; i < (int64_t) indicesCount; i++) {
+				atoms[i] = allAtoms[ indices[i] ];
 			}
+			memset(atoms + indicesCount, 0, (texels - indicesCount) * sizeof(gpuAtom));
+			break;
+		}
+		
+		case MC_INDEXED:
+		{
+			// split indices, two floats each
+			float * fIndices = (float *) (stagedRef = new char[2 * texels * sizeof(float)]);
+			encodeIndices(indices, indicesCount, fIndices);
+			break;
+		}
+			
+		case MC_DIRECT_COMPACT:
+		{
+			compactAtom * atoms = (compactAtom *) (stagedRef = new char[texels * sizeof(compactAtom)]);
+			compactRange = compactAtomRange(macrocells, indices, allAtoms);
+			memset(atoms + indicesCount, 0, (texels - indicesCount) * sizeof(compactAtom));
+			encodeCompactAtoms(macrocells, indices, allAtoms, compactRange, atoms);
+			break;
+		}
+		}
+		stagedRefMode = mode;
+	}
+	else if (!stageCells) {
+		return;
+	}
+	stats.stagingTime = timer.getElapsedTimeInSec();
+}
+
+bool Macrocells::isStaged(MC_REF_MODE mode) const
+{
+	return stagedRef && stagedRefMode == mode && (macrocellsTex || stagedCells);
+}
+
+void Macrocells::release_staging()
+{
+	delete [] stagedCells;
+	delete [] stagedRef;
+	stagedCells = NULL;
+	stagedRef = NULL;
+}
+
+void Macrocells::upload_GLSL()
+{
+	// balls.frag addresses the index texture with ints
+	if (indicesCount > INT_MAX)
+	{
+		cerr << "Macrocells: " << indicesCount << " indices are too many to draw, use a lower vpa." << endl;
+		exit(1);
+	}
+	
+	const bool ahead = isStaged(refMode);
+	stage_GLSL(refMode);
 	
-	// 3D macrocells texture
+	Timer timer;
+	timer.start();
+	
+	// 3D macrocells texture (float3: split start, count)
 	glGenTextures(1, &macrocellsTex);
 	glBindTexture(GL_TEXTURE_3D, macrocellsTex);
 	
@@ -348,14 +2665,32 @@ void Macrocells::upload_GLSL()
 	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
 	//glTexImage3D(GL_TEXTURE_3D, 0, GL_RGB32UI, gridDim.x(), gridDim.y(), gridDim.z(), 0, GL_RGB_INTEGER GL_UNSIGNED_INT, textureMem);
-	glTexImage3D(GL_TEXTURE_3D, 0, GL_RGB32F, gridDim.x(), gridDim.y(), gridDim.z(), 0, GL_RGB, GL_FLOAT, textureMem);
+	glTexImage3D(GL_TEXTURE_3D, 0, GL_RGB32F, gridDim.x(), gridDim.y(), gridDim.z(), 0, GL_RGB, GL_FLOAT, stagedCells);
 	glFinish();
 	
-	delete [] textureMem;
+	delete [] stagedCells;
+	stagedCells = NULL;
+	
+	// 3D occupancy texture (one byte per block)
+	glGenTextures(1, &blocksTex);
+	glBindTexture(GL_TEXTURE_3D, blocksTex);
+	
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexImage3D(GL_TEXTURE_3D, 0, GL_R8, blockDim.x(), blockDim.y(), blockDim.z(), 0, GL_RED, GL_UNSIGNED_BYTE, blocks.data);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
 	
 	// upload indices
 	changeRefMode( refMode );
 	hasGPUData = true;
+	
+	stats.uploadTime = timer.getElapsedTimeInSec();
+	cout << " * Macrocells staging: " << stats.stagingTime << " sec" << (ahead ? " (ahead of time)" : "") 
+		<< ", upload: " << stats.uploadTime << " sec" << endl;
 }
 
 void Macrocells::changeRefMode(MC_REF_MODE mode)
@@ -366,12 +2701,19 @@ void Macrocells::changeRefMode(MC_REF_MODE mode)
 	
 	refMode = mode;
 	
+	// switching modes of uploaded macrocells (rather than the first upload)
+	const bool modeSwitch = hasGPUData;
 	if (hasGPUData) {
 		GLuint TEX[2] = {tboIndices, tboAtoms};
 		glDeleteTextures(2, TEX);
 		hasGPUData = false;
 	}
 	
+	const bool ahead = isStaged(refMode);
+	stage_GLSL(refMode);
+	
+	Timer timer;
+	timer.start();
 	switch (refMode)
 	{
 	case MC_DIRECT:
@@ -381,8 +2723,21 @@ void Macrocells::changeRefMode(MC_REF_MODE mode)
 	case MC_INDEXED:
 		build_indexed_ref();
 		break;
+		
+	case MC_DIRECT_COMPACT:
+		build_compact_ref();
+		break;
 	}
+	delete [] stagedRef;
+	stagedRef = NULL;
 	hasGPUData = true;
+	
+	if (modeSwitch)
+	{
+		stats.uploadTime = timer.getElapsedTimeInSec();
+		cout << " * \t staging: " << stats.stagingTime << " sec" << (ahead ? " (ahead of time)" : "") 
+			<< ", upload: " << stats.uploadTime << " sec" << endl;
+	}
 }
 
 void Macrocells::build_indexed_ref()
@@ -416,20 +2771,17 @@ void Macrocells::build_indexed_ref()
 		tboIndices = TEX[0];
 		tboAtoms = TEX[1];
 				
-		float * fIndices = new float[ indicesSqrt * indicesSqrt ];
-		for (int i = 0; i < indicesCount; i++)
-			fIndices[i] = indices[i];
+		check_texture_side("indices", indicesSqrt);
+		check_texture_side("atoms", atomsSqrt);
 		
-		// indices
+		// indices (split, staged)
 		glBindTexture(GL_TEXTURE_2D, tboIndices);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, indicesSqrt, indicesSqrt, 0, GL_LUMINANCE, GL_FLOAT, fIndices);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RG32F, indicesSqrt, indicesSqrt, 0, GL_RG, GL_FLOAT, stagedRef);
 		
-		delete [] fIndices;
-
 		// atoms
 		glBindTexture(GL_TEXTURE_2D, tboAtoms);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
@@ -449,36 +2801,43 @@ void Macrocells::build_direct_ref()
 	cout << " * Uploading Macrocells with direct atom reference..." << endl;
 	cout << " \t * atoms sqrt: " << indicesSqrt << endl;
 	
-	// make a new texture for direct atom reference
-	gpuAtom * atoms = new gpuAtom[indicesSqrt * indicesSqrt];
-	gpuAtom * pAtoms = atoms;
-	const unsigned int * pIndices = indices;
-
-	// loop through all indices and copy the atoms referenced to the new texture	
-	for (unsigned int i = 0; i < indicesCount; i++, pIndices++, pAtoms++)
-	{	
-		memcpy(pAtoms, allAtoms + *pIndices, sizeof(gpuAtom));
-	}
-	
+	check_texture_side("atoms", indicesSqrt);
 	
 	GLuint TEX[2];
 	glGenTextures(2, TEX);
 	tboIndices = TEX[0];
 	tboAtoms = TEX[1];
 	
-	// atoms instead of indices	
+	// atoms instead of indices (gathered when staged)
 	glBindTexture(GL_TEXTURE_2D, tboAtoms);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, indicesSqrt, indicesSqrt, 0, GL_RGBA, GL_FLOAT, atoms);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, indicesSqrt, indicesSqrt, 0, GL_RGBA, GL_FLOAT, stagedRef);
 	
 	// wait for upload
 	glFinish();
-		
-	// cleanup
-	delete [] atoms;
 }
 
-
+void Macrocells::build_compact_ref()
+{
+	cout << " * Uploading Macrocells with compact direct atom reference..." << endl;
+	check_texture_side("atoms", indicesSqrt);
+	cout << " \t * range: " << compactRange << ", error: " << compactAtomError(compactRange) << " cells" << endl;
+	
+	GLuint TEX[2];
+	glGenTextures(2, TEX);
+	tboIndices = TEX[0];
+	tboAtoms = TEX[1];
+	
+	glBindTexture(GL_TEXTURE_2D, tboAtoms);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16, indicesSqrt, indicesSqrt, 0, GL_RGBA, GL_UNSIGNED_SHORT, stagedRef);
+	
+	// wait for upload
+	glFinish();
+}
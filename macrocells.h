@@ -8,29 +8,268 @@
  * http://www.gnu.org/licenses/gpl-2.0.html
  * macrocells.h
  *
+ * .macrocells file, version 2:
+ *   MacrocellsFileHeader
+ *   macrocells		(Macrocell per cell, x fastest)
+ *   indices		(indicesSqrt^2 uint, zero padded)
+ *   atoms		(atomsSqrt^2 gpuAtom, zero padded)
+ *   blocks		(byte per occupancy block)
+ *   atom order		(atomsCount uint, Morton layout only)
+ *   distances		(byte per macrocell)
+ * Sections start on page boundaries and are padded to
+ * their texture size, so the file is used in place
+ * through mmap. Headerless files of the original format
+ * are still read.
  * -----------------------------------------------
  */
  
 #ifndef _MACROCELLS_H___
 #define _MACROCELLS_H___
 
+#include <stdint.h>
+#include <stddef.h>
+#include <iostream>
 #include <string>
 #include <vector>
 #include "data.h"
 
+class ChargeDensityVolume;
+
 enum MC_REF_MODE
 {
 	MC_DIRECT,		// atoms are referenced directly
 	MC_INDEXED,		// atoms are referenced by global index
+	MC_DIRECT_COMPACT,	// direct, quantized relative to the macrocell (compactAtom)
 };
 static MC_REF_MODE MC_REF_MODE_DEFAULT = MC_DIRECT;
 
+// reference mode of macrocells constructed from here on
+void setMacrocellRefMode(MC_REF_MODE mode);
+
+// Whether the builder puts atoms only in cells their sphere overlaps (default),
+// or in every cell their bounding box overlaps
+void setExactCellOverlap(bool exact);
+
+// Whether the builder uses the Morton (Z-order) layout for atoms and index lists
+void setMortonLayout(bool morton);
+
+// Largest fraction of atoms that may change cells for an incremental update;
+// beyond it the macrocells are rebuilt from scratch (0: always rebuild)
+void setMacrocellChurnLimit(float limit);
+
+// Slack, in Angstroms, left around the atoms on every side of grids that are
+// meant to be updated (default 3), so that atoms jittering at the surface do
+// not leave the grid and force a rebuild
+void setMacrocellUpdateMargin(float angstroms);
+
+// Grid of such a structure: [worldMin, worldMax] padded by the update margin
+void macrocellUpdateGrid(vec3 worldMin, vec3 worldMax, float vpa, vec3 & gridOrigin, vec3i & gridDim);
+
+// Whether full builds are split across the MPI ranks (MPI builds only): every
+// rank lists the atoms of its own slab of cells, and the cell counts and
+// indices of all slabs are gathered (MPI_Allgatherv over MPI_COMM_WORLD), so
+// that each rank ends up with the whole structure. All ranks have to build
+// from the same atoms at once.
+// Only the count and scatter passes are split; every rank still reads and
+// converts all atoms and builds the blocks and distance field. With one rank
+// per node, the build is expected to go about N times faster across N nodes
+// while those passes dominate, less the gather: every rank receives the
+// indices of the others (4 bytes each), e.g. about 0.15 sec for 40M indices
+// over 10 Gbit/s. Ranks sharing a node should split its cores between them
+// (omp_set_num_threads), or they only take cores from each other.
+void setDistributedBuild(bool distributed);
+
+// macrocells per side of a block in the coarse occupancy level
+static const int MC_BLOCK_SIZE = 4;
+
+// cap of the empty space distance field (distances are stored in a byte)
+static const int MC_MAX_DISTANCE = 255;
+
+// -vpa auto
+static const float MC_AUTO_VPA = 0.0f;
+
+// What macrocells at a given resolution are predicted to cost. Rays are
+// costed in units of one ray-sphere test.
+struct MacrocellCost
+{
+	float		vpa;
+	vec3i		gridDim;
+	double		indicesCount;		// (cell, atom) entries
+	double		occupiedCells;		// cells with at least one atom
+	double		atomsPerCell;		// mean atom list of an occupied cell
+	double		cellsPerRay;		// macrocells and empty blocks stepped through up to
+						// the first occupied cell
+	double		atomsPerRay;		// atoms tested in that cell
+	double		bytes;			// GPU memory for the macrocell and atom textures
+	double		cost;			// per ray
+	bool		fits;			// within the memory budget
+};
+
+// Estimates the cost of macrocells at vpa from a sample of the atoms: cells are
+// filled with the sample's footprints and probe rays (macrocellProbeRays) are
+// marched through them
+MacrocellCost predictMacrocellCost(const Atoms & atoms, float vpa, float atomScale, vec3 worldMin, vec3 worldMax);
+
+// Picks the vpa with the lowest predicted cost among a geometric range of
+// resolutions that fit in memory
+float chooseMacrocellVPA(const Atoms & atoms, float atomScale, vec3 worldMin, vec3 worldMax, MacrocellCost * chosen = NULL);
+
+// The probe rays of the cost model, in grid space: n x n rays entering through
+// each of three faces of the grid, slightly tilted off the axes
+void macrocellProbeRays(const vec3i & gridDim, int n, vector<vec3f> & origins, vector<vec3f> & directions);
+
+// one line summary of a prediction
+ostream & operator<<(ostream & out, const MacrocellCost & c);
+
+// Builds the macrocells of a binary atoms file (.atoms) straight into a
+// .macrocells file, for structures that do not fit in memory. Atoms are read in
+// chunks and their (cell, atom) pairs go to bucket files of consecutive z planes
+// (outFile.bucket<n>), sized so that sorting one bucket into its cells and
+// indices fits memoryBudget bytes. The distance field and occupancy blocks (a
+// byte per macrocell) are kept in memory. Writes the same file as building in
+// core and saving; not for the Morton layout.
+bool buildMacrocellsOutOfCore(const string & atomsFile, float vpa, float atomScale, const string & outFile, uint64_t memoryBudget);
+
+static const char		MACROCELLS_MAGIC[8]	= {'S', 'N', 'V', 'M', 'C', 'E', 'L', 'L'};
+static const uint32_t		MACROCELLS_VERSION	= 2;
+static const uint32_t		MACROCELLS_BYTE_ORDER	= 0x01020304;
+
+// header flags
+static const uint32_t		MACROCELLS_MORTON_LAYOUT = 1;	// atoms sorted by the Z-order code of their
+								// cell, index lists laid out in Z-order
+
+struct MacrocellsFileHeader
+{
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	byteOrder;		// MACROCELLS_BYTE_ORDER as written by the producer
+	uint32_t	headerSize;		// sizeof(MacrocellsFileHeader)
+	uint32_t	flags;
+
+	float		atomScale;
+	float		voxelsPerAngstrom;
+	uint32_t	gridDim[3];
+	uint32_t	blockSize;		// macrocells per side of an occupancy block
+
+	uint64_t	maxMCDensity;
+	uint64_t	atomsCount;
+	uint64_t	indicesCount;
+
+	// byte offsets of the sections from the start of the file (0: not present)
+	uint64_t	macrocellsOffset;
+	uint64_t	indicesOffset;
+	uint64_t	atomsOffset;
+	uint64_t	blocksOffset;
+	uint64_t	atomOrderOffset;
+	uint64_t	distancesOffset;
+};
+
+// 64-bit starts: with 8-27 indices per atom, a few billion atoms are well
+// past 4G indices (atoms themselves stay 32-bit indices)
 struct Macrocell
 {
-	unsigned int ballStart;
+	uint64_t ballStart;
 	unsigned int ballCount;
 }  __attribute__((packed));
 
+// Cell starts and atom indices reach the GPU as floats, which hold integers
+// exactly only up to 2^24 (16.7M). They are split in two floats instead:
+// v = lo + hi * MC_FLOAT_SPLIT. Counts (atoms in one cell) stay one float.
+static const uint32_t MC_FLOAT_SPLIT = 65536;
+
+// per cell: start lo, start hi, count
+void encodeMacrocells(const Macrocell * cells, size_t count, float * out);
+void decodeMacrocells(const float * in, size_t count, Macrocell * cells);
+
+// per index: lo, hi
+void encodeIndices(const unsigned int * indices, size_t count, float * out);
+void decodeIndices(const float * in, size_t count, unsigned int * indices);
+
+// side of the square texture holding count entries
+uint64_t textureSide(uint64_t count);
+
+// Entry of the compact direct reference (8 bytes instead of a 16 byte gpuAtom).
+// The position is relative to the macrocell the entry is listed in, quantized
+// to 16 bits over [-range, 1 + range] per axis, where range is how far (grid
+// units) atom centers lie outside the cells they are put in. Uploaded as a
+// normalized RGBA16 texture.
+struct compactAtom
+{
+	uint16_t x, y, z;
+	uint16_t index;		// shader index of the element
+} __attribute__((packed));
+
+// largest distance of an atom center outside a cell listing it
+float compactAtomRange(const Grid3<Macrocell> & cells, const unsigned int * indices, const gpuAtom * atoms);
+
+// compact entries for every index, in index order
+void encodeCompactAtoms(const Grid3<Macrocell> & cells, const unsigned int * indices, const gpuAtom * atoms, float range, compactAtom * out);
+
+// entry of macrocell (k, l, m) back to a gpuAtom; positions are off by at most
+// compactAtomError(range) per axis
+gpuAtom decodeCompactAtom(const compactAtom & c, int k, int l, int m, float range);
+float compactAtomError(float range);
+
+// lowest and highest density the volume renderer can sample in a macrocell
+struct DensityRange
+{
+	float lo, hi;
+};
+
+// What a Macrocells structure looks like and what it cost to make, for
+// comparing datasets and builds
+struct MacrocellStats
+{
+	string			mode;			// "build", "update" or "load"
+	float			vpa;
+	int			gridDim[3];
+	bool			morton;
+	int			ranks;			// MPI ranks the build was split across
+
+	// occupancy
+	uint64_t		cells;
+	uint64_t		emptyCells;
+	uint64_t		atoms;
+	uint64_t		indices;
+	unsigned int		maxDensity;
+	double			meanDensity;		// atoms per occupied cell
+	double			duplication;		// indices / atoms
+
+	// histogram[0]: empty cells, histogram[b]: cells with 2^(b-1) .. 2^b - 1 atoms
+	vector<uint64_t>	histogram;
+
+	// bytes in memory (allocated sizes, including texture padding)
+	uint64_t		macrocellBytes;
+	uint64_t		indexBytes;
+	uint64_t		atomBytes;
+	uint64_t		blockBytes;
+	uint64_t		distanceBytes;
+	uint64_t		atomOrderBytes;
+	uint64_t		directRefBytes;		// GPU atom copies for MC_DIRECT
+	uint64_t		compactRefBytes;	// same for MC_DIRECT_COMPACT
+
+	// seconds, 0 for stages that did not run
+	double			sortTime;
+	double			countTime;
+	double			prefixTime;
+	double			scatterTime;
+	double			combineTime;		// collectives of a distributed build
+	double			detectTime;
+	double			patchTime;
+	double			blocksTime;
+	double			distancesTime;
+	double			loadTime;
+	double			totalTime;
+	
+	// GPU upload: CPU side (encoding and gathering) and GL calls
+	double			stagingTime;
+	double			uploadTime;
+
+	MacrocellStats();
+	void print(ostream & out) const;
+	void write_json(ostream & out) const;
+};
+
 
 class Macrocells
 {
@@ -42,6 +281,23 @@ public:
 		vec3 worldMin, vec3 worldMax, string saveFile
 	);
 
+	// constructs macrocells over a given grid (e.g. a padded one, from
+	// macrocellUpdateGrid); the grid has to cover all atoms
+	Macrocells(
+		const Atoms & vAtoms,
+		float vpa, float atomScale,
+		vec3 gridOrigin, vec3i gridDim, string saveFile
+	);
+
+	// Updates the macrocells of the previous timestep for new positions of the
+	// same atoms: only atoms whose cells changed are re-binned. Falls back to a
+	// full build if too many did, or the atoms no longer fit the previous grid.
+	Macrocells(
+		const Macrocells & previous,
+		const Atoms & vAtoms,
+		vec3 worldMin, vec3 worldMax, string saveFile
+	);
+
 	// loads macrocells from file
 	Macrocells(string filename);
 	
@@ -50,37 +306,106 @@ public:
 	
 	// pload to GPU
 	void upload_GLSL();
+	
+	// Prepares the buffers upload_GLSL / changeRefMode hand to GL for reference
+	// mode mode (encoded cells and the reference texture) without touching GL,
+	// so that it can run ahead of time on another thread. Uploads stage
+	// whatever was not staged before.
+	void stage_GLSL(MC_REF_MODE mode);
+	bool isStaged(MC_REF_MODE mode) const;
+	void release_staging();
 
 	// public accessors for texture IDs
 	GLuint getMacrocellsTex() const { return macrocellsTex; }
 	GLuint getIndicesTex() const { return tboIndices; }
 	GLuint getAtomsTex() const { return tboAtoms; }
+	GLuint getBlocksTex() const { return blocksTex; }
 
 	// change macrocell atom referel way works
 	void changeRefMode(MC_REF_MODE _mode);
 	MC_REF_MODE getRefMode() const { return refMode; }
 	
+	// quantization range of MC_DIRECT_COMPACT (valid once uploaded in that mode)
+	float getCompactRange() const { return compactRange; }
+	
 	// public accessors
 	unsigned int getMaxMCDensity() const { return maxMCDensity; }
-	int getIndicesSqrt() const { return indicesSqrt; }
-	int getAtomsSqrt() const { return atomsSqrt; }
+	int getIndicesSqrt() const { return (int) indicesSqrt; }
+	int getAtomsSqrt() const { return (int) atomsSqrt; }
+	uint64_t getAtomsCount() const { return atomsCount; }
+	uint64_t getIndicesCount() const { return indicesCount; }
 	bool hasGLSLData() const { return hasGPUData; }
 	float getVPA() const { return voxelsPerAngstrom; }
 	float getAtomScale() const { return atomScale; }
 	const vec3i & getGridDim() const { return gridDim; }
+	const vec3i & getBlockDim() const { return blockDim; }
+	
+	// whether this can be the previous timestep of an update
+	// (structures loaded from file do not know their world origin)
+	bool canUpdate() const { return hasOrigin; }
+	const vec3 & getOrigin() const { return origin; }
+	
+	// whether the update constructor patched the previous timestep (rather
+	// than falling back to a full build)
+	bool wasUpdated() const { return updated; }
+	
+	// CPU side structure (traversal)
+	const Grid3<Macrocell> & getMacrocells() const { return macrocells; }
+	const Grid3<unsigned char> & getBlocks() const { return blocks; }
+	const Grid3<unsigned char> & getDistances() const { return distances; }
+	const unsigned int * getIndices() const { return indices; }
+	const gpuAtom * getGPUAtoms() const { return allAtoms; }
+	
+	// Morton layout: original (file) index of every atom in getGPUAtoms()
+	bool isMortonLayout() const { return !atomOrder.empty(); }
+	const vector<unsigned int> & getAtomOrder() const { return atomOrder; }
+	
+	// occupancy, memory and timings of this structure
+	const MacrocellStats & getStats() const { return stats; }
+	
+	// Finds the density range of every macrocell's footprint in the volume (the
+	// voxels trilinear samples inside the cell read)
+	void buildDensityRange(const ChargeDensityVolume & volume);
+	bool hasDensityRange() const { return densityRange.data != NULL; }
+	const Grid3<DensityRange> & getDensityRange() const { return densityRange; }
+	
+	// Marks the cells whose density range the transfer function gives any
+	// opacity. opacity holds n bins over [0, maxValue] (the shader's TF lookup),
+	// tolerance widens the ranges for quantized volumes. Updates the texture
+	// once uploaded. Returns the number of visible cells.
+	size_t updateVisibility(const vector<float> & opacity, float maxValue, float tolerance = 0.0f);
+	const Grid3<unsigned char> & getVisible() const { return visible; }
+	GLuint getVisibleTex() const { return visibleTex; }
 	
 private:	
 	
 	// private functions
+	void build(const Atoms & vAtoms, vec3 gridOrigin, const vec3i & dim);
+	bool update(const Macrocells & previous, const Atoms & vAtoms, vec3 worldMin, vec3 worldMax);
+	void save_file(const string & saveFile);
 	bool save(const char * );
 	bool load(const char * );
+	bool load_stream(const char * );	// original format
+	
+	// marks blocks of MC_BLOCK_SIZE^3 macrocells that have any atoms
+	void build_blocks();
 	
-	// reference building / upload to GLSL
+	// Chebyshev distance (in macrocells, capped at MC_MAX_DISTANCE) from every
+	// cell to the nearest occupied one, 0 for occupied cells: a ray can leap
+	// out of the (2d - 1)^3 cube of empty cells around a cell at distance d
+	void build_distances();
+	
+	// fills in everything in stats but the timings
+	void compute_stats();
+	
+	// reference upload to GLSL (from the staged buffers)
 	void build_indexed_ref();
 	void build_direct_ref();	// builds direct reference array and upload it to GPU
+	void build_compact_ref();	// same with compactAtom entries
 	
 	// referal mode
 	MC_REF_MODE			refMode;
+	float				compactRange;
 	
 	// size of macrocells structure
 	vec3i				gridDim;
@@ -90,23 +415,52 @@ private:
 	float				atomScale;
 	unsigned int			maxMCDensity;
 	
-	unsigned int			atomsCount;
-	int				atomsSqrt;
+	// world position of cell (0, 0, 0) and how atoms were assigned to cells
+	// (only known when built rather than loaded)
+	vec3				origin;
+	bool				hasOrigin;
+	bool				updated;
+	bool				exactCells;
+	
+	uint64_t			atomsCount;
+	uint64_t			atomsSqrt;
 	
-	unsigned int			indicesCount;
-	int				indicesSqrt;
+	uint64_t			indicesCount;
+	uint64_t			indicesSqrt;
 	
-	// temp macrocells data
-	Grid3<vector<unsigned int> >	tempMacrocells;
+	MacrocellStats			stats;
+	
+	// file the structure below points into (when loaded from a version 2 file)
+	MappedFile			mcFile;
 	
 	// final macrocells structure
 	gpuAtom *			allAtoms;
 	unsigned int *			indices;
 	Grid3<Macrocell>		macrocells;
 	
+	// Morton layout atom permutation (empty: file order)
+	vector<unsigned int>		atomOrder;
+	
+	// coarse occupancy level (1: block has atoms)
+	vec3i				blockDim;
+	Grid3<unsigned char>		blocks;
+	
+	// empty space distance field (build_distances)
+	Grid3<unsigned char>		distances;
+	
+	// volume density per cell and transfer function visibility (1: visible)
+	Grid3<DensityRange>		densityRange;
+	Grid3<unsigned char>		visible;
+	GLuint				visibleTex;
+	
+	// staged upload (stage_GLSL), freed once handed to GL
+	float *				stagedCells;
+	char *				stagedRef;
+	MC_REF_MODE			stagedRefMode;
+	
 	// GLSL data
 	bool hasGPUData, texInited;
-	GLuint macrocellsTex, tboIndices, tboAtoms;
+	GLuint macrocellsTex, tboIndices, tboAtoms, blocksTex;
 };
 
 #endif
@@ -14,6 +14,7 @@
 #include <iostream>
 #include <string>
 #include <sstream>
+#include <fstream>
 #include <stdlib.h>
 
 #include "graphics/graphics.h"
@@ -24,6 +25,7 @@
 #include "data.h"
 #include "macrocells.h"
 #include "charge_volume.h"
+#include "traversal.h"
 #include "camera.h"
 #include "Matrix44.hxx"
 #include "Timer.h"
@@ -113,7 +115,9 @@ int traversalLevel = 0;
 
 // data load / save / create
 string dataFile, macrocellsFile, volumeFile, tfFile, sequenceFile, cameraFile, movieDir;
+string statsFile;		// macrocell statistics as JSON
 bool loadSequence		= false;
+bool trajectory			= false;
 #ifdef DO_MPI
 bool noSync			= false;
 bool offlineSequenceRender	= false;
@@ -142,6 +146,8 @@ bool drawMeta			= false;
 bool densityRayCast		= false;
 bool ballsRayCast		= true;	
 bool skipEmpty			= false;
+bool skipBlocks			= true;
+bool tfSkip			= true;			// skip volume samples in cells the TF makes transparent
 bool drawVolume			= true;			void _drawVolume(bool b)	{ drawVolume = b; compileShaders(); }
 bool drawBalls			= true;			void _drawBalls(bool b)	{ drawBalls = b; compileShaders(); }		
 bool drawTF			= true;
@@ -150,6 +156,7 @@ bool clipBox			= false;			void _clipBox(bool b)	{ clipBox = b; compileShaders();
 vec3 clipBoxMin			= vec3(0.0f);		void _clipBoxMin(vec3 m)	{ clipBoxMin = m; }
 vec3 clipBoxMax			= vec3(1.0f);		void _clipBoxMax(vec3 m)	{ clipBoxMax = m; }
 bool thinClient			= false;			// if true, we won't render data on master, just interface
+bool distributedBuild		= false;			// MPI ranks build macrocells together
 
 // meta keys
 bool shiftKey			= false;
@@ -214,7 +221,9 @@ bool parseCmdLine(int argc, char ** argv)
 		}
 		else if (0 == strcasecmp("-vpa", argv[i]) && i < argc-1)
 		{
-			voxelsPerAngstrom = atof(argv[++i]);
+			// "auto" picks it from the atom distribution when macrocells are built
+			i++;
+			voxelsPerAngstrom = 0 == strcasecmp("auto", argv[i]) ? MC_AUTO_VPA : atof(argv[i]);
 		}
 		else if (0 == strcasecmp("-cvpa", argv[i]) && i < argc-1)
 		{
@@ -256,6 +265,10 @@ bool parseCmdLine(int argc, char ** argv)
 		{
 			drawVolume = false;
 		}
+		else if (0 == strcasecmp("-no_tf_skip", argv[i]))
+		{
+			tfSkip = false;
+		}
 		else if (0 == strcasecmp("-res_scale", argv[i]) && i < argc-2)
 		{
 			resScaleX = atof(argv[++i]);
@@ -285,6 +298,40 @@ bool parseCmdLine(int argc, char ** argv)
 		{
 			atomScale = atof(argv[++i]);	
 		}
+		else if (0 == strcasecmp("-compact_atoms", argv[i]))
+		{
+			// 8 byte quantized entries in the direct atom reference
+			setMacrocellRefMode(MC_DIRECT_COMPACT);
+		}
+		else if (0 == strcasecmp("-morton_layout", argv[i]))
+		{
+			setMortonLayout(true);
+		}
+		else if (0 == strcasecmp("-stats", argv[i]) && i < argc-1)
+		{
+			statsFile = argv[++i];
+		}
+		else if (0 == strcasecmp("-churn_limit", argv[i]) && i < argc-1)
+		{
+			// fraction of atoms that may change cells before a timestep's
+			// macrocells are rebuilt rather than updated (0 always rebuilds)
+			setMacrocellChurnLimit(atof(argv[++i]));
+		}
+		else if (0 == strcasecmp("-update_margin", argv[i]) && i < argc-1)
+		{
+			// slack (Angstroms) around the atoms of a trajectory's grid, so
+			// that later timesteps can be updated while atoms stay within it
+			setMacrocellUpdateMargin(atof(argv[++i]));
+		}
+		else if (0 == strcasecmp("-no_skip_blocks", argv[i]))
+		{
+			skipBlocks = false;
+		}
+		else if (0 == strcasecmp("-box_overlap", argv[i]))
+		{
+			// A/B: put atoms in every macrocell their bounding box touches
+			setExactCellOverlap(false);
+		}
 		else if (0 == strcasecmp("-traversal_level", argv[i]) && i < argc-1)
 		{
 			traversalLevel = atoi(argv[++i]);
@@ -314,6 +361,34 @@ bool parseCmdLine(int argc, char ** argv)
 			clipBoxMax.z() = atof(argv[++i]);
 			clipBox = true;
 		}
+		else if (0 == strcasecmp("-trajectory", argv[i]))
+		{
+			trajectory = true;
+		}
+		else if (0 == strcasecmp("-prefetch", argv[i]))
+		{
+			// load (and stage the upload of) the next timestep while rendering
+			setSequencePrefetch(true);
+		}
+		else if (0 == strcasecmp("-type_map", argv[i]) && i < argc-1)
+		{
+			if (!setDATTypeMap(argv[++i])) {
+				exit(1);
+			}
+		}
+		else if (0 == strcasecmp("-roi", argv[i]) && i < argc-6)
+		{
+			// only load atoms in this box
+			vec3f roiMin, roiMax;
+			roiMin.x() = atof(argv[++i]);
+			roiMin.y() = atof(argv[++i]);
+			roiMin.z() = atof(argv[++i]);
+			
+			roiMax.x() = atof(argv[++i]);
+			roiMax.y() = atof(argv[++i]);
+			roiMax.z() = atof(argv[++i]);
+			setLoadRegion(roiMin, roiMax);
+		}
 		else if (0 == strcasecmp("-shaders_dir", argv[i]) && i < argc-1)
 		{
 			setShadersDir(argv[++i]);
@@ -360,6 +435,11 @@ bool parseCmdLine(int argc, char ** argv)
 		{
 			thinClient = true;
 		}
+		else if (0 == strcasecmp("-distributed_build", argv[i]))
+		{
+			// ranks share the work of building macrocells
+			distributedBuild = true;
+		}
 		else if (0 == strcasecmp("-conf_file", argv[i]) && i < argc-1)
 		{
 			setConfFile(argv[++i]);
@@ -397,13 +477,16 @@ bool parseCmdLine(int argc, char ** argv)
 			{
 				loadSequence = false;
 			}
-			volumeFile	= fName + ".volume";
-			macrocellsFile	= fName + ".macrocells";
 			tfFile		= fName + ".tf";
 			cameraFile	= fName + ".camera";
 		}
 	}
 	
+	// a multi-frame file is played back like a sequence
+	if (trajectory) {
+		loadSequence = true;
+	}
+	
 	// is there data?
 	if (dataFile.length() == 0) {
 		cerr << "No data file specified!\n";
@@ -411,6 +494,11 @@ bool parseCmdLine(int argc, char ** argv)
 		exit(1);
 	}
 
+	// caches built from a region are kept apart from the whole dataset's
+	// (-roi may come after the data file)
+	volumeFile	= fileName( dataFile ) + loadRegionTag() + ".volume";
+	macrocellsFile	= fileName( dataFile ) + loadRegionTag() + ".macrocells";
+
 	// sanity check
 	if (!loadRaw && buildMacrocells) {
 		cerr << "Need to use '-load_raw' in conjunction with '-build_macrocells'.\n";
@@ -442,7 +530,7 @@ bool parseCmdLine(int argc, char ** argv)
 	
 	#ifdef DO_MPI	
 	if (offlineSequenceRender && !loadSequence) {
-		cerr << "I expect a .seq file listing file names to render in sequence.\n";
+		cerr << "I expect a .seq file listing file names to render in sequence (or a '-trajectory').\n";
 		exit(1);
 	}
 	
@@ -451,6 +539,16 @@ bool parseCmdLine(int argc, char ** argv)
 		cerr << "Please remove '-thin_client' argument and try again.\n";
 		exit(1);
 	}
+	
+	if (distributedBuild)
+	{
+		// every rank has to take part in the same build
+		if (thinClient || loadSequence) {
+			cerr << "Can not use '-distributed_build' with '-thin_client' or sequences.\n";
+			exit(1);
+		}
+		setDistributedBuild(true);
+	}
 	#endif
 	
 	return true;
@@ -504,9 +602,21 @@ void customizeShader()
 	if (skipEmpty)
 		ballsShader.addDefine("#define SKIP_EMPTY\n");
 	
-	if (macrocells && macrocells->getRefMode() == MC_DIRECT)
+	if (skipEmpty && skipBlocks && macrocells)
+	{
+		sprintf(buffer, "#define SKIP_BLOCKS\nconst int BLOCK_SIZE = %d;\n", MC_BLOCK_SIZE);
+		ballsShader.addDefine(buffer);
+	}
+	
+	if (macrocells && macrocells->getRefMode() != MC_INDEXED)
 		ballsShader.addDefine("#define DIRECT_ATOMS_REF\n"); 
 	
+	if (macrocells && macrocells->getRefMode() == MC_DIRECT_COMPACT)
+	{
+		// the range is known once the atoms are staged, so it is set at draw time
+		ballsShader.addDefine("#define COMPACT_ATOMS_REF\n");
+	}
+	
 	if (volume && drawVolume)
 		ballsShader.addDefine("#define VOLUME_RENDER\n");
 	
@@ -525,6 +635,12 @@ void customizeShader()
 		ballsShader.addDefine("#define GEOMETRY_PRECISION 0\n");
 	}
 	
+	// atom radii, from the table the macrocells and CPU traversals use
+	float radii[8];
+	shaderRadii(1.0f, radii);
+	sprintf(buffer, "const float ATOM_RADII[5] = float[5](%f, %f, %f, %f, %f);\n", radii[0], radii[1], radii[2], radii[3], radii[4]);
+	ballsShader.addDefine(buffer);
+	
 	// background color
 	sprintf(buffer, "const vec4 background = vec4(%f, %f, %f, %f);\n", bgColor[0], bgColor[1], bgColor[2], bgColor[3]);
 	ballsShader.addDefine(buffer);
@@ -561,13 +677,17 @@ void customizeShader()
 			sprintf(buffer, "const int atomsSqrt = %d;\n", macrocells->getAtomsSqrt());
 			ballsShader.addDefine(buffer);
 		}
-		else if (macrocells->getRefMode() == MC_DIRECT)
+		else
 		{
+			// direct reference, one entry per index
 			sprintf(buffer, "const int atomsSqrt = %d;\n", macrocells->getIndicesSqrt());
 			ballsShader.addDefine(buffer);
 		}
 	}
 	
+	if (volume && drawVolume && tfSkip)
+		ballsShader.addDefine("#define TF_SKIP\n");
+	
 	if (volume && drawVolume)
 	{
 		sprintf(buffer, "const float maxVolumeValue = %f;\n", volume->getMaxValue());
@@ -633,7 +753,7 @@ void compileShaders()
 
 	// BALLS
 	// ======
-	const int BALLS_UNIFORM = 12;
+	const int BALLS_UNIFORM = 14;
 	const char * balls_uniforms[BALLS_UNIFORM] = 
 	{
 		"origin",			// camera position in world space
@@ -646,8 +766,10 @@ void compileShaders()
 		"tf",				// transfer function texture
 		"dT",				// delta T when stepping through volume
 		"colorScale",			// used to scale opacity of the volume
+		"visible",			// TF visibility of the macrocells
 		"clipBoxMin",
 		"clipBoxMax",
+		"compactRange",			// quantization range of compact atoms
 	};
 
 	// load / re-compile shader
@@ -856,6 +978,36 @@ void density_ray_cast()
 	Shader::unuse();
 }
 
+// Keeps the TF visibility of the macrocells in step with the transfer function,
+// the volume type and the current timestep
+void update_visibility()
+{
+	static const Macrocells * lastMacrocells = NULL;
+	static unsigned int lastTF = 0;
+	static VOLUME_TYPE lastVolType = VOL_FLOAT;
+	
+	if (!macrocells->hasDensityRange())
+	{
+		macrocells->buildDensityRange(*volume);
+		lastMacrocells = NULL;
+	}
+	if (	macrocells == lastMacrocells && macrocells->getVisibleTex() && 
+		tf->getVersion() == lastTF && volume->getVolumeType() == lastVolType
+	) {
+		return;
+	}
+	
+	// uchar volumes are quantized to 1/255 of the density range
+	vector<float> opacity;
+	tf->getOpacityTable(opacity);
+	const float tolerance = volume->getVolumeType() == VOL_UCHAR ? volume->getDensityScale() / 255.0f : 0.0f;
+	macrocells->updateVisibility(opacity, volume->getMaxValue(), tolerance);
+	
+	lastMacrocells = macrocells;
+	lastTF = tf->getVersion();
+	lastVolType = volume->getVolumeType();
+}
+
 void balls_ray_cast(Camera * cam = NULL, const vec2 * win_coordinates = NULL )
 {
 	if (cam == NULL) { 
@@ -873,6 +1025,11 @@ void balls_ray_cast(Camera * cam = NULL, const vec2 * win_coordinates = NULL )
 		volume->upload_GLSL();
 	}
 	
+	if (volume && drawVolume && tfSkip)
+	{
+		update_visibility();
+	}
+	
 	ballsShader.use();
 
 	// vertex attribute
@@ -886,12 +1043,15 @@ void balls_ray_cast(Camera * cam = NULL, const vec2 * win_coordinates = NULL )
 	
 	// textures
 	GLint _macrocells	= ballsShader.getUniform("macrocells");
+	GLint _blocks		= ballsShader.getUniform("blocks");
 	GLint _atoms		= ballsShader.getUniform("atoms");
 	GLint _indices		= ballsShader.getUniform("indices");
 	GLint _volume		= ballsShader.getUniform("volume");
 	GLint _tf		= ballsShader.getUniform("tf");
 	GLint _dT		= ballsShader.getUniform("dT");
 	GLint _colorScale	= ballsShader.getUniform("colorScale");
+	GLint _visible		= ballsShader.getUniform("visible");
+	GLint _compactRange	= ballsShader.getUniform("compactRange");
 	
 	// clipbox
 	GLint _clipBoxMin	= ballsShader.getUniform("clipBoxMin");
@@ -910,6 +1070,15 @@ void balls_ray_cast(Camera * cam = NULL, const vec2 * win_coordinates = NULL )
 	glEnable(GL_TEXTURE_3D);
 	glBindTexture(GL_TEXTURE_3D, macrocells->getMacrocellsTex());
 	glUniform1i(_macrocells, texIndex++);
+	
+	// occupancy blocks
+	if (skipEmpty && skipBlocks)
+	{
+		glActiveTexture(GL_TEXTURE0 + texIndex);
+		glEnable(GL_TEXTURE_3D);
+		glBindTexture(GL_TEXTURE_3D, macrocells->getBlocksTex());
+		glUniform1i(_blocks, texIndex++);
+	}
 
 	// indices
 	if (macrocells->getRefMode() == MC_INDEXED)
@@ -925,13 +1094,18 @@ void balls_ray_cast(Camera * cam = NULL, const vec2 * win_coordinates = NULL )
 		glBindTexture(GL_TEXTURE_2D, macrocells->getAtomsTex());
 		glUniform1i(_atoms, texIndex++);
 	}
-	else if (macrocells->getRefMode() == MC_DIRECT)
+	else
 	{
-		// atoms
+		// atoms (direct or compact)
 		glActiveTexture(GL_TEXTURE0 + texIndex);
 		glEnable(GL_TEXTURE_2D);
 		glBindTexture(GL_TEXTURE_2D, macrocells->getAtomsTex());
 		glUniform1i(_atoms, texIndex++);
+		
+		// of this structure's upload (it differs between timesteps)
+		if (macrocells->getRefMode() == MC_DIRECT_COMPACT) {
+			glUniform1f(_compactRange, macrocells->getCompactRange());
+		}
 	}
 	
 	if (volume && drawVolume)
@@ -953,6 +1127,15 @@ void balls_ray_cast(Camera * cam = NULL, const vec2 * win_coordinates = NULL )
 		
 		// color scale
 		glUniform1f(_colorScale, colorScale);
+		
+		// macrocells with any opacity
+		if (tfSkip)
+		{
+			glActiveTexture(GL_TEXTURE0 + texIndex);
+			glEnable(GL_TEXTURE_3D);
+			glBindTexture(GL_TEXTURE_3D, macrocells->getVisibleTex());
+			glUniform1i(_visible, texIndex++);
+		}
 	}
 	
 	if (clipBox)
@@ -1253,12 +1436,18 @@ void keyPress(char key)
 		
 	case 'i':
 		
+		// direct -> indexed -> compact direct -> direct
 		if (macrocells && macrocells->getRefMode() == MC_DIRECT)
 		{
 			cout << "INDEXED atom reference." << endl;
 			macrocells->changeRefMode(MC_INDEXED);
 		}
 		else if (macrocells && macrocells->getRefMode() == MC_INDEXED)
+		{
+			cout << "Compact direct atom reference." << endl;
+			macrocells->changeRefMode(MC_DIRECT_COMPACT);
+		}
+		else if (macrocells && macrocells->getRefMode() == MC_DIRECT_COMPACT)
 		{
 			cout << "Direct atom reference." << endl;
 			macrocells->changeRefMode(MC_DIRECT);
@@ -1300,8 +1489,16 @@ void keyPress(char key)
 		break;
 	
 	case 's':
-		skipEmpty = ! skipEmpty;
-		cout << "Skip empty space: " << (skipEmpty ? "ON" : "OFF") << endl;
+		if (shiftKey)
+		{
+			skipBlocks = ! skipBlocks;
+			cout << "Skip empty blocks: " << (skipBlocks ? "ON" : "OFF") << endl;
+		}
+		else
+		{
+			skipEmpty = ! skipEmpty;
+			cout << "Skip empty space: " << (skipEmpty ? "ON" : "OFF") << endl;
+		}
 		compileShaders();
 		break;
 		
@@ -1658,7 +1855,6 @@ int main(int argc, char ** argv)
 	#endif
 #endif
 
-	init_atom_data();
 	if (argc < 2)
 	{
 		cerr << "USAGE: " << argv[0] << " data-file\n";
@@ -1781,6 +1977,9 @@ int main(int argc, char ** argv)
 			
 			if (buildMacrocells)
 			{
+				if (voxelsPerAngstrom == MC_AUTO_VPA) {
+					voxelsPerAngstrom = chooseMacrocellVPA(theCube->allAtoms, atomScale, theCube->worldMin, theCube->worldMax);
+				}
 				macrocells = new Macrocells(
 					theCube->allAtoms, 
 					voxelsPerAngstrom, atomScale,
@@ -1815,6 +2014,19 @@ int main(int argc, char ** argv)
 		}
 	}
 	loadTime = loadTimer.getElapsedTimeInSec();
+	
+	if (macrocells)
+	{
+		macrocells->getStats().print(cout);
+		if (statsFile.length() > 0)
+		{
+			ofstream statsOut(statsFile.c_str());
+			macrocells->getStats().write_json(statsOut);
+			if (!statsOut) {
+				cerr << "Could not write " << statsFile << endl;
+			}
+		}
+	}
 
 	// load and compile shaders
 	compileShaders();
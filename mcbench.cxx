@@ -0,0 +1,1114 @@
+/* -----------------------------------------------
+ * Super nanovol
+ * Khairi Reda, 2013
+ * Electronic Visualization Laboratory
+ * www.evl.uic.edu/kreda
+ *
+ * GPL v2 License:
+ * http://www.gnu.org/licenses/gpl-2.0.html
+ * mcbench.cxx
+ *
+ * Offline benchmark for building the acceleration
+ * structures (macrocells, density volume)
+ * -----------------------------------------------
+ */
+
+#include <cfloat>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <algorithm>
+#include <string>
+#include <iostream>
+#include <fstream>
+#include <stdlib.h>
+#ifdef __linux__
+#include <omp.h>
+#endif
+#ifdef DO_MPI
+#include <mpi.h>
+#include <unistd.h>
+#endif
+#include "data.h"
+#include "atoms.h"
+#include "macrocells.h"
+#include "charge_volume.h"
+#include "traversal.h"
+#include "bvh.h"
+#include "Timer.h"
+
+using namespace std;
+string dataFile;
+int repeat = 3;
+bool benchVolume = true;
+int traverseRays = 0;
+bool benchUpdates = false;
+bool sweepVPA = false;
+string statsFile;
+uint64_t roundTripIndices = 0;
+bool benchCompactRef = false;
+bool benchTFSkip = false;
+bool benchStaging = false;
+bool benchRanks = false;
+bool benchAtomBVH = false;
+
+
+// needed by data.o
+float		voxelsPerAngstrom = 1.0f;
+float		chargeVoxelsPerAngstrom = 2.0f;
+float		atomScale = 1.0f;
+bool		loadMacrocells;
+bool		loadVolume;
+bool		buildMacrocells;
+bool		buildVolume;
+bool		loadRaw;
+bool		buildIfNeeded;
+
+
+void parseCmdLine(int argc, char ** argv)
+{
+	for (int i = 1; i < argc; i++)
+	{
+		if (0 == strcasecmp("-vpa", argv[i]) && i < argc-1)
+		{
+			i++;
+			voxelsPerAngstrom = 0 == strcasecmp("auto", argv[i]) ? MC_AUTO_VPA : atof(argv[i]);
+		}
+		else if (0 == strcasecmp("-stats", argv[i]) && i < argc-1)
+		{
+			statsFile = argv[++i];
+		}
+		else if (0 == strcasecmp("-roundtrip", argv[i]) && i < argc-1)
+		{
+			roundTripIndices = strtoull(argv[++i], NULL, 10);
+		}
+		else if (0 == strcasecmp("-tf_skip", argv[i]))
+		{
+			benchTFSkip = true;
+		}
+		else if (0 == strcasecmp("-staging", argv[i]))
+		{
+			benchStaging = true;
+		}
+		else if (0 == strcasecmp("-distributed", argv[i]))
+		{
+#ifdef DO_MPI
+			benchRanks = true;
+#else
+			cerr << "-distributed needs an MPI build (make MPI=1)" << endl;
+			exit(1);
+#endif
+		}
+		else if (0 == strcasecmp("-bvh", argv[i]))
+		{
+			benchAtomBVH = true;
+		}
+		else if (0 == strcasecmp("-compact", argv[i]))
+		{
+			benchCompactRef = true;
+		}
+		else if (0 == strcasecmp("-sweep", argv[i]))
+		{
+			sweepVPA = true;
+		}
+		else if (0 == strcasecmp("-cvpa", argv[i]) && i < argc-1)
+		{
+			chargeVoxelsPerAngstrom = atof(argv[++i]);
+		}
+		else if (0 == strcasecmp("-atom_scale", argv[i]) && i < argc-1)
+		{
+			atomScale = atof(argv[++i]);
+		}
+		else if (0 == strcasecmp("-repeat", argv[i]) && i < argc-1)
+		{
+			repeat = max(1, atoi(argv[++i]));
+		}
+		else if (0 == strcasecmp("-no_volume", argv[i]))
+		{
+			benchVolume = false;
+		}
+		else if (0 == strcasecmp("-traverse", argv[i]) && i < argc-1)
+		{
+			traverseRays = max(1, atoi(argv[++i]));
+		}
+		else if (0 == strcasecmp("-update", argv[i]))
+		{
+			benchUpdates = true;
+		}
+		else if (0 == strcasecmp("-churn_limit", argv[i]) && i < argc-1)
+		{
+			setMacrocellChurnLimit(atof(argv[++i]));
+		}
+		else if (0 == strcasecmp("-update_margin", argv[i]) && i < argc-1)
+		{
+			setMacrocellUpdateMargin(atof(argv[++i]));
+		}
+		else if (0 == strcasecmp("-morton", argv[i]))
+		{
+			setMortonLayout(true);
+		}
+		else if (0 == strcasecmp("-box_overlap", argv[i]))
+		{
+			setExactCellOverlap(false);
+		}
+		else if (argv[i][0] == '-')
+		{
+			cerr << "Unrecognized option " << argv[i] << endl;
+			exit(1);
+		}
+		else
+		{
+			dataFile = argv[i];
+		}
+	}
+
+	if (dataFile.length() == 0 && roundTripIndices == 0) {
+		cerr << "USAGE: " << argv[0] << " <atoms file> [-vpa v|auto] [-sweep] [-stats file.json] [-cvpa v] [-atom_scale s] [-repeat n] [-no_volume] [-box_overlap] [-morton] [-traverse n] [-bvh] [-compact] [-tf_skip] [-staging] [-update [-churn_limit f] [-update_margin a]]" << endl;
+		cerr << "       mpirun -np N " << argv[0] << " <atoms file> -distributed [-vpa v] [-repeat n]" << endl;
+		cerr << "       " << argv[0] << " -roundtrip <indices>" << endl;
+		exit(1);
+	}
+}
+
+// Casts n x n rays at the grid from above and to the side (looking down at the
+// slab), walking every macrocell, skipping empty blocks and leaping with the
+// distance field
+void benchTraversal(const Macrocells & macrocells, int n)
+{
+	const vec3i & dim = macrocells.getGridDim();
+	const vec3f center(dim.x() * .5f, dim.y() * .5f, dim.z() * .5f);
+	const float extent = length(vec3f(dim.x(), dim.y(), dim.z()));
+	
+	const vec3f eye = center + vec3f(.3f, .2f, 1.f) * extent;
+	const vec3f w = normalize(center - eye);
+	const vec3f u = normalize(cross(w, vec3f(0.f, 1.f, 0.f)));
+	const vec3f v = cross(u, w);
+	
+	MacrocellTraversal traversal(macrocells);
+	TraversalStats flat, skip, leap;
+	size_t mismatches = 0;
+	double flatTime = 0.0, skipTime = 0.0, leapTime = 0.0;
+	Timer timer;
+	
+	vector<vec3f> rays(n);
+	for (int j = 0; j < n; j++)
+	{
+		for (int i = 0; i < n; i++)
+		{
+			const vec3f target = center 
+				+ u * ((i + .5f) / n - .5f) * extent
+				+ v * ((j + .5f) / n - .5f) * extent;
+			rays[i] = normalize(target - eye);
+		}
+		
+		vector<float> T(n);
+		timer.start();
+		for (int i = 0; i < n; i++) {
+			T[i] = traversal.trace(eye, rays[i], TRAVERSE_CELLS, flat);
+		}
+		flatTime += timer.getElapsedTimeInSec();
+		
+		timer.start();
+		for (int i = 0; i < n; i++)
+		{
+			if (traversal.trace(eye, rays[i], TRAVERSE_BLOCKS, skip) != T[i]) {
+				mismatches++;
+			}
+		}
+		skipTime += timer.getElapsedTimeInSec();
+		
+		timer.start();
+		for (int i = 0; i < n; i++)
+		{
+			if (traversal.trace(eye, rays[i], TRAVERSE_LEAP, leap) != T[i]) {
+				mismatches++;
+			}
+		}
+		leapTime += timer.getElapsedTimeInSec();
+	}
+	
+	const double r = (double) flat.rays;
+	cout << "traversal:\t" << flat.rays << " rays, " << 100.0 * flat.hits / r << "% hit" << endl;
+	cout << "  all cells:\t" << flat.cellsVisited / r << " cells / ray, " 
+		<< flat.atomsTested / r << " atoms / ray, " << flatTime << " sec" << endl;
+	cout << "  skip blocks:\t" << skip.cellsVisited / r << " cells + " << skip.blocksSkipped / r << " blocks / ray, "
+		<< skip.atomsTested / r << " atoms / ray, " << skipTime << " sec" << endl;
+	cout << "  leap:\t\t" << leap.cellsVisited / r << " cells + " << leap.leaps / r << " leaps / ray, "
+		<< leap.atomsTested / r << " atoms / ray, " << leapTime << " sec" << endl;
+	cout << "  steps / ray:\t" << flat.steps() / r << " all cells, " << skip.steps() / r << " skip blocks, " 
+		<< leap.steps() / r << " leap" << endl;
+	if (mismatches > 0) {
+		cout << "  WARNING: " << mismatches << " rays hit differently" << endl;
+	}
+}
+
+// Treats the data file as a sequence (.seq file or trajectory): every timestep
+// after the first is built from scratch and updated from the previous
+// timestep's macrocells. Returns the number of timesteps patched.
+// Whether two structures have the same cells, indices and atoms, byte for byte
+bool sameStructure(const Macrocells & a, const Macrocells & b)
+{
+	const vec3i & dim = a.getGridDim();
+	const size_t totalCells = (size_t) dim.x() * dim.y() * dim.z();
+	if (	!(dim == b.getGridDim()) ||
+		a.getAtomsCount() != b.getAtomsCount() ||
+		a.getIndicesCount() != b.getIndicesCount()
+	)
+	{
+		return false;
+	}
+	return
+		0 == memcmp(a.getMacrocells().data, b.getMacrocells().data, totalCells * sizeof(Macrocell)) &&
+		0 == memcmp(a.getIndices(), b.getIndices(), a.getIndicesCount() * sizeof(unsigned int)) &&
+		0 == memcmp(a.getGPUAtoms(), b.getGPUAtoms(), a.getAtomsCount() * sizeof(gpuAtom));
+}
+
+// Updates every timestep of a sequence from the previous one, and checks the
+// result against a full build over the same (padded) grid. Returns the number
+// of patched timesteps, or -1 if a structure differed.
+int benchUpdate(const string & sequenceFile)
+{
+	CubeSequence sequence(sequenceFile);
+	if (sequence.getLength() < 2)
+	{
+		cerr << sequenceFile << " is not a sequence with at least two timesteps" << endl;
+		exit(1);
+	}
+	
+	Timer timer;
+	Macrocells * previous = NULL;
+	double fullTotal = 0.0, updateTotal = 0.0;
+	int updates = 0, mismatches = 0;
+	bool checked = false;
+	
+	cout << "\n==== " << sequenceFile << " (" << sequence.getLength() << " timesteps) ====" << endl;
+	do
+	{
+		string filename;
+		const AtomCube & cube = *sequence.getCube(filename);
+		const int f = sequence.getCurrentIndex();
+		
+		if (voxelsPerAngstrom == MC_AUTO_VPA) {
+			voxelsPerAngstrom = chooseMacrocellVPA(cube.allAtoms, atomScale, cube.worldMin, cube.worldMax);
+		}
+		
+		if (!previous)
+		{
+			// the first frame is padded like CubeSequence pads it
+			vec3 gridOrigin;
+			vec3i gridDim;
+			macrocellUpdateGrid(cube.worldMin, cube.worldMax, voxelsPerAngstrom, gridOrigin, gridDim);
+			timer.start();
+			previous = new Macrocells(cube.allAtoms, voxelsPerAngstrom, atomScale, gridOrigin, gridDim, "");
+			cout << "frame " << f << ":	full " << timer.getElapsedTimeInSec() << " sec" << endl;
+			continue;
+		}
+		
+		timer.start();
+		Macrocells * current = new Macrocells(*previous, cube.allAtoms, cube.worldMin, cube.worldMax, "");
+		const double updateTime = timer.getElapsedTimeInSec();
+		
+		timer.start();
+		Macrocells * full = new Macrocells(
+			cube.allAtoms,
+			voxelsPerAngstrom, atomScale,
+			current->getOrigin(), current->getGridDim(), ""
+		);
+		const double fullTime = timer.getElapsedTimeInSec();
+		
+		cout << "frame " << f << ":	full " << fullTime << " sec, update " << updateTime << " sec (" 
+			<< (current->wasUpdated() ? "patched" : "rebuilt") << ", " << fullTime / updateTime << "x)";
+		
+		// a Morton layout keeps the first frame's atom order, which a full
+		// build would sort anew
+		if (!current->isMortonLayout())
+		{
+			checked = true;
+			if (!sameStructure(*current, *full))
+			{
+				cout << ", DIFFERS from a full build";
+				mismatches++;
+			}
+		}
+		cout << endl;
+		delete full;
+		
+		fullTotal += fullTime;
+		updateTotal += updateTime;
+		updates += current->wasUpdated() ? 1 : 0;
+		
+		delete previous;
+		previous = current;
+	} while (sequence.next());
+	delete previous;
+	
+	cout << "total:		full " << fullTotal << " sec, update " << updateTotal << " sec (" 
+		<< updates << " of " << sequence.getLength() - 1 << " frames patched)" << endl;
+	if (!checked)
+	{
+		cout << "identical to full builds: not checked (Morton layout)" << endl;
+		return updates;
+	}
+	cout << "identical to full builds: " << (mismatches == 0 ? "PASSED" : "FAILED") << endl;
+	return mismatches == 0 ? updates : -1;
+}
+
+// Steps through a .seq file or trajectory the way the viewer does (default
+// in-core limit, no prefetch) and checks that CubeSequence patches as many
+// timesteps from their neighbours as benchUpdate did
+bool benchSequence(const string & sequenceFile, int expected)
+{
+	loadMacrocells = false;
+	loadVolume = false;
+	buildMacrocells = true;
+	buildVolume = false;
+	loadRaw = true;
+	buildIfNeeded = false;
+	
+	CubeSequence sequence(sequenceFile);
+	if (sequence.getLength() < 2)
+	{
+		cerr << sequenceFile << " has fewer than two timesteps" << endl;
+		return false;
+	}
+	
+	int updates = 0;
+	cout << "\n==== " << sequenceFile << " through CubeSequence ====" << endl;
+	do
+	{
+		const Timestep * t = sequence.getCurrentTimestep();
+		if (!t->macrocells)
+		{
+			cerr << "No macrocells for timestep " << sequence.getCurrentIndex() << endl;
+			return false;
+		}
+		const string & mode = t->macrocells->getStats().mode;
+		cout << "timestep " << sequence.getCurrentIndex() << ":	" << mode << endl;
+		updates += mode == "update" ? 1 : 0;
+	} while (sequence.next());
+	
+	cout << updates << " of " << sequence.getLength() - 1 << " timesteps updated (" << expected << " patchable)" << endl;
+	if (updates < expected) {
+		cerr << "CubeSequence rebuilt timesteps it could have updated" << endl;
+	}
+	return updates >= expected;
+}
+
+// Round-trips a synthetic structure with n indices through the float encoding
+// of the GPU textures and checks that every cell and index comes back
+bool benchRoundTrip(uint64_t n)
+{
+	static const size_t CELLS = 128 * 128 * 128;
+	static const size_t CHUNK = 1 << 24;
+	
+	cout << "\n==== round trip: " << n << " indices, " << CELLS << " cells ====" << endl;
+	// random cell sizes adding up to n
+	uint64_t seed = 12345;
+	vector<Macrocell> cells(CELLS);
+	uint64_t start = 0;
+	for (size_t c = 0; c < CELLS; c++)
+	{
+		seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+		const uint64_t left = n - start;
+		const uint64_t mean = left / (CELLS - c);
+		const uint64_t count = c == CELLS - 1 ? left : min(left, (seed >> 33) % (2 * mean + 1));
+		cells[c].ballStart = start;
+		cells[c].ballCount = count;
+		start += count;
+	}
+	
+	Timer timer;
+	timer.start();
+	size_t cellErrors = 0, singleFloatStarts = 0;
+	vector<float> encodedCells(3 * CELLS);
+	vector<Macrocell> decodedCells(CELLS);
+	encodeMacrocells(&cells[0], CELLS, &encodedCells[0]);
+	decodeMacrocells(&encodedCells[0], CELLS, &decodedCells[0]);
+	for (size_t c = 0; c < CELLS; c++)
+	{
+		cellErrors += decodedCells[c].ballStart != cells[c].ballStart || decodedCells[c].ballCount != cells[c].ballCount;
+		singleFloatStarts += (uint64_t) (float) cells[c].ballStart != cells[c].ballStart;
+	}
+	
+	// indices over the whole 32-bit range, a chunk at a time
+	size_t indexErrors = 0, singleFloatIndices = 0;
+	vector<unsigned int> indices(CHUNK), decoded(CHUNK);
+	vector<float> encoded(2 * CHUNK);
+	for (uint64_t first = 0; first < n; first += CHUNK)
+	{
+		const size_t count = (size_t) min((uint64_t) CHUNK, n - first);
+		for (size_t i = 0; i < count; i++)
+		{
+			seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+			indices[i] = (unsigned int) (seed >> 32);
+		}
+		encodeIndices(&indices[0], count, &encoded[0]);
+		decodeIndices(&encoded[0], count, &decoded[0]);
+		for (size_t i = 0; i < count; i++)
+		{
+			indexErrors += decoded[i] != indices[i];
+			singleFloatIndices += (unsigned int) (float) indices[i] != indices[i];
+		}
+	}
+	const double time = timer.getElapsedTimeInSec();
+	
+	const uint64_t side = textureSide(n);
+	cout << "index texture:	" << side << " x " << side << " (" << (2 * sizeof(float) * side * side >> 20) << " MB split)" << endl;
+	cout << "cells:		" << cellErrors << " errors (a single float would corrupt " << singleFloatStarts << " starts)" << endl;
+	cout << "indices:	" << indexErrors << " errors (a single float would corrupt " << singleFloatIndices << ")" << endl;
+	cout << "time:		" << time << " sec" << endl;
+	
+	const bool ok = start == n && cellErrors == 0 && indexErrors == 0 && side * side >= n;
+	cout << (ok ? "PASSED" : "FAILED") << endl;
+	return ok;
+}
+
+// Quantizes the direct reference of the given macrocells into compact entries,
+// decodes every entry back and checks it against the quantization error bound
+bool benchCompact(const Macrocells & macrocells)
+{
+	const Grid3<Macrocell> & cells = macrocells.getMacrocells();
+	const unsigned int * indices = macrocells.getIndices();
+	const gpuAtom * atoms = macrocells.getGPUAtoms();
+	const size_t count = macrocells.getIndicesCount();
+	
+	Timer timer;
+	timer.start();
+	const float range = compactAtomRange(cells, indices, atoms);
+	vector<compactAtom> compact(count);
+	if (count > 0) {
+		encodeCompactAtoms(cells, indices, atoms, range, &compact[0]);
+	}
+	const double encodeTime = timer.getElapsedTimeInSec();
+	
+	// allow for the float rounding of positions up to the grid size
+	const vec3i & dim = macrocells.getGridDim();
+	const float bound = compactAtomError(range) + max(dim.x(), max(dim.y(), dim.z())) * FLT_EPSILON;
+	float maxError[3] = {0.0f, 0.0f, 0.0f};
+	size_t indexErrors = 0;
+	for (int m = 0; m < cells.d3; m++)
+		for (int l = 0; l < cells.d2; l++)
+			for (int k = 0; k < cells.d1; k++)
+			{
+				const Macrocell & mc = cells.get_data(k, l, m);
+				for (uint64_t b = mc.ballStart; b < mc.ballStart + mc.ballCount; b++)
+				{
+					const gpuAtom & a = atoms[ indices[b] ];
+					const gpuAtom d = decodeCompactAtom(compact[b], k, l, m, range);
+					maxError[0] = max(maxError[0], fabs(d.x - a.x));
+					maxError[1] = max(maxError[1], fabs(d.y - a.y));
+					maxError[2] = max(maxError[2], fabs(d.z - a.z));
+					indexErrors += d.index != a.index;
+				}
+			}
+	
+	const MacrocellStats & stats = macrocells.getStats();
+	const double MB = 1024.0 * 1024.0;
+	const double angstromsPerCell = 1.0 / macrocells.getVPA();
+	cout << "\n==== " << dataFile << ": compact direct reference ====" << endl;
+	cout << "entries:\t" << count << " (" << sizeof(gpuAtom) << " -> " << sizeof(compactAtom) << " bytes)" << endl;
+	cout << "range:\t\t" << range << " cells beyond the macrocell" << endl;
+	cout << "max error:\t" << maxError[0] << ", " << maxError[1] << ", " << maxError[2] 
+		<< " cells (bound " << bound << ", " << bound * angstromsPerCell << " A)" << endl;
+	cout << "element ids:\t" << indexErrors << " errors" << endl;
+	cout << "GPU memory:\t" << stats.directRefBytes / MB << " MB direct, " << stats.compactRefBytes / MB 
+		<< " MB compact (saves " << (stats.directRefBytes - stats.compactRefBytes) / MB << " MB)" << endl;
+	cout << "encode:\t\t" << encodeTime << " sec" << endl;
+	
+	const bool ok = indexErrors == 0 && maxError[0] <= bound && maxError[1] <= bound && maxError[2] <= bound;
+	cout << (ok ? "PASSED" : "FAILED") << endl;
+	return ok;
+}
+
+// CPU side of the GPU upload for every reference mode, against the serial
+// loops it replaced (allocation, cell encoding, one copy / conversion per index)
+void benchUploadStaging(Macrocells & macrocells)
+{
+	static const MC_REF_MODE MODES[3] = {MC_DIRECT, MC_INDEXED, MC_DIRECT_COMPACT};
+	static const char * NAMES[3] = {"direct", "indexed", "compact"};
+	
+	const size_t totalCells = (size_t) macrocells.getGridDim().x() * macrocells.getGridDim().y() * macrocells.getGridDim().z();
+	const uint64_t count = macrocells.getIndicesCount();
+	const unsigned int * indices = macrocells.getIndices();
+	const gpuAtom * atoms = macrocells.getGPUAtoms();
+	const Macrocell * cells = macrocells.getMacrocells().data;
+	
+	cout << "\n==== " << dataFile << ": upload staging (" << count << " indices) ====" << endl;
+	
+	Timer timer;
+	double serialCells = DBL_MAX, serialDirect = DBL_MAX, serialIndexed = DBL_MAX;
+	for (int r = 0; r < repeat; r++)
+	{
+		timer.start();
+		float * textureMem = new float[3 * totalCells];
+		for (size_t c = 0; c < totalCells; c++)
+		{
+			textureMem[3*c + 0] = (float) (cells[c].ballStart % MC_FLOAT_SPLIT);
+			textureMem[3*c + 1] = (float) (cells[c].ballStart / MC_FLOAT_SPLIT);
+			textureMem[3*c + 2] = (float) cells[c].ballCount;
+		}
+		serialCells = min(serialCells, timer.getElapsedTimeInSec());
+		delete [] textureMem;
+		
+		timer.start();
+		gpuAtom * direct = new gpuAtom[count];
+		for (uint64_t i = 0; i < count; i++) {
+			memcpy(direct + i, atoms + indices[i], sizeof(gpuAtom));
+		}
+		serialDirect = min(serialDirect, timer.getElapsedTimeInSec());
+		delete [] direct;
+		
+		timer.start();
+		float * split = new float[2 * count];
+		for (uint64_t i = 0; i < count; i++)
+		{
+			split[2*i + 0] = (float) (indices[i] % MC_FLOAT_SPLIT);
+			split[2*i + 1] = (float) (indices[i] / MC_FLOAT_SPLIT);
+		}
+		serialIndexed = min(serialIndexed, timer.getElapsedTimeInSec());
+		delete [] split;
+	}
+	const double serial[3] = {serialCells + serialDirect, serialCells + serialIndexed, 0.0};
+	
+	for (int m = 0; m < 3; m++)
+	{
+		double staging = DBL_MAX;
+		for (int r = 0; r < repeat; r++)
+		{
+			macrocells.stage_GLSL(MODES[m]);
+			staging = min(staging, macrocells.getStats().stagingTime);
+			macrocells.release_staging();
+		}
+		cout << NAMES[m] << ":\t" << staging << " sec";
+		if (serial[m] > 0.0) {
+			cout << " (serial loops " << serial[m] << " sec, " << serial[m] / staging << "x)";
+		}
+		cout << endl;
+	}
+}
+
+// trilinear density at p (grid space), as the shader samples the volume texture
+static float sample_volume(const ChargeDensityVolume & volume, const vec3f & p)
+{
+	const Grid3<float> & voxels = volume.getVolume();
+	const vec3i & dim = volume.getGridDim();
+	const vec3 & extent = volume.getVolumeGSExtent();
+	
+	int i0[3], i1[3];
+	float f[3];
+	for (int a = 0; a < 3; a++)
+	{
+		const float v = p[a] * dim[a] / extent[a] - 0.5f;
+		const float fl = floor(v);
+		f[a] = v - fl;
+		i0[a] = max(0, min(dim[a] - 1, (int) fl));
+		i1[a] = max(0, min(dim[a] - 1, (int) fl + 1));
+	}
+	float value = 0.0f;
+	for (int c = 0; c < 8; c++)
+	{
+		const float w = (c & 1 ? f[0] : 1.0f - f[0]) * (c & 2 ? f[1] : 1.0f - f[1]) * (c & 4 ? f[2] : 1.0f - f[2]);
+		value += w * voxels.get_data(c & 1 ? i1[0] : i0[0], c & 2 ? i1[1] : i0[1], c & 4 ? i1[2] : i0[2]);
+	}
+	return value;
+}
+
+// Computes the macrocell density ranges, then the visibility of the cells under
+// transfer functions that are transparent below a threshold. Random samples in
+// cells marked invisible must all fall on transparent TF bins.
+bool benchVisibility(Macrocells & macrocells, const ChargeDensityVolume & volume)
+{
+	static const int TF_BINS = 1024;
+	static const int SAMPLES = 1 << 20;
+	static const float THRESHOLDS[] = {0.02f, 0.05f, 0.1f, 0.25f, 0.5f};
+	
+	cout << "\n==== " << dataFile << ": transfer function visibility ====" << endl;
+	macrocells.buildDensityRange(volume);
+	Timer timer;
+	
+	const vec3i & dim = macrocells.getGridDim();
+	const size_t totalCells = (size_t) dim.x() * dim.y() * dim.z();
+	const float maxValue = volume.getMaxValue();
+	bool ok = true;
+	
+	for (size_t t = 0; t < sizeof(THRESHOLDS) / sizeof(float); t++)
+	{
+		vector<float> opacity(TF_BINS);
+		for (int b = 0; b < TF_BINS; b++)
+		{
+			const float v = (b + 0.5f) / TF_BINS;
+			opacity[b] = v < THRESHOLDS[t] ? 0.0f : v;
+		}
+		
+		double updateTime = DBL_MAX;
+		size_t visibleCells = 0;
+		for (int r = 0; r < 5; r++)
+		{
+			timer.start();
+			visibleCells = macrocells.updateVisibility(opacity, maxValue);
+			updateTime = min(updateTime, timer.getElapsedTimeInSec());
+		}
+		
+		// samples the TF shows in cells marked invisible
+		uint64_t seed = 4242 + t;
+		size_t missed = 0, skipped = 0;
+		const Grid3<unsigned char> & visible = macrocells.getVisible();
+		for (int s = 0; s < SAMPLES; s++)
+		{
+			vec3f p;
+			for (int a = 0; a < 3; a++)
+			{
+				seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+				p[a] = (seed >> 40) / float(1 << 24) * dim[a];
+			}
+			const int k = min(dim.x() - 1, (int) p.x()), l = min(dim.y() - 1, (int) p.y()), m = min(dim.z() - 1, (int) p.z());
+			if (visible.get_data(k, l, m)) {
+				continue;
+			}
+			skipped++;
+			const int bin = max(0, min(TF_BINS - 1, (int) floor(sample_volume(volume, p) / maxValue * TF_BINS)));
+			missed += opacity[bin] > 0.0f ? 1 : 0;
+		}
+		
+		cout << "threshold " << THRESHOLDS[t] << ":\t" << 100.0 * visibleCells / totalCells << "% of cells visible, "
+			<< updateTime * 1000.0 << " ms, " << skipped << " of " << SAMPLES << " samples skipped, " 
+			<< missed << " wrongly" << endl;
+		ok = ok && missed == 0;
+	}
+	cout << (ok ? "PASSED" : "FAILED") << endl;
+	return ok;
+}
+
+// rays checked against testing every atom
+static const size_t BVH_CHECK_RAYS = 256;
+
+// Builds an AtomBVH over the same atoms and compares it with the macrocells
+// (leaping with the distance field) on the cost model's probe rays: build
+// time, memory, and steps and atoms tested per ray. The BVH's hits are checked
+// against brute force on a few rays.
+bool benchBVH(const AtomCube & cube, const Macrocells & macrocells, double mcTime)
+{
+	Timer timer;
+	double bvhTime = DBL_MAX;
+	AtomBVH * bvh = NULL;
+	for (int r = 0; r < repeat; r++)
+	{
+		delete bvh;
+		timer.start();
+		bvh = new AtomBVH(cube.allAtoms, cube.worldMin, macrocells.getVPA(), macrocells.getAtomScale());
+		bvhTime = min(bvhTime, timer.getElapsedTimeInSec());
+	}
+	
+	vector<vec3f> origins, directions;
+	macrocellProbeRays(macrocells.getGridDim(), traverseRays > 0 ? traverseRays : 32, origins, directions);
+	const size_t rays = origins.size();
+	
+	MacrocellTraversal traversal(macrocells);
+	TraversalStats mcStats, bvhStats;
+	vector<float> mcT(rays), bvhT(rays);
+	
+	// the closest hit, like the BVH (the shader's early exit would return
+	// hits past the exit of the first macrocell with one)
+	timer.start();
+	for (size_t r = 0; r < rays; r++) {
+		mcT[r] = traversal.trace(origins[r], directions[r], TRAVERSE_LEAP, mcStats, true);
+	}
+	const double mcTrace = timer.getElapsedTimeInSec();
+	
+	timer.start();
+	for (size_t r = 0; r < rays; r++) {
+		bvhT[r] = bvh->trace(origins[r], directions[r], bvhStats);
+	}
+	const double bvhTrace = timer.getElapsedTimeInSec();
+	
+	// brute force with the same test (every ray hits the same atoms in the same order)
+	float radius2[8];
+	shaderRadii2(macrocells.getAtomScale() * macrocells.getVPA(), radius2);
+	const vector<gpuAtom> & atoms = bvh->getAtoms();
+	size_t wrong = 0, checked = 0, differs = 0;
+	for (size_t r = 0; r < rays; r += max((size_t) 1, rays / BVH_CHECK_RAYS), checked++)
+	{
+		float T = TRAVERSAL_MISS;
+		for (size_t i = 0; i < atoms.size(); i++) {
+			intersectSphere(atoms[i], radius2[ int(atoms[i].index) ], origins[r], directions[r], T);
+		}
+		if (T != bvhT[r]) {
+			wrong++;
+		}
+	}
+	for (size_t r = 0; r < rays; r++)
+	{
+		if (fabs(mcT[r] - bvhT[r]) > 1e-4f * max(1.0f, fabs(bvhT[r]))) {
+			differs++;
+		}
+	}
+	
+	const MacrocellStats & s = macrocells.getStats();
+	const uint64_t mcBytes = s.macrocellBytes + s.indexBytes + s.atomBytes + s.blockBytes + s.distanceBytes;
+	const BVHStats & b = bvh->getStats();
+	const double MB = 1024.0 * 1024.0;
+	const double n = (double) rays;
+	
+	cout << "\n==== " << dataFile << ": BVH vs macrocells (" << rays << " probe rays, " << 100.0 * bvhStats.hits / n << "% hit) ====" << endl;
+	cout << "              build s       MB   steps/ray  atoms/ray   trace s" << endl;
+	char row[256];
+	snprintf(row, sizeof(row), "macrocells  %9.3f %8.1f %11.1f %10.1f %9.3f", mcTime, mcBytes / MB, mcStats.steps() / n, mcStats.atomsTested / n, mcTrace);
+	cout << row << endl;
+	snprintf(row, sizeof(row), "bvh         %9.3f %8.1f %11.1f %10.1f %9.3f", bvhTime, b.bytes / MB, bvhStats.nodesVisited / n, bvhStats.atomsTested / n, bvhTrace);
+	cout << row << endl;
+	cout << "macrocells: grid " << s.gridDim[0] << " x " << s.gridDim[1] << " x " << s.gridDim[2] << ", max density " << s.maxDensity
+		<< ", steps = cells + leaps" << endl;
+	cout << "bvh: " << b.nodes << " nodes, " << b.leafAtoms << " atoms / leaf, depth " << b.depth << ", steps = nodes" << endl;
+	cout << "bvh against macrocells, closest hit (" << rays << " rays): " << (differs == 0 ? "PASSED" : "FAILED");
+	if (differs > 0) {
+		cout << " (differs on " << differs << " rays)";
+	}
+	cout << endl;
+	cout << "bvh against brute force (" << checked << " rays): " << (wrong == 0 ? "PASSED" : "FAILED") << endl;
+	
+	delete bvh;
+	return wrong == 0 && differs == 0;
+}
+
+#ifdef DO_MPI
+static uint64_t hash_bytes(uint64_t h, const void * data, size_t n)
+{
+	// FNV-1a
+	const unsigned char * p = (const unsigned char *) data;
+	for (size_t i = 0; i < n; i++) {
+		h = (h ^ p[i]) * 1099511628211ULL;
+	}
+	return h;
+}
+
+// cells, indices, atoms and the distance field
+static uint64_t structure_hash(const Macrocells & m)
+{
+	const vec3i & dim = m.getGridDim();
+	const size_t totalCells = (size_t) dim.x() * dim.y() * dim.z();
+	uint64_t h = 14695981039346656037ULL;
+	h = hash_bytes(h, m.getMacrocells().data, totalCells * sizeof(Macrocell));
+	h = hash_bytes(h, m.getIndices(), m.getIndicesCount() * sizeof(unsigned int));
+	h = hash_bytes(h, m.getGPUAtoms(), m.getAtomsCount() * sizeof(gpuAtom));
+	h = hash_bytes(h, m.getDistances().data, totalCells);
+	return h;
+}
+
+// waits for the other ranks without spinning a core (MPI_Barrier busy-polls
+// in most implementations, taking cores from the ranks that work)
+static void idle_barrier()
+{
+	MPI_Request request;
+	MPI_Ibarrier(MPI_COMM_WORLD, &request);
+	int done = 0;
+	while (MPI_Test(&request, &done, MPI_STATUS_IGNORE), !done) {
+		usleep(1000);
+	}
+}
+
+// Builds the macrocells on rank 0 alone, then split across all ranks, and
+// checks that every rank ends up with what the single rank built. Run through
+// mpirun -np N; times are the slowest rank's, best of repeat. The cores of a
+// node are divided among its ranks, and the single-rank build gets all the
+// cores the ranks on rank 0's node share, so both use the same cores.
+bool benchDistributed(const AtomCube & cube)
+{
+	int rank = 0, ranks = 1, nodeRanks = 1;
+	MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+	MPI_Comm_size(MPI_COMM_WORLD, &ranks);
+	
+	MPI_Comm node;
+	MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, rank, MPI_INFO_NULL, &node);
+	MPI_Comm_size(node, &nodeRanks);
+	MPI_Comm_free(&node);
+	
+	int cores = 1;
+#ifdef __linux__
+	cores = omp_get_num_procs();
+#endif
+	const int rankThreads = max(1, cores / nodeRanks);
+	const int singleThreads = rankThreads * nodeRanks;
+	Timer timer;
+	
+	// the others wait, so that rank 0 has its node's cores to itself
+	double singleTime = DBL_MAX;
+	uint64_t singleHash = 0;
+	setDistributedBuild(false);
+	if (rank == 0)
+	{
+#ifdef __linux__
+		omp_set_num_threads(singleThreads);
+#endif
+		for (int r = 0; r < repeat; r++)
+		{
+			timer.start();
+			Macrocells single(cube.allAtoms, voxelsPerAngstrom, atomScale, cube.worldMin, cube.worldMax, "");
+			singleTime = min(singleTime, timer.getElapsedTimeInSec());
+			singleHash = structure_hash(single);
+		}
+	}
+	idle_barrier();
+	
+#ifdef __linux__
+	omp_set_num_threads(rankThreads);
+#endif
+	setDistributedBuild(true);
+	double splitTime = DBL_MAX;
+	Macrocells * split = NULL;
+	for (int r = 0; r < repeat; r++)
+	{
+		delete split;
+		MPI_Barrier(MPI_COMM_WORLD);
+		timer.start();
+		split = new Macrocells(cube.allAtoms, voxelsPerAngstrom, atomScale, cube.worldMin, cube.worldMax, "");
+		double t = timer.getElapsedTimeInSec();
+		MPI_Allreduce(MPI_IN_PLACE, &t, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+		splitTime = min(splitTime, t);
+	}
+	setDistributedBuild(false);
+	
+	unsigned long long hash = structure_hash(*split);
+	vector<unsigned long long> hashes(ranks);
+	MPI_Gather(&hash, 1, MPI_UNSIGNED_LONG_LONG, &hashes[0], 1, MPI_UNSIGNED_LONG_LONG, 0, MPI_COMM_WORLD);
+	
+	int ok = 1;
+	if (rank == 0)
+	{
+		for (int r = 0; r < ranks; r++)
+		{
+			if (hashes[r] != singleHash)
+			{
+				cerr << "rank " << r << " built a different structure" << endl;
+				ok = 0;
+			}
+		}
+		
+		const MacrocellStats & stats = split->getStats();
+		cout << "\n==== " << dataFile << ": distributed build ====" << endl;
+		cout << "atoms:\t\t" << cube.allAtoms.size() << ", indices " << split->getIndicesCount() << " (vpa " << voxelsPerAngstrom << ")" << endl;
+		cout << "1 rank:\t\t" << singleTime << " sec (" << singleThreads << " threads)" << endl;
+		cout << ranks << " ranks:\t" << splitTime << " sec (" << rankThreads << " threads each; rank 0: count " << stats.countTime << ", prefix sum " << stats.prefixTime
+			<< ", scatter " << stats.scatterTime << ", combine " << stats.combineTime << ", blocks " << stats.blocksTime
+			<< ", distances " << stats.distancesTime << ")" << endl;
+		cout << "speedup:\t" << singleTime / splitTime << "x";
+		if (ranks > nodeRanks) {
+			cout << " (the single rank only had one node's cores)";
+		}
+		if (nodeRanks > cores) {
+			cout << " (more ranks than the node's " << cores << " cores: they time-share)";
+		}
+		cout << endl;
+		cout << "identical on all ranks: " << (ok ? "PASSED" : "FAILED") << endl;
+	}
+	delete split;
+	
+	MPI_Bcast(&ok, 1, MPI_INT, 0, MPI_COMM_WORLD);
+	return ok != 0;
+}
+#endif
+
+// resolutions predicted to need more are not built by the sweep
+static const double SWEEP_MAX_BYTES = 4096.0 * 1024.0 * 1024.0;
+
+// Builds macrocells over a range of resolutions and compares the cost model's
+// predictions with the built structures and traced probe rays
+void benchSweep(const AtomCube & cube)
+{
+	MacrocellCost chosen;
+	chooseMacrocellVPA(cube.allAtoms, atomScale, cube.worldMin, cube.worldMax, &chosen);
+	
+	vector<float> vpas;
+	for (float vpa = 0.25f; vpa <= 2.01f; vpa *= sqrt(2.0f)) {
+		vpas.push_back(vpa);
+	}
+	vpas.push_back(chosen.vpa);
+	sort(vpas.begin(), vpas.end());
+	
+	vector<string> rows;
+	Timer timer;
+	for (size_t v = 0; v < vpas.size(); v++)
+	{
+		const float vpa = vpas[v];
+		const MacrocellCost p = predictMacrocellCost(cube.allAtoms, vpa, atomScale, cube.worldMin, cube.worldMax);
+		if (p.bytes > SWEEP_MAX_BYTES)
+		{
+			cout << "vpa " << vpa << " skipped (" << p.bytes / (1024.0 * 1024.0) << " MB predicted)" << endl;
+			continue;
+		}
+		
+		timer.start();
+		Macrocells macrocells(cube.allAtoms, vpa, atomScale, cube.worldMin, cube.worldMax, "");
+		const double buildTime = timer.getElapsedTimeInSec();
+		
+		const vec3i & dim = macrocells.getGridDim();
+		const size_t totalCells = (size_t) dim.x() * dim.y() * dim.z();
+		const Macrocell * cells = macrocells.getMacrocells().data;
+		size_t indices = 0, occupied = 0;
+		for (size_t c = 0; c < totalCells; c++)
+		{
+			indices += cells[c].ballCount;
+			occupied += cells[c].ballCount > 0 ? 1 : 0;
+		}
+		
+		// the same rays the model marched
+		vector<vec3f> origins, directions;
+		macrocellProbeRays(dim, traverseRays > 0 ? traverseRays : 32, origins, directions);
+		MacrocellTraversal traversal(macrocells);
+		TraversalStats stats;
+		timer.start();
+		for (size_t r = 0; r < origins.size(); r++) {
+			traversal.trace(origins[r], directions[r], TRAVERSE_BLOCKS, stats);
+		}
+		const double traceTime = timer.getElapsedTimeInSec();
+		const double rays = (double) stats.rays;
+		
+		char row[512];
+		snprintf(row, sizeof(row), "%5.3f%s %5dx%4dx%4d %11.0f %11zu %7.1f %7.1f %7.1f %7.1f %8.1f %8.1f %8.0f %7.3f %7.3f",
+			vpa, vpa == chosen.vpa ? "*" : " ", dim.x(), dim.y(), dim.z(),
+			p.indicesCount, indices,
+			p.atomsPerCell, occupied > 0 ? double(indices) / occupied : 0.0,
+			p.cellsPerRay, (stats.cellsVisited + stats.blocksSkipped) / rays,
+			p.atomsPerRay, stats.atomsTested / rays,
+			p.bytes / (1024.0 * 1024.0), buildTime, traceTime
+		);
+		rows.push_back(row);
+	}
+	
+	cout << "\n==== " << dataFile << ": resolution sweep (* = auto) ====" << endl;
+	cout << "  vpa          grid   indices:pred      actual  atoms/cell:pred actual  cells/ray:pred actual  atoms/ray:pred actual  MB:pred  build s trace s" << endl;
+	for (size_t r = 0; r < rows.size(); r++) {
+		cout << rows[r] << endl;
+	}
+}
+
+int main(int argc, char ** argv)
+{
+	parseCmdLine(argc, argv);
+#ifdef DO_MPI
+	if (benchRanks && MPI_SUCCESS != MPI_Init(&argc, &argv))
+	{
+		cerr << "Could not initialize MPI." << endl;
+		exit(1);
+	}
+#endif
+	
+	if (roundTripIndices > 0) {
+		return benchRoundTrip(roundTripIndices) ? 0 : 1;
+	}
+	
+	if (benchUpdates)
+	{
+		const int patched = benchUpdate(dataFile);
+		if (patched < 0) {
+			return 1;
+		}
+		return benchSequence(dataFile, patched) ? 0 : 1;
+	}
+
+	Timer timer;
+	AtomCube cube;
+
+	timer.start();
+	if (!cube.load_file( dataFile.c_str() ))
+	{
+		cerr << "Could not read " << dataFile << endl;
+		exit(1);
+	}
+	const double loadTime = timer.getElapsedTimeInSec();
+	
+	if (sweepVPA)
+	{
+		benchSweep(cube);
+		return 0;
+	}
+	if (voxelsPerAngstrom == MC_AUTO_VPA) {
+		voxelsPerAngstrom = chooseMacrocellVPA(cube.allAtoms, atomScale, cube.worldMin, cube.worldMax);
+	}
+#ifdef DO_MPI
+	if (benchRanks)
+	{
+		const bool ok = benchDistributed(cube);
+		MPI_Finalize();
+		return ok ? 0 : 1;
+	}
+#endif
+
+	// best of N builds
+	double mcTime = DBL_MAX, volumeTime = DBL_MAX;
+	Macrocells * lastMacrocells = NULL;
+	bool visibilityOK = true;
+	for (int r = 0; r < repeat; r++)
+	{
+		timer.start();
+		Macrocells * macrocells = new Macrocells(
+			cube.allAtoms,
+			voxelsPerAngstrom, atomScale,
+			cube.worldMin, cube.worldMax, ""
+		);
+		mcTime = min(mcTime, timer.getElapsedTimeInSec());
+
+		if (benchVolume)
+		{
+			timer.start();
+			ChargeDensityVolume * volume = new ChargeDensityVolume(
+				cube.allAtoms,
+				cube.worldMin,
+				macrocells->getVPA(),
+				chargeVoxelsPerAngstrom,
+				macrocells->getGridDim(),
+				""
+			);
+			volumeTime = min(volumeTime, timer.getElapsedTimeInSec());
+			if (benchTFSkip && r == repeat - 1) {
+				visibilityOK = benchVisibility(*macrocells, *volume);
+			}
+			delete volume;
+		}
+		// keep the last one for statistics and the traversal benchmark
+		if (r == repeat - 1) {
+			lastMacrocells = macrocells;
+		}
+		else {
+			delete macrocells;
+		}
+	}
+
+	cout << "\n==== " << dataFile << " ====" << endl;
+	cout << "atoms:\t\t" << cube.allAtoms.size() << " (" << 4 * sizeof(float) + sizeof(unsigned char) << " bytes / atom";
+	if (cube.allAtoms.isWrapped()) {
+		cout << ", mapped";
+	}
+	cout << ")" << endl;
+	cout << "load:\t\t" << loadTime << " sec" << endl;
+	cout << "macrocells:\t" << mcTime << " sec (vpa " << voxelsPerAngstrom << ", best of " << repeat << ")" << endl;
+	if (benchVolume) {
+		cout << "volume:\t\t" << volumeTime << " sec (cvpa " << chargeVoxelsPerAngstrom << ", best of " << repeat << ")" << endl;
+	}
+	
+	const MacrocellStats & stats = lastMacrocells->getStats();
+	cout << endl;
+	stats.print(cout);
+	if (statsFile.length() > 0)
+	{
+		ofstream statsOut(statsFile.c_str());
+		stats.write_json(statsOut);
+		if (!statsOut)
+		{
+			cerr << "Could not write " << statsFile << endl;
+			exit(1);
+		}
+	}
+	
+	if (traverseRays > 0) {
+		benchTraversal(*lastMacrocells, traverseRays);
+	}
+	const bool bvhOK = !benchAtomBVH || benchBVH(cube, *lastMacrocells, mcTime);
+	const bool compactOK = !benchCompactRef || benchCompact(*lastMacrocells);
+	if (benchStaging) {
+		benchUploadStaging(*lastMacrocells);
+	}
+	delete lastMacrocells;
+
+	return compactOK && visibilityOK && bvhOK ? 0 : 1;
+}
@@ -0,0 +1,136 @@
+/* -----------------------------------------------
+ * Super nanovol
+ * Khairi Reda, 2013
+ * Electronic Visualization Laboratory
+ * www.evl.uic.edu/kreda
+ *
+ * GPL v2 License:
+ * http://www.gnu.org/licenses/gpl-2.0.html
+ * mcbuild.cxx
+ *
+ * Builds the .macrocells file of a binary atoms
+ * file within a memory budget (out of core), or
+ * in core for comparison. Reports the peak
+ * resident memory of the build.
+ * -----------------------------------------------
+ */
+
+#include <string>
+#include <iostream>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include "data.h"
+#include "atoms.h"
+#include "macrocells.h"
+#include "Timer.h"
+#include "graphics/misc.h"
+
+using namespace std;
+string inputFile, outputFile;
+uint64_t memoryBudget = (uint64_t) 1024 << 20;
+bool inCore = false;
+
+
+// needed by data.o
+float		voxelsPerAngstrom = 1.0f;
+float		chargeVoxelsPerAngstrom = 2.0f;
+float		atomScale = 1.0f;
+bool		loadMacrocells;
+bool		loadVolume;
+bool		buildMacrocells;
+bool		buildVolume;
+bool		loadRaw;
+bool		buildIfNeeded;
+
+
+void parseCmdLine(int argc, char ** argv)
+{
+	for (int i = 1; i < argc; i++)
+	{
+		if (0 == strcasecmp("-o", argv[i]) && i < argc-1)
+		{
+			outputFile = argv[++i];
+		}
+		else if (0 == strcasecmp("-vpa", argv[i]) && i < argc-1)
+		{
+			voxelsPerAngstrom = atof(argv[++i]);
+		}
+		else if (0 == strcasecmp("-atom_scale", argv[i]) && i < argc-1)
+		{
+			atomScale = atof(argv[++i]);
+		}
+		else if (0 == strcasecmp("-memory", argv[i]) && i < argc-1)
+		{
+			// MB
+			memoryBudget = (uint64_t) max(1.0, atof(argv[++i])) * (1 << 20);
+		}
+		else if (0 == strcasecmp("-in_core", argv[i]))
+		{
+			inCore = true;
+		}
+		else if (0 == strcasecmp("-box_overlap", argv[i]))
+		{
+			setExactCellOverlap(false);
+		}
+		else if (argv[i][0] == '-')
+		{
+			cerr << "Unrecognized option " << argv[i] << endl;
+			exit(1);
+		}
+		else
+		{
+			inputFile = argv[i];
+		}
+	}
+
+	if (inputFile.length() == 0 || voxelsPerAngstrom <= 0.0f) {
+		cerr << "USAGE: " << argv[0] << " <file.atoms> [-vpa v] [-atom_scale s] [-box_overlap] [-memory MB | -in_core] [-o output.macrocells]" << endl;
+		exit(1);
+	}
+
+	if (outputFile.length() == 0) {
+		outputFile = fileName(inputFile) + ".macrocells";
+	}
+}
+
+// high water mark of the resident set, in bytes
+uint64_t peakResidentBytes()
+{
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+	return usage.ru_maxrss;
+#else
+	return (uint64_t) usage.ru_maxrss * 1024;
+#endif
+}
+
+int main(int argc, char ** argv)
+{
+	parseCmdLine(argc, argv);
+
+	Timer timer;
+	timer.start();
+	bool ok = true;
+	if (inCore)
+	{
+		AtomCube cube;
+		if (!cube.load_file( inputFile.c_str() ))
+		{
+			cerr << "Could not read " << inputFile << endl;
+			exit(1);
+		}
+		Macrocells macrocells(cube.allAtoms, voxelsPerAngstrom, atomScale, cube.worldMin, cube.worldMax, outputFile);
+	}
+	else {
+		ok = buildMacrocellsOutOfCore(inputFile, voxelsPerAngstrom, atomScale, outputFile, memoryBudget);
+	}
+
+	cout << (inCore ? "in core" : "out of core") << ": " << timer.getElapsedTimeInSec() << " sec, peak RSS "
+		<< peakResidentBytes() / (1024.0 * 1024.0) << " MB";
+	if (!inCore) {
+		cout << " (budget " << (memoryBudget >> 20) << " MB)";
+	}
+	cout << endl;
+	return ok ? 0 : 1;
+}
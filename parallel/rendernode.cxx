@@ -162,7 +162,7 @@ void GLWindow::dumpFrame(string IMAGE_FORMAT)
 	}
 	
 	assert(cubeSequence);
-	string basename = fileName(cubeSequence->getCurrentTimestep()->dataFile);
+	string basename = cubeSequence->getCurrentTimestep()->baseName();
 	string framename;
 	
 	switch (stereoMode)
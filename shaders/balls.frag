@@ -9,6 +9,8 @@
  * int atomsSqrt:			square root of number of atoms (ceiled)
  * int indicesSqrt:			square root of number of indices (ceiled)
  * vec4 background:			background color
+ * float ATOM_RADII[5]:			Van der Waals radius by shader index (from
+ *					ELEMENT_TABLE, the radii the macrocells are built with)
  *
  * Additional consts when VOLUME_RENDER
  * float voxelScale			scale of charge density volume voxel relative 
@@ -24,6 +26,13 @@
  * PRECISE_GEOMETRY			whether we are doing precise geom 
  *					by not exiting too early
  * GEOMETRY_PRECISION			precision level (starts from 0)
+ * SKIP_BLOCKS				step over empty blocks of BLOCK_SIZE^3 macrocells
+ *					(along with SKIP_EMPTY)
+ * COMPACT_ATOMS_REF			direct reference entries are quantized relative
+ *					to their macrocell (along with DIRECT_ATOMS_REF;
+ *					uniform float compactRange)
+ * TF_SKIP				no volume samples in macrocells the transfer
+ *					function maps to zero opacity (along with VOLUME_RENDER)
  * ------------------------------------------------------------------------------
  */
 
@@ -33,14 +42,14 @@ const vec3 	LIGHT 			= vec3(-0.7, 0.0, -0.7);
 const float	SPECULAR_EXPONENT	= 20.0;
 const vec3	SPECULAR_COLOR		= vec3(.9);
 
-// atom type data ( vec3(color), Van der Waals radius )
-const vec4 ATOM_DATA[5] = vec4[5]
+// atom type colors (Van der Waals radii are in ATOM_RADII)
+const vec3 ATOM_COLORS[5] = vec3[5]
 (
-	vec4(.988, .25, .25, 1.52),		// O
-	vec4(.12, .257, 1, 2.1),		// Si
-	vec4(.6, .6, .6, 3.1),			// Al
-	vec4(.0, .0, .0, 2.1),			// Al in the background
-	vec4(.6, .6, .6, 1.7)			// Carbon
+	vec3(.988, .25, .25),			// O
+	vec3(.12, .257, 1),			// Si
+	vec3(.6, .6, .6),			// Al
+	vec3(.0, .0, .0),			// Al in the background
+	vec3(.6, .6, .6)			// Carbon
 );
 
 // varyings
@@ -59,6 +68,11 @@ uniform vec3			clipBoxMax;
 // Macrocells structure
 uniform sampler3D		macrocells;
 
+// coarse occupancy level (0: block is empty)
+#ifdef SKIP_BLOCKS
+uniform sampler3D		blocks;
+#endif
+
 // indices (for indexed ref to atoms)
 #ifndef DIRECT_ATOMS_REF
 uniform sampler2D		indices;
@@ -67,6 +81,10 @@ uniform sampler2D		indices;
 // actual atom data
 uniform sampler2D		atoms;
 
+#ifdef COMPACT_ATOMS_REF
+uniform float			compactRange;		// quantization range of the compact entries (cells)
+#endif
+
 // volume data
 #ifdef VOLUME_RENDER
 uniform sampler3D		volume;
@@ -74,6 +92,10 @@ uniform sampler2D		tf;
 uniform float			dT;			// amount to step through the volume
 uniform float			colorScale;		// how much to scale opacity by
 
+#ifdef TF_SKIP
+uniform sampler3D		visible;		// 0: TF is transparent over the macrocell's densities
+#endif
+
 // density color accumilated so far
 vec4 volumeColor		= vec4(0.0);
 
@@ -101,11 +123,14 @@ void dvr_sample(float v)
 }
 #endif
 
+// cell starts and indices come split in two floats (lo + hi * 65536), since
+// a float holds integers exactly only up to 2^24
 #ifndef DIRECT_ATOMS_REF
 int getIndex(int idx)
 {
 	int r = idx / indicesSqrt;
-	return int( texelFetch2D(indices, ivec2(idx - r*indicesSqrt, r), 0).x );
+	vec2 index = texelFetch2D(indices, ivec2(idx - r*indicesSqrt, r), 0).xy;
+	return int(index.x) + int(index.y) * 65536;
 }
 #endif
 
@@ -115,11 +140,22 @@ vec4 getAtom(int idx)
 	return texelFetch2D(atoms, ivec2(idx - r*atomsSqrt, r), 0);
 }
 
+#ifdef COMPACT_ATOMS_REF
+// position within the macrocell, quantized over [-compactRange, 1 + compactRange],
+// and the element index (normalized 16-bit texels)
+vec4 getCompactAtom(int idx, ivec3 macrocell)
+{
+	int r = idx / atomsSqrt;
+	vec4 q = texelFetch2D(atoms, ivec2(idx - r*atomsSqrt, r), 0);
+	return vec4(vec3(macrocell) - compactRange + q.xyz * (1.0 + 2.0 * compactRange), floor(q.w * 65535.0 + 0.5));
+}
+#endif
+
 bool getMacrocell(ivec3 macrocell, out int ballStart, out int ballEnd)
 {
 	vec3 cell = texelFetch3D(macrocells, macrocell, 0).xyz;
-	ballStart = int(cell.x);
-	ballEnd = int(cell.y) + ballStart;
+	ballStart = int(cell.x) + int(cell.y) * 65536;
+	ballEnd = int(cell.z) + ballStart;
 	
 	return ballStart != ballEnd;
 }
@@ -213,6 +249,37 @@ void main()
 	#endif
 	)
 	{	
+	#ifdef SKIP_BLOCKS
+		ivec3 block = macrocell / BLOCK_SIZE;
+		if (texelFetch3D(blocks, block, 0).x == 0.0)
+		{
+			// leave the empty block through the face the ray exits from
+			// (blocks on the far sides may stick out of the grid)
+			ivec3 blockMin = block * BLOCK_SIZE;
+			ivec3 blockEnd = min(blockMin + BLOCK_SIZE, imaxDomain + 1);
+			vec3 tMax = tenter + ( vec3(blockMin + rayDirStep * (blockEnd - blockMin)) - intersect ) * inv_ray;
+			float tnext = min(tMax.x, min(tMax.y, tMax.z));
+			ivec3 exitAxis = ivec3(equal(vec3(tnext), tMax));
+			
+			intersect = origin + ray * tnext;
+			tenter = tnext;
+			
+			// first macrocell past the block
+			ivec3 inside = clamp(ivec3(intersect), blockMin, blockEnd - 1);
+			ivec3 past = blockMin - 1 + rayDirStep * (blockEnd - blockMin + 1);
+			macrocell = inside * (1 - exitAxis) + past * exitAxis;
+			
+			if (any(greaterThan(macrocell, imaxDomain)) || any(lessThan(macrocell, ivec3(0))))
+			{
+				#ifdef VOLUME_RENDER
+					gl_FragColor = volumeColor;
+				#endif
+				break;
+			}
+			continue;
+		}
+	#endif
+		
 		int b, count;
 		bool dontSkip = getMacrocell(macrocell, b, count);
 	#ifdef SKIP_EMPTY
@@ -223,14 +290,17 @@ void main()
 
 			for (; b < count; b++)
 			{		
-			#ifdef DIRECT_ATOMS_REF
+			#if defined(COMPACT_ATOMS_REF)
+				vec4 atom = getCompactAtom(b, macrocell);
+			#elif defined(DIRECT_ATOMS_REF)
 				vec4 atom = getAtom(b);
 			#else
 				vec4 atom = getAtom( getIndex(b) );
 			#endif
 				
 				// get atom type / information
-				vec4 atomType = ATOM_DATA[ int(atom.w) ];
+				int type = int(atom.w);
+				vec4 atomType = vec4(ATOM_COLORS[type], ATOM_RADII[type]);
 				atomType.w *= atomScale;
 				atomType.w *= atomType.w;
 	
@@ -275,6 +345,11 @@ void main()
 		}
 		
 		{
+		#ifdef TF_SKIP
+			ivec3 cellLeft = macrocell;
+			float tcell = tenter;
+		#endif
+		
 			// figure out next macrocell and tnext
 			vec3 tMax = tenter + ( vec3(rayDirStep + macrocell) - intersect ) * inv_ray;
 			float tnext = min(tMax.x, min(tMax.y, tMax.z));
@@ -291,6 +366,18 @@ void main()
 		#endif
 			{
 				float tvstop = hasBallIntersect > 0 ? T : tnext;
+			#ifdef TF_SKIP
+				if (texelFetch3D(visible, cellLeft, 0).x == 0.0)
+				{
+					// take the samples left over from before the macrocell, 
+					// then step over it
+					for (; tvnext < min(tvstop, tcell) && volumeColor.a < 1.0; tvnext += dT) {
+						dvr_sample( sampleVolume(origin + ray * tvnext) );
+					}
+					tvnext += dT * max(0.0, ceil((tvstop - tvnext) / dT));
+				}
+				else
+			#endif
 				for (;;)
 				{
 					dvr_sample( sampleVolume(origin + ray * tvnext) );
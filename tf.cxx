@@ -42,6 +42,7 @@ TransferFunction::TransferFunction(string filename, bool _loadToGPU)
 	callback = NULL;
 	interpTarget = NULL;
 	interpAlpha = 0.0f;
+	version = 0;
 	
 	
 	if (filename.length() == 0 || !load(filename))
@@ -62,6 +63,7 @@ TransferFunction::TransferFunction(const TransferFunction & rhs)
 	callback = NULL;
 	interpTarget = NULL;
 	interpAlpha = 0.0f;
+	version = 0;
 
 	this->points = rhs.points;	
 }
@@ -434,8 +436,42 @@ void TransferFunction::tick(float dT)
 	this->upload_GLSL(false);
 }
 
+float TransferFunction::opacity_at(const vector<TFPoint> & points, float v)
+{
+	// (points dragged past each other overlap, take the most opaque)
+	float alpha = 0.0f;
+	for (int i = 1; i < points.size(); i++)
+	{
+		const TFPoint & p0 = points[i-1];
+		const TFPoint & p1 = points[i];
+		if (v >= min(p0.value, p1.value) && v <= max(p0.value, p1.value))
+		{
+			const float len = p1.value - p0.value;
+			const float a = len != 0.0f ? (v - p0.value) / len : 0.0f;
+			alpha = max(alpha, (1.0f - a) * p0.color.a() + a * p1.color.a());
+		}
+	}
+	return alpha;
+}
+
+void TransferFunction::getOpacityTable(vector<float> & opacity) const
+{
+	const int n = TF_TEX_WIDTH;
+	opacity.resize(n);
+	for (int b = 0; b < n; b++)
+	{
+		const float v = (b + 0.5f) / n;
+		opacity[b] = opacity_at(points, v);
+		if (interpTarget) {
+			opacity[b] = max(opacity[b], opacity_at(interpTarget->points, v));
+		}
+	}
+}
+
 void TransferFunction::upload_GLSL(bool enableCallback)
 {
+	version++;
+
 	if (loadToGPU) 
 	{
 		tfFB.bind();
@@ -73,6 +73,13 @@ public:
 	// return the texture ID of the rendered transfer function
 	// so that we can bind it to the shader
 	GLuint getTFTex() { return tfFB.getTexture(); }
+	
+	// opacity of every texel of the TF texture, over the normalized value range
+	// (while interpolating, the larger of the two TFs)
+	void getOpacityTable(vector<float> & opacity) const;
+	
+	// changes every time the TF is re-rendered
+	unsigned int getVersion() const { return version; }
 
 	// updates the color of the currently selected point
 	void updatePointColor( Color c );
@@ -90,6 +97,9 @@ private:
 	vec2 mapPoint(float u, float v);
 	void upload_GLSL(bool enableCallback = true);
 	
+	// opacity of the points at normalized value v (0 outside of them)
+	static float opacity_at(const vector<TFPoint> & points, float v);
+	
 	// interpolation target
 	float interpAlpha;
 	const TransferFunction * interpTarget;
@@ -106,6 +116,7 @@ private:
 	bool				texInited;
 	bool				loadToGPU;
 	bool				hasGPUData;
+	unsigned int			version;
 	
 	// what's being picked
 	int				pickedPoint;
@@ -0,0 +1,151 @@
+/* -----------------------------------------------
+ * Super nanovol
+ * Khairi Reda, 2013
+ * Electronic Visualization Laboratory
+ * www.evl.uic.edu/kreda
+ *
+ * GPL v2 License:
+ * http://www.gnu.org/licenses/gpl-2.0.html
+ * trajectory.cxx
+ *
+ * -----------------------------------------------
+ */
+
+#include <iostream>
+#include <fstream>
+#include <string.h>
+#include <sys/stat.h>
+#include "trajectory.h"
+#include "fast_io.h"
+#include "Timer.h"
+
+bool FrameIndex::open(const string & trajectoryFile)
+{
+	offsets.clear();
+
+	struct stat st;
+	if (stat(trajectoryFile.c_str(), &st) != 0)
+	{
+		cerr << "Could not open trajectory: " << trajectoryFile << endl;
+		return false;
+	}
+
+	const string indexFile = trajectoryFile + ".frames";
+	if (load(indexFile, st.st_size, st.st_mtime)) {
+		return true;
+	}
+
+	Timer timer;
+	timer.start();
+	cout << "Indexing frames of " << trajectoryFile << "..." << flush;
+	if (!scan(trajectoryFile)) {
+		return false;
+	}
+	cout << " " << frameCount() << " frames (" << timer.getElapsedTimeInSec() << " sec)." << endl;
+
+	if (!save(indexFile, st.st_size, st.st_mtime)) {
+		cerr << "Warning: could not write frame index " << indexFile << endl;
+	}
+	return true;
+}
+
+bool FrameIndex::load(const string & indexFile, uint64_t fileSize, int64_t fileMTime)
+{
+	ifstream input(indexFile.c_str(), ios::binary);
+	if (!input.is_open()) {
+		return false;
+	}
+
+	FrameIndexHeader header;
+	input.read( (char *) &header, sizeof(header) );
+	if (	!input.good() ||
+		memcmp(header.magic, FRAME_INDEX_MAGIC, sizeof(FRAME_INDEX_MAGIC)) != 0 ||
+		header.version != FRAME_INDEX_VERSION ||
+		header.headerSize != sizeof(FrameIndexHeader)
+	)
+	{
+		return false;
+	}
+
+	// stale index?
+	if (header.fileSize != fileSize || header.fileMTime != fileMTime) {
+		return false;
+	}
+
+	offsets.resize(header.frameCount + 1);
+	input.read( (char *) &offsets[0], offsets.size() * sizeof(uint64_t) );
+	if (!input.good())
+	{
+		offsets.clear();
+		return false;
+	}
+	return true;
+}
+
+bool FrameIndex::save(const string & indexFile, uint64_t fileSize, int64_t fileMTime) const
+{
+	FrameIndexHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, FRAME_INDEX_MAGIC, sizeof(FRAME_INDEX_MAGIC));
+	header.version		= FRAME_INDEX_VERSION;
+	header.headerSize	= sizeof(FrameIndexHeader);
+	header.fileSize		= fileSize;
+	header.fileMTime	= fileMTime;
+	header.frameCount	= frameCount();
+
+	ofstream output(indexFile.c_str(), ios::binary);
+	if (!output.is_open()) {
+		return false;
+	}
+	output.write( (const char *) &header, sizeof(header) );
+	output.write( (const char *) &offsets[0], offsets.size() * sizeof(uint64_t) );
+	output << flush;
+	return output.good();
+}
+
+// Every frame is an atom count line, a comment line (the extended XYZ
+// properties) and that many atom lines. Frames are found by hopping from
+// one count line to the next, so only newlines are looked at in between.
+bool FrameIndex::scan(const string & trajectoryFile)
+{
+	MappedFile file;
+	if (!file.open(trajectoryFile.c_str())) {
+		cerr << "Could not open trajectory: " << trajectoryFile << endl;
+		return false;
+	}
+
+	const char * begin = file.data();
+	const char * end = begin + file.size();
+	const char * p = begin;
+
+	while (p < end)
+	{
+		// blank lines between frames
+		const char * lineEnd = skip_line(p, end);
+		const char * q = skip_blanks(p, lineEnd);
+		if (q == lineEnd || *q == '\n')
+		{
+			p = lineEnd;
+			continue;
+		}
+
+		long npts;
+		if (!parse_long(p, lineEnd, npts) || npts < 0)
+		{
+			cerr << "\nInvalid atom count at byte " << (p - begin) << " of " << trajectoryFile << endl;
+			offsets.clear();
+			return false;
+		}
+
+		offsets.push_back(p - begin);
+		p = skip_lines(lineEnd, end, 1 + npts);
+	}
+
+	if (offsets.empty())
+	{
+		cerr << "\nNo frames in " << trajectoryFile << endl;
+		return false;
+	}
+	offsets.push_back(file.size());
+	return true;
+}
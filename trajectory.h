@@ -0,0 +1,64 @@
+/* -----------------------------------------------
+ * Super nanovol
+ * Khairi Reda, 2013
+ * Electronic Visualization Laboratory
+ * www.evl.uic.edu/kreda
+ *
+ * GPL v2 License:
+ * http://www.gnu.org/licenses/gpl-2.0.html
+ * trajectory.h
+ *
+ * Frame index of multi-frame (extended) XYZ
+ * trajectory files. The index is cached next to
+ * the trajectory in a sidecar <file>.frames:
+ *   FrameIndexHeader
+ *   frame offsets	(frameCount+1 uint64, the last
+ *			 one is the end of the last frame)
+ * -----------------------------------------------
+ */
+
+#ifndef _TRAJECTORY_H___
+#define _TRAJECTORY_H___
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+static const char		FRAME_INDEX_MAGIC[8]	= {'S', 'N', 'V', 'F', 'R', 'A', 'M', 'E'};
+static const uint32_t		FRAME_INDEX_VERSION	= 1;
+
+struct FrameIndexHeader
+{
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	headerSize;
+
+	// the trajectory the index was built from
+	uint64_t	fileSize;
+	int64_t		fileMTime;
+
+	uint64_t	frameCount;
+};
+
+class FrameIndex
+{
+public:
+	// Loads the index from the sidecar if it matches the trajectory's size and
+	// modification time, otherwise scans the trajectory and (re)writes the sidecar
+	bool open(const string & trajectoryFile);
+
+	size_t frameCount() const { return offsets.empty() ? 0 : offsets.size() - 1; }
+	uint64_t frameOffset(size_t frame) const { return offsets[frame]; }
+	uint64_t frameLength(size_t frame) const { return offsets[frame + 1] - offsets[frame]; }
+
+private:
+	bool load(const string & indexFile, uint64_t fileSize, int64_t fileMTime);
+	bool save(const string & indexFile, uint64_t fileSize, int64_t fileMTime) const;
+	bool scan(const string & trajectoryFile);
+
+	vector<uint64_t>	offsets;
+};
+
+#endif
@@ -0,0 +1,216 @@
+/* -----------------------------------------------
+ * Super nanovol
+ * Khairi Reda, 2013
+ * Electronic Visualization Laboratory
+ * www.evl.uic.edu/kreda
+ *
+ * GPL v2 License:
+ * http://www.gnu.org/licenses/gpl-2.0.html
+ * traversal.cxx
+ *
+ * -----------------------------------------------
+ */
+
+#include <math.h>
+#include <algorithm>
+#include "traversal.h"
+
+void TraversalStats::add(const TraversalStats & s)
+{
+	rays		+= s.rays;
+	hits		+= s.hits;
+	cellsVisited	+= s.cellsVisited;
+	blocksSkipped	+= s.blocksSkipped;
+	leaps		+= s.leaps;
+	nodesVisited	+= s.nodesVisited;
+	atomsTested	+= s.atomsTested;
+}
+
+void shaderRadii(float scale, float radius[8])
+{
+	for (int i = 0; i < 8; i++) {
+		radius[i] = 0.0f;
+	}
+	for (int e = ELEMENT_COUNT - 1; e >= 0; e--)
+	{
+		const AtomData & d = lookUpElement(e);
+		if (d.shader_index >= 0 && d.shader_index < 8) {
+			radius[d.shader_index] = d.vdw_radius * scale;
+		}
+	}
+}
+
+void shaderRadii2(float scale, float radius2[8])
+{
+	shaderRadii(scale, radius2);
+	for (int i = 0; i < 8; i++) {
+		radius2[i] *= radius2[i];
+	}
+}
+
+MacrocellTraversal::MacrocellTraversal(const Macrocells & _mc): mc(_mc)
+{
+	gridDim = mc.getGridDim();
+
+	// same radii the builder used, scaled to grid space
+	shaderRadii2(mc.getAtomScale() * mc.getVPA(), radius2);
+}
+
+void MacrocellTraversal::intersect_cell(const Macrocell & cell, const vec3f & origin, const vec3f & ray, float & T, TraversalStats & stats) const
+{
+	const unsigned int * indices = mc.getIndices();
+	const gpuAtom * atoms = mc.getGPUAtoms();
+
+	stats.atomsTested += cell.ballCount;
+	for (uint64_t b = cell.ballStart; b < cell.ballStart + cell.ballCount; b++)
+	{
+		const gpuAtom & atom = atoms[ indices[b] ];
+		intersectSphere(atom, radius2[ int(atom.index) ], origin, ray, T);
+	}
+}
+
+bool MacrocellTraversal::leave_box(const int lo[3], const int hi[3], const vec3f & origin, const vec3f & ray, 
+	const vec3f & invRay, const int step[3], int cell[3]) const
+{
+	// face the ray leaves through
+	float tnext = TRAVERSAL_MISS;
+	int axis = 0;
+	for (int a = 0; a < 3; a++)
+	{
+		if (ray[a] == 0.0f) continue;
+		const int boundary = step[a] > 0 ? hi[a] : lo[a];
+		const float t = (boundary - origin[a]) * invRay[a];
+		if (t < tnext)
+		{
+			tnext = t;
+			axis = a;
+		}
+	}
+
+	// first macrocell past the box
+	for (int a = 0; a < 3; a++)
+	{
+		if (a == axis) {
+			cell[a] = step[a] > 0 ? hi[a] : lo[a] - 1;
+		}
+		else {
+			cell[a] = max(lo[a], min(hi[a] - 1, (int) floor(origin[a] + ray[a] * tnext)));
+		}
+	}
+	return cell[axis] >= 0 && cell[axis] < gridDim[axis];
+}
+
+float MacrocellTraversal::trace(const vec3f & origin, const vec3f & ray, TRAVERSAL_MODE mode, TraversalStats & stats, bool closestHit) const
+{
+	stats.rays++;
+
+	// where the ray enters and leaves the grid
+	float tenter = 0.0f, texit = TRAVERSAL_MISS;
+	vec3f invRay;
+	for (int a = 0; a < 3; a++)
+	{
+		if (ray[a] == 0.0f)
+		{
+			if (origin[a] < 0.0f || origin[a] > gridDim[a]) {
+				return TRAVERSAL_MISS;
+			}
+			invRay[a] = TRAVERSAL_MISS;
+			continue;
+		}
+		invRay[a] = 1.0f / ray[a];
+		float t0 = (0.0f - origin[a]) * invRay[a];
+		float t1 = (gridDim[a] - origin[a]) * invRay[a];
+		tenter = max(tenter, min(t0, t1));
+		texit = min(texit, max(t0, t1));
+	}
+	if (tenter > texit) {
+		return TRAVERSAL_MISS;
+	}
+
+	int cell[3], step[3];
+	for (int a = 0; a < 3; a++)
+	{
+		cell[a] = max(0, min(gridDim[a] - 1, (int) floor(origin[a] + ray[a] * tenter)));
+		step[a] = ray[a] >= 0.0f ? 1 : -1;
+	}
+
+	const Grid3<Macrocell> & cells = mc.getMacrocells();
+	const Grid3<unsigned char> & blocks = mc.getBlocks();
+	const Grid3<unsigned char> & distances = mc.getDistances();
+	float T = TRAVERSAL_MISS;
+
+	for (;;)
+	{
+		if (mode == TRAVERSE_BLOCKS)
+		{
+			int block[3] = { cell[0] / MC_BLOCK_SIZE, cell[1] / MC_BLOCK_SIZE, cell[2] / MC_BLOCK_SIZE };
+			if (!blocks.get_data(block[0], block[1], block[2]))
+			{
+				stats.blocksSkipped++;
+
+				// blocks on the far sides may stick out of the grid
+				int lo[3], hi[3];
+				for (int a = 0; a < 3; a++)
+				{
+					lo[a] = block[a] * MC_BLOCK_SIZE;
+					hi[a] = min(lo[a] + MC_BLOCK_SIZE, gridDim[a]);
+				}
+				if (!leave_box(lo, hi, origin, ray, invRay, step, cell)) {
+					break;
+				}
+				continue;
+			}
+		}
+		else if (mode == TRAVERSE_LEAP)
+		{
+			const int d = distances.get_data(cell[0], cell[1], cell[2]);
+			if (d > 0)
+			{
+				stats.leaps++;
+				
+				// every cell closer than d is empty
+				int lo[3], hi[3];
+				for (int a = 0; a < 3; a++)
+				{
+					lo[a] = max(0, cell[a] - (d - 1));
+					hi[a] = min(gridDim[a], cell[a] + d);
+				}
+				if (!leave_box(lo, hi, origin, ray, invRay, step, cell)) {
+					break;
+				}
+				continue;
+			}
+		}
+
+		stats.cellsVisited++;
+		intersect_cell(cells.get_data(cell[0], cell[1], cell[2]), origin, ray, T, stats);
+
+		// where the ray leaves this macrocell
+		float tnext = TRAVERSAL_MISS;
+		int axis = 0;
+		for (int a = 0; a < 3; a++)
+		{
+			if (ray[a] == 0.0f) continue;
+			const float t = (cell[a] + (step[a] > 0 ? 1 : 0) - origin[a]) * invRay[a];
+			if (t < tnext)
+			{
+				tnext = t;
+				axis = a;
+			}
+		}
+		if (T < TRAVERSAL_MISS && (!closestHit || T <= tnext)) {
+			break;
+		}
+
+		// next macrocell
+		cell[axis] += step[axis];
+		if (cell[axis] < 0 || cell[axis] >= gridDim[axis]) {
+			break;
+		}
+	}
+
+	if (T < TRAVERSAL_MISS) {
+		stats.hits++;
+	}
+	return T;
+}
@@ -0,0 +1,104 @@
+/* -----------------------------------------------
+ * Super nanovol
+ * Khairi Reda, 2013
+ * Electronic Visualization Laboratory
+ * www.evl.uic.edu/kreda
+ *
+ * GPL v2 License:
+ * http://www.gnu.org/licenses/gpl-2.0.html
+ * traversal.h
+ *
+ * CPU version of the macrocell ray traversal in
+ * balls.frag, for measuring how acceleration
+ * structures change the work done per ray.
+ * Rays are in grid space (1 unit = 1 macrocell).
+ * -----------------------------------------------
+ */
+
+#ifndef _TRAVERSAL_H___
+#define _TRAVERSAL_H___
+
+#include <math.h>
+#include "macrocells.h"
+
+static const float TRAVERSAL_MISS = 9999999.0f;
+
+// how empty space is stepped over
+enum TRAVERSAL_MODE
+{
+	TRAVERSE_CELLS,		// every macrocell along the ray
+	TRAVERSE_BLOCKS,	// over empty blocks of the occupancy level
+	TRAVERSE_LEAP,		// out of the empty cube around a cell (distance field)
+};
+
+struct TraversalStats
+{
+	size_t		rays;
+	size_t		hits;
+	size_t		cellsVisited;		// macrocells whose atom lists were looked at
+	size_t		blocksSkipped;		// empty blocks stepped over
+	size_t		leaps;			// distance field leaps
+	size_t		nodesVisited;		// BVH nodes (AtomBVH)
+	size_t		atomsTested;		// ray-sphere tests
+
+	TraversalStats(): rays(0), hits(0), cellsVisited(0), blocksSkipped(0), leaps(0), nodesVisited(0), atomsTested(0) {}
+	
+	// macrocells visited plus empty space steps
+	size_t steps() const { return cellsVisited + blocksSkipped + leaps; }
+	void add(const TraversalStats & s);
+};
+
+// radius by shader index, from ELEMENT_TABLE (0 for unused indices); the
+// balls shader gets the same table (ATOM_RADII), so the CPU traversals and
+// the GPU hit the same spheres
+void shaderRadii(float scale, float radius[8]);
+
+// squared radius (grid space, scale = atomScale * vpa) by shader index
+void shaderRadii2(float scale, float radius2[8]);
+
+// ray-sphere test from balls.frag (ray is unit length): lowers T to where the
+// ray enters the sphere if that is closer
+static inline void intersectSphere(const gpuAtom & atom, float r2, const vec3f & origin, const vec3f & ray, float & T)
+{
+	vec3f L(atom.x - origin.x(), atom.y - origin.y(), atom.z - origin.z());
+	float Tca = dot(L, ray);
+	float dd = dot(L, L) - Tca*Tca;
+	if (Tca >= 0 && dd <= r2)
+	{
+		float newT = Tca - sqrt(r2 - dd);
+		if (newT < T) {
+			T = newT;
+		}
+	}
+}
+
+class MacrocellTraversal
+{
+public:
+	MacrocellTraversal(const Macrocells & macrocells);
+
+	// Walks the ray through the macrocells and returns the T of the first atom hit
+	// (TRAVERSAL_MISS if none). Like the shader, it stops at the first macrocell
+	// with a hit. With closestHit, only hits up to where the ray leaves that
+	// macrocell count (like PRECISE_GEOMETRY); farther ones are kept until the
+	// walk reaches their macrocell, so the hit returned is the closest one.
+	float trace(const vec3f & origin, const vec3f & ray, TRAVERSAL_MODE mode, TraversalStats & stats, bool closestHit = false) const;
+
+private:
+	// moves cell to the first macrocell past the box of cells [lo, hi) on the
+	// ray's way out; false if that is outside the grid
+	bool leave_box(const int lo[3], const int hi[3], const vec3f & origin, const vec3f & ray, 
+		const vec3f & invRay, const int step[3], int cell[3]) const;
+	
+
+	// tests the atoms of a macrocell
+	void intersect_cell(const Macrocell & mc, const vec3f & origin, const vec3f & ray, float & T, TraversalStats & stats) const;
+
+	const Macrocells &		mc;
+	vec3i				gridDim;
+
+	// squared radius (grid space) by shader index
+	float				radius2[8];
+};
+
+#endif